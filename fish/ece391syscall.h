@@ -19,6 +19,33 @@ extern int32_t ece391_open (const uint8_t* filename);
 extern int32_t ece391_close (int32_t fd);
 extern int32_t ece391_getargs (uint8_t* buf, int32_t nbytes);
 extern int32_t ece391_vidmap (uint8_t** screen_start);
+extern int32_t ece391_set_quantum (uint32_t ticks, uint32_t scope);
+extern int32_t ece391_nice (int32_t increment);
+extern int32_t ece391_sleep (uint32_t ms);
+extern int32_t ece391_fork (void);
+
+/* Nonzero if system calls are made with sysenter rather than INT $0x80.
+   Set at startup if the CPU supports it; may be cleared to force INT $0x80. */
+extern int32_t ece391_use_sysenter;
+
+/* Kernel data mapped read-only into every program, readable without a
+   system call. Use ece391_vdata_read (ece391support.h) to get a consistent
+   copy: the kernel keeps seq odd while it is updating the page. */
+#define ECE391_VDATA_ADDR    0x8401000
+#define ECE391_VDATA_VERSION 1
+
+typedef struct ece391_vdata {
+    uint32_t seq;
+    uint32_t version;       /* ECE391_VDATA_VERSION */
+    uint32_t tick_hz;       /* Ticks per second */
+    uint32_t ticks;         /* Ticks since boot */
+    uint32_t tsc_stamp;     /* Low half of the TSC at the start of that tick */
+    uint32_t tsc_khz;       /* TSC cycles per ms, or 0 if unknown */
+    uint32_t num_cpus;      /* CPUs online */
+    uint32_t nr_running;    /* Runnable processes */
+    uint32_t switches;      /* Context switches since boot */
+    uint32_t idle_ticks;    /* Ticks the CPUs spent idle, summed */
+} ece391_vdata_t;
 
 #endif /* ECE391SYSCALL_H */
 
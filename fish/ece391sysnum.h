@@ -11,5 +11,9 @@
 #define SYS_VIDMAP  8
 #define SYS_SET_HANDLER  9
 #define SYS_SIGRETURN  10
+#define SYS_SET_QUANTUM  11
+#define SYS_NICE  12
+#define SYS_SLEEP  13
+#define SYS_FORK  14
 
 #endif /* ECE391SYSNUM_H */
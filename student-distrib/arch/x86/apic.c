@@ -0,0 +1,264 @@
+#include <arch/x86/apic.h>
+#include <arch/x86/cpu.h>
+#include <arch/x86/io.h>
+#include <drivers/pit.h>
+#include <lib/lib.h>
+
+/*
+ * Local APIC. Every CPU has one at the same physical address; each CPU only ever sees its own.
+ * The kernel uses it to start the other CPUs, to send them inter-processor interrupts and to
+ * time their timeslices. Device interrupts arrive through it too: from the I/O APIC, or from the
+ * 8259 on the boot CPU's LINT0 if there is none (see irq.c).
+ */
+
+/* Upper bound on the calibration, in reads of the PIT's gate port (about a microsecond each) */
+#define LAPIC_CALIBRATE_TIMEOUT 1000000
+
+/* MMIO base of the local APIC (identity mapped), or NULL if there is none */
+static volatile uint32_t *lapic = NULL;
+
+/* Timer counts per scheduler tick, or 0 if the timer hasn't been calibrated */
+static uint32_t timer_counts_per_tick = 0;
+
+/**
+ * lapic_read
+ * Reads a local APIC register.
+ *
+ * @param reg   Byte offset of the register
+ *
+ * @return      The register's value
+ */
+static uint32_t lapic_read(uint32_t reg) {
+    return lapic[reg / sizeof(uint32_t)];
+}
+
+/**
+ * lapic_write
+ * Writes a local APIC register.
+ *
+ * @param reg   Byte offset of the register
+ * @param val   The value to write
+ */
+static void lapic_write(uint32_t reg, uint32_t val) {
+    lapic[reg / sizeof(uint32_t)] = val;
+}
+
+/**
+ * lapic_wait_icr
+ * Waits until the previous IPI has been accepted, so the interrupt command register can be reused.
+ */
+static void lapic_wait_icr() {
+    while(lapic_read(LAPIC_REG_ICR_LOW) & LAPIC_ICR_PENDING) {
+        cpu_relax();
+    }
+}
+
+/**
+ * lapic_send
+ * Sends an IPI through the interrupt command register.
+ *
+ * @param apic_id   Destination APIC ID (ignored with a destination shorthand)
+ * @param command   Low half of the command: vector, delivery mode and flags
+ */
+static void lapic_send(uint8_t apic_id, uint32_t command) {
+    lapic_wait_icr();
+    lapic_write(LAPIC_REG_ICR_HIGH, (uint32_t) apic_id << LAPIC_ICR_DEST_SHIFT);
+    lapic_write(LAPIC_REG_ICR_LOW, command);
+}
+
+/**
+ * lapic_detect
+ * Checks whether the CPU has a local APIC and finds its registers. Paging must still be off, or
+ * the registers must be identity mapped before they are used.
+ *
+ * @return      The physical address of the local APIC, or 0 if there is none
+ */
+uint32_t lapic_detect() {
+    uint32_t eax, ebx, ecx, edx;
+    uint32_t base;
+
+    cpuid(CPUID_FEATURES, eax, ebx, ecx, edx);
+    if(!(edx & CPUID_EDX_APIC)) return 0;
+
+    rdmsr(MSR_APIC_BASE, base);
+    base &= MSR_APIC_BASE_ADDR_MASK;
+
+    lapic = (volatile uint32_t*) base;
+    return base;
+}
+
+/**
+ * lapic_get_base
+ * Get the physical address of the local APIC found by lapic_detect.
+ *
+ * @return      The address, or 0 if there is none
+ */
+uint32_t lapic_get_base() {
+    return (uint32_t) lapic;
+}
+
+/**
+ * lapic_init
+ * Enables the calling CPU's local APIC. Called once on every CPU.
+ *
+ * @param bsp   1 on the boot CPU, which takes 8259 interrupts (ExtINT) and NMIs on its LINT
+ *              pins; 0 on the others, which only get IPIs and their local timer
+ */
+void lapic_init(uint8_t bsp) {
+    uint32_t base;
+
+    rdmsr(MSR_APIC_BASE, base);
+    wrmsr(MSR_APIC_BASE, base | MSR_APIC_BASE_ENABLE);
+
+    // Accept every interrupt. The timer stays masked until it has been calibrated, and then only
+    // fires once lapic_timer_set arms it
+    lapic_write(LAPIC_REG_TPR, 0);
+    lapic_write(LAPIC_REG_TIMER_INIT, 0);
+    lapic_write(LAPIC_REG_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_16);
+    lapic_write(LAPIC_REG_LVT_TIMER, timer_counts_per_tick ? LAPIC_TIMER_VEC : LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_REG_LVT_ERROR, LAPIC_LVT_MASKED);
+
+    if(bsp) {
+        lapic_write(LAPIC_REG_LVT_LINT0, LAPIC_DELIVERY_EXTINT);
+        lapic_write(LAPIC_REG_LVT_LINT1, LAPIC_DELIVERY_NMI);
+    } else {
+        lapic_write(LAPIC_REG_LVT_LINT0, LAPIC_LVT_MASKED);
+        lapic_write(LAPIC_REG_LVT_LINT1, LAPIC_LVT_MASKED);
+    }
+
+    // The error status register is cleared by writing it (twice, on some models)
+    lapic_write(LAPIC_REG_ESR, 0);
+    lapic_write(LAPIC_REG_ESR, 0);
+    lapic_write(LAPIC_REG_EOI, 0);
+
+    lapic_write(LAPIC_REG_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VEC);
+}
+
+/**
+ * lapic_id
+ * Get the APIC ID of the calling CPU.
+ *
+ * @return      Its APIC ID
+ */
+uint8_t lapic_id() {
+    return lapic_read(LAPIC_REG_ID) >> LAPIC_ID_SHIFT;
+}
+
+/**
+ * lapic_eoi
+ * Acknowledges the interrupt the calling CPU's local APIC delivered last. A single MMIO write, so
+ * it is also how I/O APIC interrupts are acknowledged; 8259 interrupts need send_eoi instead.
+ */
+void lapic_eoi() {
+    lapic_write(LAPIC_REG_EOI, 0);
+}
+
+/**
+ * lapic_send_ipi
+ * Interrupts one other CPU.
+ *
+ * @param apic_id   APIC ID of the CPU
+ * @param vector    Interrupt vector to raise on it
+ */
+void lapic_send_ipi(uint8_t apic_id, uint8_t vector) {
+    lapic_send(apic_id, LAPIC_DELIVERY_FIXED | LAPIC_ICR_ASSERT | vector);
+}
+
+/**
+ * lapic_send_ipi_others
+ * Interrupts every CPU except the calling one.
+ *
+ * @param vector    Interrupt vector to raise on them
+ */
+void lapic_send_ipi_others(uint8_t vector) {
+    lapic_send(0, LAPIC_ICR_ALL_BUT_SELF | LAPIC_DELIVERY_FIXED | LAPIC_ICR_ASSERT | vector);
+}
+
+/**
+ * lapic_send_init
+ * Resets another CPU (INIT IPI, asserted and then deasserted as the MP specification describes).
+ * It then waits for a STARTUP IPI.
+ *
+ * @param apic_id   APIC ID of the CPU
+ */
+void lapic_send_init(uint8_t apic_id) {
+    lapic_send(apic_id, LAPIC_DELIVERY_INIT | LAPIC_ICR_LEVEL | LAPIC_ICR_ASSERT);
+    lapic_send(apic_id, LAPIC_DELIVERY_INIT | LAPIC_ICR_LEVEL);
+    lapic_wait_icr();
+}
+
+/**
+ * lapic_send_startup
+ * Starts a CPU that was reset with lapic_send_init. It begins executing in real mode at addr.
+ *
+ * @param apic_id   APIC ID of the CPU
+ * @param addr      Physical address of its startup code: 4 kB aligned and below 1 MB
+ */
+void lapic_send_startup(uint8_t apic_id, uint32_t addr) {
+    lapic_send(apic_id, LAPIC_DELIVERY_STARTUP | (addr >> 12));
+    lapic_wait_icr();
+}
+
+/**
+ * lapic_timer_calibrate
+ * Measures how fast the local timer counts, against PIT channel 2 (channel 0 belongs to pit.c).
+ * The local APICs share the bus clock, so the result holds for every CPU. Must be called with
+ * interrupts disabled, after lapic_init. If the PIT never finishes, the timer stays unused.
+ *
+ * @param hertz The tick length lapic_timer_set counts in (19 Hz to 1193182 Hz)
+ */
+void lapic_timer_calibrate(uint32_t hertz) {
+    uint32_t count = PIT_FREQUENCY / hertz;
+    uint8_t gate = inportb(PIT_CH2_GATE_PORT);
+    uint32_t elapsed;
+    uint32_t waited;
+
+    // Load channel 2 with the gate low, so it doesn't start counting yet, and keep the speaker quiet
+    outportb(PIT_CH2_GATE_PORT, gate & ~(PIT_CH2_GATE | PIT_CH2_SPEAKER));
+    outportb(PIT_CMD_REG_PORT, PIT_BINARY_VAL | PIT_CMD_MODE0 | PIT_CMD_RW_BOTH | PIT_CMD_COUNTER2);
+    outportb(PIT_CH2_DATA_PORT, (uint8_t) (count & LOW_EIGHT_BIT_BITMASK));
+    outportb(PIT_CH2_DATA_PORT, (uint8_t) ((count >> 8) & LOW_EIGHT_BIT_BITMASK));
+
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_REG_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_16);
+
+    // Start both, then wait for OUT2 to go high at the end of the PIT's countdown
+    outportb(PIT_CH2_GATE_PORT, (gate & ~PIT_CH2_SPEAKER) | PIT_CH2_GATE);
+    lapic_write(LAPIC_REG_TIMER_INIT, 0xFFFFFFFF);
+    for(waited = 0; !(inportb(PIT_CH2_GATE_PORT) & PIT_CH2_OUT) && waited < LAPIC_CALIBRATE_TIMEOUT; waited++) {
+        cpu_relax();
+    }
+    elapsed = 0xFFFFFFFF - lapic_read(LAPIC_REG_TIMER_CURRENT);
+
+    lapic_write(LAPIC_REG_TIMER_INIT, 0);
+    outportb(PIT_CH2_GATE_PORT, gate);
+
+    if(waited < LAPIC_CALIBRATE_TIMEOUT && elapsed != 0) {
+        timer_counts_per_tick = elapsed;
+        lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_TIMER_VEC);
+    }
+}
+
+/**
+ * lapic_timer_available
+ * Checks whether the local timer has been calibrated and can be armed.
+ *
+ * @return      1 if it can, 0 if not
+ */
+uint32_t lapic_timer_available() {
+    return timer_counts_per_tick != 0;
+}
+
+/**
+ * lapic_timer_set
+ * Arms the calling CPU's local timer to fire LAPIC_TIMER_VEC once, replacing whatever was armed.
+ *
+ * @param ticks Ticks (of the length given to lapic_timer_calibrate) until the interrupt, or 0 to
+ *              disarm the timer
+ */
+void lapic_timer_set(uint32_t ticks) {
+    if(ticks > 0xFFFFFFFF / timer_counts_per_tick) {
+        ticks = 0xFFFFFFFF / timer_counts_per_tick;
+    }
+    lapic_write(LAPIC_REG_TIMER_INIT, ticks * timer_counts_per_tick);
+}
@@ -0,0 +1,198 @@
+#include <arch/x86/fpu.h>
+#include <arch/x86/cpu.h>
+#include <arch/x86/task.h>
+#include <arch/x86/x86_desc.h>
+#include <lib/lib.h>
+
+/*
+ * Lazy FPU switching: a context switch only sets CR0.TS. The first FPU/SSE instruction
+ * the new process runs raises #NM, and only then are the registers of the previous owner
+ * saved and the new process's registers loaded. Processes that never touch the FPU never
+ * pay for it. Every CPU has its own FPU; a process never changes CPUs, so its registers can only
+ * be live in the FPU of its own CPU.
+ */
+
+/* The process whose registers are currently in each CPU's FPU, or NULL */
+static pcb_t *fpu_owner[SMP_MAX_CPUS];
+
+/* Whether we can use fxsave/fxrstor (needed for SSE registers), and SSE exceptions */
+static uint8_t fpu_has_fxsr = 0;
+static uint8_t fpu_has_sse = 0;
+
+/* Freshly initialized FPU state, given to a process the first time it uses the FPU */
+static fpu_state_t fpu_initial_state;
+
+static fpu_stats_t fpu_stats;
+
+/**
+ * fpu_save
+ * Saves the FPU (and SSE, if supported) registers.
+ *
+ * @param state     Area to save the registers into
+ */
+static void fpu_save(fpu_state_t *state) {
+    if(fpu_has_fxsr) {
+        asm volatile("fxsave %0" : "=m"(*state) : : "memory");
+    } else {
+        asm volatile("fnsave %0; fwait" : "=m"(*state) : : "memory");
+    }
+}
+
+/**
+ * fpu_restore
+ * Loads the FPU (and SSE, if supported) registers.
+ *
+ * @param state     Area to load the registers from
+ */
+static void fpu_restore(fpu_state_t *state) {
+    if(fpu_has_fxsr) {
+        asm volatile("fxrstor %0" : : "m"(*state) : "memory");
+    } else {
+        asm volatile("frstor %0" : : "m"(*state) : "memory");
+    }
+}
+
+/**
+ * fpu_init_cpu
+ * Enables the FPU and, if the CPU has them, SSE instructions for user programs on the calling CPU.
+ * Leaves CR0.TS set so that the first FPU instruction traps. fpu_init must have run on the boot CPU.
+ */
+void fpu_init_cpu() {
+    uint32_t cr0, cr4;
+
+    // Use the real FPU and report its errors as exceptions
+    read_cr0(cr0);
+    cr0 &= ~CR0_EM;
+    cr0 |= CR0_MP | CR0_NE | CR0_TS;
+    write_cr0(cr0);
+
+    // Tell the CPU we save SSE state on context switches, which turns SSE instructions on
+    if(fpu_has_fxsr) {
+        read_cr4(cr4);
+        cr4 |= CR4_OSFXSR;
+        if(fpu_has_sse) {
+            cr4 |= CR4_OSXMMEXCPT;
+        }
+        write_cr4(cr4);
+    }
+}
+
+/**
+ * fpu_init
+ * Finds out what the FPU supports and sets it up on the boot CPU.
+ */
+void fpu_init() {
+    uint32_t eax, ebx, ecx, edx;
+    uint32_t cr0;
+
+    cpuid(CPUID_FEATURES, eax, ebx, ecx, edx);
+    fpu_has_fxsr = (edx & CPUID_EDX_FXSR) != 0;
+    fpu_has_sse = (edx & CPUID_EDX_SSE) != 0;
+
+    fpu_init_cpu();
+
+    // Take a snapshot of a clean FPU to start every process with
+    clts();
+    asm volatile("fninit" : : : "memory");
+    fpu_save(&fpu_initial_state);
+
+    read_cr0(cr0);
+    write_cr0(cr0 | CR0_TS);
+}
+
+/**
+ * fpu_switch
+ * Called when a process is about to get the CPU. If its registers aren't the ones
+ * in the FPU, sets CR0.TS so that its first FPU instruction traps to fpu_handler.
+ *
+ * @param next      The process about to run
+ */
+void fpu_switch(pcb_t *next) {
+    uint32_t cr0;
+
+    if(next == fpu_owner[next->cpu]) {
+        clts();
+    } else {
+        read_cr0(cr0);
+        write_cr0(cr0 | CR0_TS);
+    }
+}
+
+/**
+ * fpu_release
+ * Throws away a process's FPU state, e.g. when it exits.
+ *
+ * @param pcb       The process whose FPU state is no longer needed
+ */
+void fpu_release(pcb_t *pcb) {
+    if(fpu_owner[pcb->cpu] == pcb) {
+        fpu_owner[pcb->cpu] = NULL;
+    }
+    pcb->fpu_used = 0;
+}
+
+/**
+ * fpu_fork
+ * Gives a forked child a copy of its parent's FPU registers.
+ *
+ * @param parent    The process that forked. Must be the current process.
+ * @param child     The new process
+ */
+void fpu_fork(pcb_t *parent, pcb_t *child) {
+    child->fpu_used = parent->fpu_used;
+    if(!parent->fpu_used) return;
+
+    if(fpu_owner[parent->cpu] == parent) {
+        // The parent's registers are live (and CR0.TS is clear, since it is running)
+        fpu_save(&child->fpu_state);
+
+        // fnsave reinitializes the FPU, so give the parent its registers back
+        if(!fpu_has_fxsr) {
+            fpu_restore(&child->fpu_state);
+        }
+        fpu_stats.saves++;
+    } else {
+        child->fpu_state = parent->fpu_state;
+    }
+}
+
+/**
+ * fpu_get_stats
+ * Reports how much work lazy FPU switching has done, on all CPUs together (the counters aren't
+ * locked, so they are approximate when several CPUs update them at once).
+ *
+ * @param stats     Filled in with the FPU statistics
+ */
+void fpu_get_stats(fpu_stats_t *stats) {
+    *stats = fpu_stats;
+}
+
+/**
+ * fpu_handler
+ * Handler for the "Device not available" exception, raised by the first FPU/SSE instruction
+ * after a context switch. Moves the FPU over to the current process.
+ */
+void fpu_handler() {
+    pcb_t *pcb = get_current_pcb();
+    pcb_t **owner = &fpu_owner[pcb->cpu];
+
+    clts();
+    fpu_stats.traps++;
+
+    if(*owner == pcb) return;
+
+    if(*owner != NULL) {
+        fpu_save(&(*owner)->fpu_state);
+        fpu_stats.saves++;
+    }
+
+    if(pcb->fpu_used) {
+        fpu_restore(&pcb->fpu_state);
+        fpu_stats.restores++;
+    } else {
+        fpu_restore(&fpu_initial_state);
+        pcb->fpu_used = 1;
+    }
+
+    *owner = pcb;
+}
@@ -0,0 +1,307 @@
+#include <arch/x86/frame.h>
+#include <arch/x86/spinlock.h>
+#include <lib/lib.h>
+
+/*
+ * Physical memory allocator. Free memory is managed as a buddy system of blocks from 4 kB
+ * (order 0) up to 4 MB (FRAME_MAX_ORDER): a block of order n is 2^n frames, aligned to its own
+ * size, and its buddy is the block it was split from. Freeing a block merges it with its buddy
+ * whenever that one is free too, so large blocks come back as soon as their pieces do.
+ * Free blocks are kept on one list per order, linked through the blocks themselves, so the
+ * allocator costs no memory apart from two small per-frame arrays.
+ * Single frames handed out to page tables are reference counted so that several page tables
+ * can share one copy-on-write.
+ */
+
+/* Marks a frame that doesn't start a free block in block_order */
+#define FRAME_NOT_FREE 0xFF
+
+/* Header stored at the start of every free block */
+typedef struct free_block_t {
+    uint32_t next;      // Physical address of the next free block of the same order, or 0
+    uint32_t prev;      // Physical address of the previous one, or 0 if this is the first
+} free_block_t;
+
+/* End of the highest range of memory in the pool */
+static uint32_t pool_end = 0;
+
+/* First free block of each order, or 0 if there is none */
+static uint32_t free_lists[FRAME_MAX_ORDER + 1];
+
+/* Order of the free block starting at each frame, or FRAME_NOT_FREE, indexed by frame number */
+static uint8_t block_order[FRAME_MAX_FRAMES];
+
+/* Number of page table entries pointing at each frame, indexed by frame number */
+static uint16_t frame_refs[FRAME_MAX_FRAMES];
+
+static frame_stats_t stats;
+
+/* Protects the free lists, the reference counts and the counters */
+static spinlock_t frame_lock = SPINLOCK_INIT;
+
+/**
+ * push_free_block
+ * Puts a block on the free list of its order.
+ *
+ * @param addr      Physical address of the block
+ * @param order     Its order
+ */
+static void push_free_block(uint32_t addr, uint32_t order) {
+    free_block_t *block = (free_block_t*) addr;
+
+    block->next = free_lists[order];
+    block->prev = 0;
+    if(block->next != 0) {
+        ((free_block_t*) block->next)->prev = addr;
+    }
+    free_lists[order] = addr;
+    block_order[addr / FRAME_SIZE] = order;
+
+    if(order == FRAME_MAX_ORDER) stats.free_large++;
+}
+
+/**
+ * remove_free_block
+ * Takes a block off the free list of its order.
+ *
+ * @param addr      Physical address of the block
+ * @param order     Its order
+ */
+static void remove_free_block(uint32_t addr, uint32_t order) {
+    free_block_t *block = (free_block_t*) addr;
+
+    if(block->prev != 0) {
+        ((free_block_t*) block->prev)->next = block->next;
+    } else {
+        free_lists[order] = block->next;
+    }
+    if(block->next != 0) {
+        ((free_block_t*) block->next)->prev = block->prev;
+    }
+    block_order[addr / FRAME_SIZE] = FRAME_NOT_FREE;
+
+    if(order == FRAME_MAX_ORDER) stats.free_large--;
+}
+
+/**
+ * free_block
+ * Returns a block to the free lists, merging it with its buddy for as long as the buddy is free.
+ * Interrupts must be off.
+ *
+ * @param addr      Physical address of the block
+ * @param order     Its order
+ */
+static void free_block(uint32_t addr, uint32_t order) {
+    while(order < FRAME_MAX_ORDER) {
+        uint32_t buddy = addr ^ (FRAME_SIZE << order);
+
+        if(buddy >= FRAME_PHYS_LIMIT || block_order[buddy / FRAME_SIZE] != order) break;
+
+        remove_free_block(buddy, order);
+        if(buddy < addr) addr = buddy;
+        order++;
+    }
+    push_free_block(addr, order);
+}
+
+/**
+ * frame_init
+ * Empties the pool. Memory is added to it with frame_add_region.
+ */
+void frame_init() {
+    int i;
+
+    pool_end = 0;
+    for(i = 0; i <= FRAME_MAX_ORDER; i++) {
+        free_lists[i] = 0;
+    }
+
+    memset(&stats, 0, sizeof(stats));
+    memset(block_order, FRAME_NOT_FREE, sizeof(block_order));
+    memset(frame_refs, 0, sizeof(frame_refs));
+}
+
+/**
+ * frame_add_region
+ * Adds a range of free physical memory to the pool, e.g. one entry of the bootloader's memory map.
+ * The range must be identity mapped (or paging must still be off), since the free lists are stored
+ * in the blocks. Ranges may be added in any order; neighbouring ones merge into larger blocks.
+ *
+ * @param start     Physical address of the range. Rounded up to a frame.
+ * @param end       Physical address just past the range. Rounded down to a frame and clamped to FRAME_PHYS_LIMIT.
+ */
+void frame_add_region(uint32_t start, uint32_t end) {
+    uint32_t flags;
+    uint32_t addr;
+
+    if(end > FRAME_PHYS_LIMIT) end = FRAME_PHYS_LIMIT;
+    start = (start + FRAME_SIZE - 1) & ~(FRAME_SIZE - 1);
+    end &= ~(FRAME_SIZE - 1);
+    if(start == 0) start = FRAME_SIZE;    // 0 means "no block" on the free lists
+    if(start >= end) return;
+
+    spin_lock_irqsave(&frame_lock, flags);
+
+    // Carve the range into the largest aligned blocks that fit
+    for(addr = start; addr < end; ) {
+        uint32_t order = FRAME_MAX_ORDER;
+
+        while((addr & ((FRAME_SIZE << order) - 1)) != 0 || end - addr < (FRAME_SIZE << order)) {
+            order--;
+        }
+
+        free_block(addr, order);
+        addr += FRAME_SIZE << order;
+    }
+
+    stats.total += (end - start) / FRAME_SIZE;
+    stats.free += (end - start) / FRAME_SIZE;
+    if(end > pool_end) pool_end = end;
+
+    spin_unlock_irqrestore(&frame_lock, flags);
+}
+
+/**
+ * frame_pool_end
+ * Get the end of the frame pool, i.e. how much physical memory the kernel has to map.
+ *
+ * @return      The physical address just past the highest frame
+ */
+uint32_t frame_pool_end() {
+    return pool_end;
+}
+
+/**
+ * frame_alloc_pages
+ * Allocates a block of 2^order contiguous frames, aligned to its size, splitting a larger block
+ * if there is no free block of that order. Its contents are undefined.
+ *
+ * @param order     Size of the block: 0 for 4 kB up to FRAME_MAX_ORDER for 4 MB
+ *
+ * @return          The physical address of the block, or 0 if no block that large is free
+ */
+uint32_t frame_alloc_pages(uint32_t order) {
+    uint32_t flags;
+    uint32_t addr = 0;
+    uint32_t found;
+
+    if(order > FRAME_MAX_ORDER) return 0;
+
+    spin_lock_irqsave(&frame_lock, flags);
+
+    for(found = order; found <= FRAME_MAX_ORDER; found++) {
+        if(free_lists[found] != 0) break;
+    }
+
+    if(found <= FRAME_MAX_ORDER) {
+        addr = free_lists[found];
+        remove_free_block(addr, found);
+
+        // Give back the upper halves until the block is the right size
+        while(found > order) {
+            found--;
+            push_free_block(addr + (FRAME_SIZE << found), found);
+        }
+
+        stats.free -= 1 << order;
+    }
+
+    spin_unlock_irqrestore(&frame_lock, flags);
+    return addr;
+}
+
+/**
+ * frame_free_pages
+ * Returns a block allocated with frame_alloc_pages.
+ *
+ * @param addr      Physical address of the block
+ * @param order     The order it was allocated with
+ */
+void frame_free_pages(uint32_t addr, uint32_t order) {
+    uint32_t flags;
+
+    spin_lock_irqsave(&frame_lock, flags);
+    free_block(addr, order);
+    stats.free += 1 << order;
+    spin_unlock_irqrestore(&frame_lock, flags);
+}
+
+/**
+ * frame_alloc
+ * Allocates a single frame for a page table entry. Its contents are undefined.
+ *
+ * @return      The physical address of the frame (with a reference count of 1), or 0 if memory is exhausted
+ */
+uint32_t frame_alloc() {
+    uint32_t addr = frame_alloc_pages(0);
+
+    if(addr != 0) {
+        frame_refs[addr / FRAME_SIZE] = 1;
+    }
+    return addr;
+}
+
+/**
+ * frame_get
+ * Adds a reference to a frame that is in use, e.g. when another page table starts sharing it.
+ *
+ * @param addr  Physical address of the frame
+ */
+void frame_get(uint32_t addr) {
+    uint32_t flags;
+
+    spin_lock_irqsave(&frame_lock, flags);
+    if(frame_refs[addr / FRAME_SIZE]++ == 1) {
+        stats.shared++;
+    }
+    spin_unlock_irqrestore(&frame_lock, flags);
+}
+
+/**
+ * frame_put
+ * Drops a reference to a frame from frame_alloc. The frame is freed once nobody uses it.
+ *
+ * @param addr  Physical address of the frame
+ */
+void frame_put(uint32_t addr) {
+    uint32_t flags;
+    uint16_t refs;
+
+    spin_lock_irqsave(&frame_lock, flags);
+
+    refs = --frame_refs[addr / FRAME_SIZE];
+    if(refs == 1) {
+        stats.shared--;
+    } else if(refs == 0) {
+        free_block(addr, 0);
+        stats.free++;
+    }
+
+    spin_unlock_irqrestore(&frame_lock, flags);
+}
+
+/**
+ * frame_refcount
+ * Get the number of page table entries that use a frame.
+ *
+ * @param addr  Physical address of the frame
+ *
+ * @return      The frame's reference count (0 if it is free)
+ */
+uint32_t frame_refcount(uint32_t addr) {
+    return frame_refs[addr / FRAME_SIZE];
+}
+
+/**
+ * frame_get_stats
+ * Reports how much of the frame pool is in use.
+ *
+ * @param stats_out     Filled in with the frame pool statistics
+ */
+void frame_get_stats(frame_stats_t *stats_out) {
+    uint32_t flags;
+
+    spin_lock_irqsave(&frame_lock, flags);
+    *stats_out = stats;
+    spin_unlock_irqrestore(&frame_lock, flags);
+}
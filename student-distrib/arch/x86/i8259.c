@@ -5,11 +5,16 @@
 #include <arch/x86/i8259.h>
 #include <lib/lib.h>
 #include <arch/x86/io.h>
+#include <arch/x86/interrupt.h>
+#include <arch/x86/spinlock.h>
 
 /* Interrupt masks to determine which interrupts are enabled and disabled */
 uint8_t master_mask = EIGHT_BIT_MASK; /* IRQs 0-7  */
 uint8_t slave_mask = EIGHT_BIT_MASK;  /* IRQs 8-15 */
 
+/* Protects the masks: any CPU may enable or disable an IRQ (e.g. rtc_open) */
+static spinlock_t pic_lock = SPINLOCK_INIT;
+
 /* PIC References:
     https://www.kernel.org/pub/linux/kernel/people/marcelo/linux-2.4/arch/mips64/kernel/i8259.c  (has actual Linux code for first 3 functions below)
     Lecture 9 (especially slide 21)
@@ -22,6 +27,9 @@ uint8_t slave_mask = EIGHT_BIT_MASK;  /* IRQs 8-15 */
 void
 i8259_init(void)
 {
+    master_mask = EIGHT_BIT_MASK;
+    slave_mask = EIGHT_BIT_MASK;
+
     outportb(MASTER_8259_PORT_DATA, master_mask);   /* mask all of 8259A-1 */
     outportb(SLAVE_8259_PORT_DATA, slave_mask);     /* mask all of 8259A-2 */
 
@@ -42,14 +50,42 @@ i8259_init(void)
 }
 
 /*
- * enable_irq
+ * i8259_mask_all
+ * Masks every IRQ, including the cascade, so that neither PIC raises interrupts any more
+ */
+void
+i8259_mask_all(void)
+{
+    master_mask = EIGHT_BIT_MASK;
+    slave_mask = EIGHT_BIT_MASK;
+    outportb(MASTER_8259_PORT_DATA, master_mask);
+    outportb(SLAVE_8259_PORT_DATA, slave_mask);
+}
+
+/*
+ * i8259_vector
+ * Get the IDT vector an IRQ arrives on (the PICs were remapped to 0x20-0x2F)
+ *
+ * @param irq_num    the IRQ number
+ */
+static uint8_t
+i8259_vector(uint32_t irq_num)
+{
+    return IRQ_INT_NUM(irq_num);
+}
+
+/*
+ * i8259_enable_irq
  * Enables (unmasks) the specified IRQ
  * 
  * @param irq_num    the IRQ number to unmask
  */
-void
-enable_irq(uint32_t irq_num)
+static void
+i8259_enable_irq(uint32_t irq_num)
 {
+    uint32_t flags;
+
+    spin_lock_irqsave(&pic_lock, flags);
     if (irq_num & SLAVE_BIT){
         slave_mask &= ~(1 << (irq_num - IRQ_MASTER_OFFSET));
         outportb(SLAVE_8259_PORT_DATA, slave_mask);
@@ -58,17 +94,21 @@ enable_irq(uint32_t irq_num)
         master_mask &= ~(1 << irq_num);
         outportb(MASTER_8259_PORT_DATA, master_mask);
     }
+    spin_unlock_irqrestore(&pic_lock, flags);
 }
 
 /*
- * disable_irq
+ * i8259_disable_irq
  * Disables (masks) the specified IRQ
  * 
  * @param irq_num    the IRQ number to unmask
  */
-void
-disable_irq(uint32_t irq_num)
+static void
+i8259_disable_irq(uint32_t irq_num)
 {
+    uint32_t flags;
+
+    spin_lock_irqsave(&pic_lock, flags);
     if (irq_num & SLAVE_BIT){
         slave_mask |= (1 << (irq_num - IRQ_MASTER_OFFSET));
         outportb(SLAVE_8259_PORT_DATA, slave_mask);
@@ -77,16 +117,17 @@ disable_irq(uint32_t irq_num)
         master_mask |=  (1 << irq_num);
         outportb(MASTER_8259_PORT_DATA, master_mask);
     }
+    spin_unlock_irqrestore(&pic_lock, flags);
 }
 
 /*
- * send_eoi
+ * i8259_send_eoi
  * Send end-of-interrupt signal for the specified IRQ
  * 
  * @param irq_num    The number IRQ to send EOI for.
  */
-void
-send_eoi(uint32_t irq_num)
+static void
+i8259_send_eoi(uint32_t irq_num)
 {
     if (irq_num & SLAVE_BIT){
         outportb(SLAVE_8259_PORT_COMMAND, EOI | (irq_num - IRQ_MASTER_OFFSET)); 
@@ -95,3 +136,14 @@ send_eoi(uint32_t irq_num)
     else
         outportb(MASTER_8259_PORT_COMMAND, EOI | irq_num);
 }
+
+/* The PICs as the interrupt controller. Every operation is port I/O */
+irq_chip_t i8259_chip = {
+    "8259 PIC",
+    i8259_init,
+    NULL,
+    i8259_vector,
+    i8259_enable_irq,
+    i8259_disable_irq,
+    i8259_send_eoi
+};
@@ -3,6 +3,7 @@
 #include <tty/terminal.h>
 #include <arch/x86/x86_desc.h>
 #include <arch/x86/task.h>
+#include <arch/x86/paging.h>
 
 // Human-readable errors for the 32 possible Exceptions (Entries 0-31 in IDT table)
 static const char *human_readable_errors[] = {
@@ -116,6 +117,11 @@ void exception_handler(uint32_t eax, uint32_t ebx, uint32_t ecx, uint32_t edx,
     uint32_t int_num, uint32_t error,
     uint32_t eip, uint32_t cs, uint32_t eflags) {
 
+    // User pages that are loaded on demand or shared copy-on-write aren't errors; retry the access once the page is mapped
+    if(int_num == PAGE_FAULT_VEC && handle_page_fault(error) == 0) {
+        return;
+    }
+
     pcb_t *child_pcb = get_current_pcb();
     pcb_t *parent_pcb = child_pcb->parent;
     if(parent_pcb != NULL) {
@@ -0,0 +1,181 @@
+#include <arch/x86/ioapic.h>
+#include <arch/x86/apic.h>
+#include <arch/x86/i8259.h>
+#include <arch/x86/mptable.h>
+#include <arch/x86/paging.h>
+#include <arch/x86/spinlock.h>
+#include <arch/x86/io.h>
+#include <lib/lib.h>
+
+/*
+ * I/O APIC interrupt routing. Each ISA IRQ goes to the I/O APIC pin the MP table names, and from
+ * there to the boot CPU's local APIC on a vector of its own priority class. Acknowledging is a
+ * single MMIO write to the local APIC, and masking one IRQ touches only its own redirection entry,
+ * where the 8259 needs port I/O to one or both PICs each time.
+ */
+
+/* Priority class of each IRQ: the PIT first, then the keyboard, then the RTC, then everything else */
+static const uint8_t irq_class[NUM_IRQS] = {
+    6, 5, 3, 3, 3, 3, 3, 3,     /* 0: PIT, 1: keyboard */
+    4, 3, 3, 3, 3, 3, 3, 3      /* 8: RTC */
+};
+
+/* MMIO base of the I/O APIC (identity mapped) */
+static volatile uint32_t *ioapic = NULL;
+
+/* Number of pins the I/O APIC has */
+static uint32_t num_pins = 0;
+
+/* Low half of each IRQ's redirection entry, so that masking doesn't have to read it back first */
+static uint32_t redirection[NUM_IRQS];
+
+/* Protects the register select/window pair and the redirection entries */
+static spinlock_t ioapic_lock = SPINLOCK_INIT;
+
+/**
+ * ioapic_read
+ * Reads an I/O APIC register.
+ *
+ * @param reg   The register number
+ *
+ * @return      The register's value
+ */
+static uint32_t ioapic_read(uint32_t reg) {
+    ioapic[IOAPIC_IOREGSEL / sizeof(uint32_t)] = reg;
+    return ioapic[IOAPIC_IOWIN / sizeof(uint32_t)];
+}
+
+/**
+ * ioapic_write
+ * Writes an I/O APIC register.
+ *
+ * @param reg   The register number
+ * @param val   The value to write
+ */
+static void ioapic_write(uint32_t reg, uint32_t val) {
+    ioapic[IOAPIC_IOREGSEL / sizeof(uint32_t)] = reg;
+    ioapic[IOAPIC_IOWIN / sizeof(uint32_t)] = val;
+}
+
+/**
+ * ioapic_vector
+ * Get the IDT vector an IRQ arrives on.
+ *
+ * @param irq   The IRQ number
+ *
+ * @return      Its vector
+ */
+static uint8_t ioapic_vector(uint32_t irq) {
+    return IOAPIC_VECTOR(irq_class[irq], irq);
+}
+
+/**
+ * ioapic_init
+ * Routes every ISA IRQ to the boot CPU, masked. The 8259 is still initialized, so that it sits on
+ * harmless vectors, and then masked entirely.
+ */
+static void ioapic_init() {
+    uint32_t dest = (uint32_t) lapic_id() << IOAPIC_REDIR_DEST_SHIFT;
+    uint32_t irq;
+
+    i8259_init();
+    i8259_mask_all();
+    if(mp_has_imcr()) {
+        outportb(IMCR_SELECT_PORT, IMCR_SELECT);
+        outportb(IMCR_DATA_PORT, IMCR_APIC_MODE);
+    }
+
+    ioapic = (volatile uint32_t*) mp_ioapic_addr();
+    num_pins = ((ioapic_read(IOAPIC_REG_VERSION) >> IOAPIC_MAX_REDIR_SHIFT) & 0xFF) + 1;
+
+    // The boot CPU's local APIC has to be on to take the interrupts
+    lapic_init(1);
+
+    for(irq = 0; irq < NUM_IRQS; irq++) {
+        uint8_t pin = mp_isa_irq_pin(irq);
+        uint16_t flags = mp_isa_irq_flags(irq);
+        uint32_t entry = ioapic_vector(irq) | IOAPIC_REDIR_MASKED;
+
+        if((flags & MP_INT_POLARITY_MASK) == MP_INT_POLARITY_LOW) entry |= IOAPIC_REDIR_ACTIVE_LOW;
+        if((flags & MP_INT_TRIGGER_MASK) == MP_INT_TRIGGER_LEVEL) entry |= IOAPIC_REDIR_LEVEL;
+        redirection[irq] = entry;
+
+        if(pin < num_pins) {
+            ioapic_write(IOAPIC_REG_REDTBL(pin) + 1, dest);
+            ioapic_write(IOAPIC_REG_REDTBL(pin), entry);
+        }
+    }
+}
+
+/**
+ * ioapic_map_registers
+ * Maps the I/O APIC's and the local APIC's registers into every address space.
+ */
+static void ioapic_map_registers() {
+    paging_map_mmio(mp_ioapic_addr());
+    paging_map_mmio(lapic_get_base());
+}
+
+/**
+ * ioapic_set_masked
+ * Masks or unmasks an IRQ's redirection entry.
+ *
+ * @param irq       The IRQ number
+ * @param masked    1 to mask, 0 to unmask
+ */
+static void ioapic_set_masked(uint32_t irq, uint8_t masked) {
+    uint8_t pin = mp_isa_irq_pin(irq);
+    uint32_t flags;
+
+    if(pin >= num_pins) return;
+
+    spin_lock_irqsave(&ioapic_lock, flags);
+    if(masked) {
+        redirection[irq] |= IOAPIC_REDIR_MASKED;
+    } else {
+        redirection[irq] &= ~IOAPIC_REDIR_MASKED;
+    }
+    ioapic_write(IOAPIC_REG_REDTBL(pin), redirection[irq]);
+    spin_unlock_irqrestore(&ioapic_lock, flags);
+}
+
+/**
+ * ioapic_enable_irq
+ * Enables (unmasks) an IRQ.
+ *
+ * @param irq   The IRQ number
+ */
+static void ioapic_enable_irq(uint32_t irq) {
+    ioapic_set_masked(irq, 0);
+}
+
+/**
+ * ioapic_disable_irq
+ * Disables (masks) an IRQ.
+ *
+ * @param irq   The IRQ number
+ */
+static void ioapic_disable_irq(uint32_t irq) {
+    ioapic_set_masked(irq, 1);
+}
+
+/**
+ * ioapic_send_eoi
+ * Acknowledges an IRQ. The local APIC passes the EOI on to the I/O APIC for level triggered ones.
+ *
+ * @param irq   The IRQ number (unused: the local APIC knows which interrupt is in service)
+ */
+static void ioapic_send_eoi(uint32_t irq) {
+    lapic_eoi();
+}
+
+/* The I/O APIC as the interrupt controller */
+irq_chip_t ioapic_chip = {
+    "I/O APIC",
+    ioapic_init,
+    ioapic_map_registers,
+    ioapic_vector,
+    ioapic_enable_irq,
+    ioapic_disable_irq,
+    ioapic_send_eoi
+};
@@ -0,0 +1,103 @@
+#include <arch/x86/irq.h>
+#include <arch/x86/i8259.h>
+#include <arch/x86/ioapic.h>
+#include <arch/x86/apic.h>
+#include <arch/x86/mptable.h>
+#include <arch/x86/interrupt.h>
+#include <arch/x86/x86_desc.h>
+
+/*
+ * Device IRQs, independent of the interrupt controller behind them. Drivers only use IRQ numbers;
+ * the controller picked at boot decides which vector each one arrives on and how it's masked and
+ * acknowledged.
+ */
+
+/* The interrupt controller in use */
+static irq_chip_t *chip = &i8259_chip;
+
+/**
+ * irq_init
+ * Picks the interrupt controller and initializes it with every IRQ masked: the I/O APIC if the MP
+ * table lists one and the CPU has a local APIC to receive its interrupts, otherwise the 8259.
+ * mp_init must have been called, and paging must still be off.
+ */
+void irq_init() {
+    if(mp_ioapic_addr() != 0 && lapic_detect() != 0) {
+        chip = &ioapic_chip;
+    }
+    chip->init();
+}
+
+/**
+ * irq_map_registers
+ * Maps the interrupt controller's registers into the kernel's address spaces. Must be called after
+ * paging_init and before the kernel page directory is cloned.
+ */
+void irq_map_registers() {
+    if(chip->map_registers != NULL) {
+        chip->map_registers();
+    }
+}
+
+/**
+ * irq_chip_name
+ * Get the name of the interrupt controller in use.
+ *
+ * @return      Its name
+ */
+const int8_t *irq_chip_name() {
+    return chip->name;
+}
+
+/**
+ * irq_vector
+ * Get the IDT vector an IRQ arrives on.
+ *
+ * @param irq   The IRQ number
+ *
+ * @return      Its vector
+ */
+uint8_t irq_vector(uint32_t irq) {
+    return chip->vector(irq);
+}
+
+/**
+ * irq_set_handler
+ * Installs the interrupt handler for an IRQ. irq_init must have been called.
+ *
+ * @param irq       The IRQ number
+ * @param handler   The handler's assembly wrapper
+ */
+void irq_set_handler(uint32_t irq, void *handler) {
+    install_interrupt_handler(chip->vector(irq), handler, KERNEL_CS, PRIVILEGE_KERNEL);
+}
+
+/**
+ * enable_irq
+ * Enables (unmasks) the specified IRQ
+ *
+ * @param irq_num    the IRQ number to unmask
+ */
+void enable_irq(uint32_t irq_num) {
+    chip->enable(irq_num);
+}
+
+/**
+ * disable_irq
+ * Disables (masks) the specified IRQ
+ *
+ * @param irq_num    the IRQ number to mask
+ */
+void disable_irq(uint32_t irq_num) {
+    chip->disable(irq_num);
+}
+
+/**
+ * send_eoi
+ * Send end-of-interrupt signal for the specified IRQ
+ *
+ * @param irq_num    The number IRQ to send EOI for.
+ */
+void send_eoi(uint32_t irq_num) {
+    chip->eoi(irq_num);
+}
@@ -0,0 +1,324 @@
+#include <arch/x86/latency.h>
+#include <arch/x86/cpu.h>
+#include <arch/x86/smp.h>
+#include <arch/x86/x86_desc.h>
+#include <kernel/sched.h>
+#include <lib/lib.h>
+
+/*
+ * Interrupt latency instrumentation, in TSC cycles. Two things are measured on every CPU:
+ *
+ *  - How long each interrupt handler runs, from the wrapper's entry to its return, as a histogram
+ *    per handler. A run during which the handler switched to another process is only counted,
+ *    since its length says more about that process than about the handler.
+ *  - How long interrupts stay disabled, from the moment they go off (an interrupt, system call or
+ *    exception from code that had them on, or cli_and_save with them on) to the moment they come
+ *    back (iret, restore_flags, or the idle task's sti). The window is charged to where it began,
+ *    and the longest window of each call site is kept.
+ *
+ * Only the low half of the TSC is used, so anything longer than 2^32 cycles wraps around. Each CPU
+ * only writes its own counters, with interrupts off, so no locks are needed; a CPU reading another
+ * CPU's counters may see them mid-update, which is fine for statistics.
+ */
+
+/* Counters of one CPU */
+typedef struct latency_cpu_t {
+	uint32_t off_start;                     // TSC when interrupts went off (valid if off_site != NULL)
+	const int8_t *off_site;                 // Where they went off, or NULL if they're on (or unknown)
+	uint32_t off_line;
+	uint32_t count[LATENCY_NUM_SRCS];
+	uint32_t switched[LATENCY_NUM_SRCS];
+	uint32_t max[LATENCY_NUM_SRCS];
+	uint32_t hist[LATENCY_NUM_SRCS][LATENCY_HIST_BUCKETS];
+	latency_window_t top[LATENCY_TOP_WINDOWS];  // Longest first; unused entries have site == NULL
+} latency_cpu_t;
+
+static latency_cpu_t cpus[SMP_MAX_CPUS];
+
+/* Names of the measured handlers, indexed by LATENCY_SRC_* */
+static const int8_t *src_names[LATENCY_NUM_SRCS] = {
+    "keyboard",
+    "rtc",
+    "pit",
+    "fpu (#NM)",
+    "tick IPI",
+    "resched IPI",
+    "TLB IPI",
+    "APIC timer"
+};
+
+/* Set once the CPU is known to have a TSC */
+static uint32_t enabled = 0;
+
+/**
+ * read_tsc
+ * Reads the low half of the time-stamp counter.
+ *
+ * @return      The cycle count, modulo 2^32
+ */
+static inline uint32_t read_tsc() {
+    uint32_t low;
+
+    asm volatile("rdtsc" : "=a"(low) : : "edx");
+    return low;
+}
+
+/**
+ * latency_bucket
+ * Get the histogram bucket a duration falls in.
+ *
+ * @param cycles    The duration
+ *
+ * @return          Its bucket (0 to LATENCY_HIST_BUCKETS - 1)
+ */
+static uint32_t latency_bucket(uint32_t cycles) {
+    uint32_t bit;
+
+    if(cycles < (1 << LATENCY_HIST_MIN_SHIFT)) return 0;
+
+    asm("bsrl %1, %0" : "=r"(bit) : "rm"(cycles) : "cc");
+    bit -= LATENCY_HIST_MIN_SHIFT - 1;
+    return (bit < LATENCY_HIST_BUCKETS) ? bit : LATENCY_HIST_BUCKETS - 1;
+}
+
+/**
+ * latency_record_window
+ * Charges an interrupts-disabled window to its call site, keeping the site's table sorted.
+ *
+ * @param cpu       The calling CPU's counters
+ * @param site      Where the window began
+ * @param line      Line (or syscall/exception number) of the site
+ * @param cycles    How long it lasted
+ */
+static void latency_record_window(latency_cpu_t *cpu, const int8_t *site, uint32_t line, uint32_t cycles) {
+    latency_window_t entry;
+    int32_t i;
+
+    // Take the site out of the table if it's there, otherwise make room at the end
+    for(i = 0; i < LATENCY_TOP_WINDOWS - 1; i++) {
+        if(cpu->top[i].site == NULL || (cpu->top[i].site == site && cpu->top[i].line == line)) break;
+    }
+    if(cpu->top[i].site == site && cpu->top[i].line == line) {
+        entry = cpu->top[i];
+    } else if(cpu->top[i].site != NULL && cpu->top[i].max >= cycles) {
+        // The table is full of longer windows
+        return;
+    } else {
+        entry.site = site;
+        entry.line = line;
+        entry.max = 0;
+        entry.count = 0;
+    }
+
+    entry.count++;
+    if(cycles > entry.max) entry.max = cycles;
+
+    // Insertion sort it back in, longest first
+    for(; i > 0 && cpu->top[i - 1].max < entry.max; i--) {
+        cpu->top[i] = cpu->top[i - 1];
+    }
+    cpu->top[i] = entry;
+}
+
+/**
+ * latency_init
+ * Turns the instrumentation on if the CPU has a time-stamp counter. Everything before is ignored.
+ */
+void latency_init() {
+    uint32_t eax, ebx, ecx, edx;
+
+    cpuid(CPUID_FEATURES, eax, ebx, ecx, edx);
+    enabled = (edx & CPUID_EDX_TSC) != 0;
+}
+
+/**
+ * latency_enabled
+ * Checks whether latencies are being measured.
+ *
+ * @return      1 if they are, 0 if the CPU has no TSC
+ */
+uint32_t latency_enabled() {
+    return enabled;
+}
+
+/**
+ * latency_irqs_off
+ * Notes that the calling CPU just disabled interrupts. Must only be called when they were on.
+ *
+ * @param site  Where: a file name, or a name for an entry point
+ * @param line  Line in the file, or a number qualifying the entry point
+ */
+void latency_irqs_off(const int8_t *site, uint32_t line) {
+    latency_cpu_t *cpu;
+
+    if(!enabled) return;
+
+    cpu = &cpus[smp_cpu_id()];
+    cpu->off_site = site;
+    cpu->off_line = line;
+    cpu->off_start = read_tsc();
+}
+
+/**
+ * latency_irqs_on
+ * Notes that the calling CPU is about to enable interrupts, ending the current window.
+ */
+void latency_irqs_on() {
+    latency_cpu_t *cpu;
+    uint32_t now;
+
+    if(!enabled) return;
+
+    now = read_tsc();
+    cpu = &cpus[smp_cpu_id()];
+    if(cpu->off_site == NULL) return;
+
+    latency_record_window(cpu, cpu->off_site, cpu->off_line, now - cpu->off_start);
+    cpu->off_site = NULL;
+}
+
+/**
+ * latency_irq_enter
+ * Called by interrupt_wrapper.S before an interrupt handler. Interrupts were on until the CPU took
+ * this one, so an interrupts-disabled window starts here too.
+ *
+ * @param src       Which handler (LATENCY_SRC_*)
+ * @param sample    Where to remember the start, for latency_irq_exit
+ */
+void latency_irq_enter(uint32_t src, latency_sample_t *sample) {
+    if(!enabled) return;
+
+    latency_irqs_off(src_names[src], 0);
+    sample->switches = sched_switch_count();
+    sample->start = read_tsc();
+}
+
+/**
+ * latency_irq_exit
+ * Called by interrupt_wrapper.S after an interrupt handler returns, right before the iret that
+ * enables interrupts again.
+ *
+ * @param src       Which handler (LATENCY_SRC_*)
+ * @param sample    What latency_irq_enter recorded
+ */
+void latency_irq_exit(uint32_t src, latency_sample_t *sample) {
+    latency_cpu_t *cpu;
+    uint32_t cycles;
+
+    if(!enabled) return;
+
+    cycles = read_tsc() - sample->start;
+    cpu = &cpus[smp_cpu_id()];
+
+    if(sched_switch_count() != sample->switches) {
+        cpu->switched[src]++;
+    } else {
+        cpu->count[src]++;
+        cpu->hist[src][latency_bucket(cycles)]++;
+        if(cycles > cpu->max[src]) cpu->max[src] = cycles;
+    }
+
+    latency_irqs_on();
+}
+
+/**
+ * latency_syscall_enter
+ * Called by syscall_handler_wrapper, which disables interrupts for the whole system call.
+ *
+ * @param num   The system call number
+ */
+void latency_syscall_enter(uint32_t num) {
+    latency_irqs_off("syscall", num);
+}
+
+/**
+ * latency_exception_enter
+ * Called by the exception wrapper. Exceptions don't change the interrupt flag, but the handler
+ * runs with interrupts off, so if the faulting code had them on a window starts here.
+ *
+ * @param eflags    EFLAGS of the faulting code
+ * @param num       The exception number
+ */
+void latency_exception_enter(uint32_t eflags, uint32_t num) {
+    if(eflags & EFLAGS_INTERRUPT) {
+        latency_irqs_off("exception", num);
+    }
+}
+
+/**
+ * latency_exception_exit
+ * Called by the exception wrapper before returning to the faulting code.
+ *
+ * @param eflags    EFLAGS the iret restores
+ */
+void latency_exception_exit(uint32_t eflags) {
+    if(eflags & EFLAGS_INTERRUPT) {
+        latency_irqs_on();
+    }
+}
+
+/**
+ * latency_get_irq_stats
+ * Sums the run times of one interrupt handler over the CPUs.
+ *
+ * @param src       Which handler (LATENCY_SRC_*)
+ * @param stats     Filled in with its statistics
+ */
+void latency_get_irq_stats(uint32_t src, latency_irq_stats_t *stats) {
+    uint32_t cpu;
+    uint32_t i;
+
+    memset(stats, 0, sizeof(latency_irq_stats_t));
+    stats->name = src_names[src];
+
+    for(cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        stats->count += cpus[cpu].count[src];
+        stats->switched += cpus[cpu].switched[src];
+        if(cpus[cpu].max[src] > stats->max) stats->max = cpus[cpu].max[src];
+        for(i = 0; i < LATENCY_HIST_BUCKETS; i++) {
+            stats->hist[i] += cpus[cpu].hist[src][i];
+        }
+    }
+}
+
+/**
+ * latency_get_windows
+ * Collects the longest interrupts-disabled window of each call site over the CPUs.
+ *
+ * @param windows   Array of LATENCY_TOP_WINDOWS entries, filled in longest first
+ *
+ * @return          The number of entries filled in
+ */
+uint32_t latency_get_windows(latency_window_t *windows) {
+    uint32_t num = 0;
+    uint32_t cpu;
+    uint32_t i, j;
+
+    for(cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        for(i = 0; i < LATENCY_TOP_WINDOWS && cpus[cpu].top[i].site != NULL; i++) {
+            latency_window_t entry = cpus[cpu].top[i];
+
+            // Merge with the same site on another CPU
+            for(j = 0; j < num; j++) {
+                if(windows[j].site == entry.site && windows[j].line == entry.line) break;
+            }
+            if(j < num) {
+                entry.count += windows[j].count;
+                if(windows[j].max > entry.max) entry.max = windows[j].max;
+            } else if(num < LATENCY_TOP_WINDOWS) {
+                j = num++;
+            } else if(windows[num - 1].max < entry.max) {
+                j = num - 1;
+            } else {
+                continue;
+            }
+
+            // Move it up to its place, longest first
+            for(; j > 0 && windows[j - 1].max < entry.max; j--) {
+                windows[j] = windows[j - 1];
+            }
+            windows[j] = entry;
+        }
+    }
+    return num;
+}
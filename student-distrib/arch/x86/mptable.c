@@ -0,0 +1,251 @@
+#include <arch/x86/mptable.h>
+#include <lib/lib.h>
+
+/*
+ * The BIOS's MP configuration table: which CPUs the machine has, where its I/O APIC is, and which
+ * I/O APIC pin each ISA IRQ is wired to. Read once at boot, while paging is still off (the table
+ * lives in low memory or the BIOS ROM, which the kernel doesn't map).
+ */
+
+/* CPUs found (the boot CPU is index 0) and their local APIC IDs */
+static uint32_t num_cpus = 1;
+static uint8_t cpu_apic_id[SMP_MAX_CPUS];
+
+/* Physical address of the (first) I/O APIC, or 0 if there is none, and its APIC ID */
+static uint32_t ioapic_addr = 0;
+static uint8_t ioapic_id = 0;
+
+/* Whether interrupts have to be switched from the 8259 to the APICs through the IMCR */
+static uint32_t has_imcr = 0;
+
+/* Bus ID of the ISA bus, or MP_NO_BUS if the table doesn't list one */
+#define MP_NO_BUS 0xFFFF
+static uint32_t isa_bus = MP_NO_BUS;
+
+/* I/O APIC pin and polarity/trigger flags of each ISA IRQ. Unless the table says otherwise, IRQ n
+ * is on pin n, edge triggered and active high */
+static uint8_t isa_irq_pin[MP_ISA_IRQS];
+static uint16_t isa_irq_flags[MP_ISA_IRQS];
+
+/**
+ * mp_checksum
+ * Adds up the bytes of an MP structure. Valid structures add up to 0.
+ *
+ * @param addr  Start of the structure
+ * @param len   Its length in bytes
+ *
+ * @return      The sum, modulo 256
+ */
+static uint8_t mp_checksum(uint8_t *addr, uint32_t len) {
+    uint8_t sum = 0;
+    uint32_t i;
+
+    for(i = 0; i < len; i++) {
+        sum += addr[i];
+    }
+    return sum;
+}
+
+/**
+ * mp_search
+ * Looks for the MP floating pointer structure in a range of physical memory.
+ *
+ * @param start Start of the range (16-byte aligned)
+ * @param len   Length of the range in bytes
+ *
+ * @return      The structure, or NULL if it isn't there
+ */
+static mp_floating_t *mp_search(uint32_t start, uint32_t len) {
+    uint32_t addr;
+
+    for(addr = start; addr + sizeof(mp_floating_t) <= start + len; addr += MP_SEARCH_ALIGN) {
+        mp_floating_t *mp = (mp_floating_t*) addr;
+        if(mp->signature == MP_FLOATING_SIGNATURE && mp->length == 1 &&
+                mp_checksum((uint8_t*) mp, sizeof(mp_floating_t)) == 0) {
+            return mp;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * mp_find
+ * Finds the MP floating pointer structure in the places the MP specification allows: the first kB
+ * of the extended BIOS data area, the last kB of base memory, or the BIOS ROM.
+ *
+ * @return      The structure, or NULL if the machine has none
+ */
+static mp_floating_t *mp_find() {
+    mp_floating_t *mp;
+    uint16_t ebda_segment;
+    uint16_t base_mem_kb;
+    uint32_t ebda;
+    uint32_t base_mem;
+
+    // Copied rather than dereferenced, since the compiler takes pointers into the first page for NULL
+    memcpy(&ebda_segment, (void*) BDA_EBDA_SEGMENT, sizeof(ebda_segment));
+    memcpy(&base_mem_kb, (void*) BDA_BASE_MEM_KB, sizeof(base_mem_kb));
+    ebda = (uint32_t) ebda_segment << 4;    // Real mode segment to address
+    base_mem = (uint32_t) base_mem_kb * 1024;
+
+    if(ebda != 0 && (mp = mp_search(ebda, MP_SEARCH_LENGTH)) != NULL) return mp;
+    if(base_mem >= MP_SEARCH_LENGTH && (mp = mp_search(base_mem - MP_SEARCH_LENGTH, MP_SEARCH_LENGTH)) != NULL) return mp;
+    return mp_search(BIOS_ROM_START, BIOS_ROM_END - BIOS_ROM_START);
+}
+
+/**
+ * mp_add_processor
+ * Records a processor entry. The boot CPU becomes CPU 0 and the others are numbered in table order;
+ * CPUs past SMP_MAX_CPUS are left alone.
+ *
+ * @param proc  The entry
+ */
+static void mp_add_processor(mp_processor_t *proc) {
+    if(!(proc->flags & MP_PROC_ENABLED)) return;
+
+    if(proc->flags & MP_PROC_BSP) {
+        cpu_apic_id[0] = proc->apic_id;
+    } else if(num_cpus < SMP_MAX_CPUS) {
+        cpu_apic_id[num_cpus++] = proc->apic_id;
+    }
+}
+
+/**
+ * mp_add_io_int
+ * Records an I/O interrupt entry if it wires an ISA IRQ to the I/O APIC we use.
+ *
+ * @param io_int    The entry
+ */
+static void mp_add_io_int(mp_io_int_t *io_int) {
+    if(io_int->int_type != MP_INT_TYPE_INT || io_int->src_bus != isa_bus) return;
+    if(io_int->dst_ioapic != ioapic_id || io_int->src_irq >= MP_ISA_IRQS) return;
+
+    isa_irq_pin[io_int->src_irq] = io_int->dst_pin;
+    isa_irq_flags[io_int->src_irq] = io_int->flags;
+}
+
+/**
+ * mp_init
+ * Reads the MP configuration table. Without one (or with one of the default configurations, which
+ * we don't bother with), the machine is treated as having a single CPU and no I/O APIC. Must be
+ * called while paging is off.
+ */
+void mp_init() {
+    mp_floating_t *mp = mp_find();
+    mp_config_t *config;
+    uint8_t *entry;
+    uint32_t pass;
+    uint32_t i;
+
+    for(i = 0; i < MP_ISA_IRQS; i++) {
+        isa_irq_pin[i] = i;
+        isa_irq_flags[i] = 0;
+    }
+
+    if(mp == NULL || mp->config == 0) return;
+    has_imcr = (mp->features[1] & MP_FEATURE2_IMCR) != 0;
+
+    config = (mp_config_t*) mp->config;
+    if(config->signature != MP_CONFIG_SIGNATURE || mp_checksum((uint8_t*) config, config->length) != 0) return;
+
+    // Interrupt entries refer to buses and I/O APICs by ID, which may be listed after them, so
+    // the first pass collects those and the second the interrupt wiring
+    for(pass = 0; pass < 2; pass++) {
+        entry = (uint8_t*) (config + 1);
+        for(i = 0; i < config->entry_count; i++) {
+            switch(*entry) {
+                case MP_ENTRY_PROCESSOR:
+                    if(pass == 0) mp_add_processor((mp_processor_t*) entry);
+                    break;
+                case MP_ENTRY_BUS:
+                    if(pass == 0 && strncmp((int8_t*) ((mp_bus_t*) entry)->bus_type, "ISA", 3) == 0) {
+                        isa_bus = ((mp_bus_t*) entry)->bus_id;
+                    }
+                    break;
+                case MP_ENTRY_IOAPIC:
+                    if(pass == 0 && ioapic_addr == 0 && (((mp_ioapic_t*) entry)->flags & MP_IOAPIC_ENABLED)) {
+                        ioapic_addr = ((mp_ioapic_t*) entry)->addr;
+                        ioapic_id = ((mp_ioapic_t*) entry)->apic_id;
+                    }
+                    break;
+                case MP_ENTRY_IO_INT:
+                    if(pass == 1) mp_add_io_int((mp_io_int_t*) entry);
+                    break;
+                case MP_ENTRY_LOCAL_INT:
+                    break;
+                default:
+                    // Unknown entry type, so the size of the rest is unknown too
+                    i = config->entry_count;
+                    continue;
+            }
+            entry += (*entry == MP_ENTRY_PROCESSOR) ? MP_PROCESSOR_SIZE : MP_OTHER_ENTRY_SIZE;
+        }
+    }
+}
+
+/**
+ * mp_num_cpus
+ * Get the number of usable CPUs listed in the MP table.
+ *
+ * @return      The number of CPUs (1 without a table)
+ */
+uint32_t mp_num_cpus() {
+    return num_cpus;
+}
+
+/**
+ * mp_cpu_apic_id
+ * Get the local APIC ID of a CPU.
+ *
+ * @param cpu   The CPU's index (0 is the boot CPU)
+ *
+ * @return      Its APIC ID
+ */
+uint8_t mp_cpu_apic_id(uint32_t cpu) {
+    return cpu_apic_id[cpu];
+}
+
+/**
+ * mp_ioapic_addr
+ * Get the physical address of the I/O APIC's registers.
+ *
+ * @return      The address, or 0 if the MP table lists no I/O APIC
+ */
+uint32_t mp_ioapic_addr() {
+    return ioapic_addr;
+}
+
+/**
+ * mp_has_imcr
+ * Checks whether the machine starts in PIC mode, where the 8259 is wired straight to the boot CPU
+ * and the IMCR has to be written before the I/O APIC's interrupts get through.
+ *
+ * @return      1 if it does, 0 if not
+ */
+uint32_t mp_has_imcr() {
+    return has_imcr;
+}
+
+/**
+ * mp_isa_irq_pin
+ * Get the I/O APIC pin an ISA IRQ is wired to (e.g. the PIT's IRQ 0 is usually on pin 2).
+ *
+ * @param irq   The ISA IRQ (0-15)
+ *
+ * @return      The pin
+ */
+uint8_t mp_isa_irq_pin(uint32_t irq) {
+    return isa_irq_pin[irq];
+}
+
+/**
+ * mp_isa_irq_flags
+ * Get the polarity and trigger mode of an ISA IRQ, as MP_INT_* flags.
+ *
+ * @param irq   The ISA IRQ (0-15)
+ *
+ * @return      The flags (0 means the ISA default: edge triggered, active high)
+ */
+uint16_t mp_isa_irq_flags(uint32_t irq) {
+    return isa_irq_flags[irq];
+}
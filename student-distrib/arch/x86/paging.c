@@ -1,29 +1,183 @@
 #include <arch/x86/paging.h>
 #include <arch/x86/task.h>
+#include <arch/x86/cpu.h>
+#include <arch/x86/frame.h>
+#include <arch/x86/tlb.h>
+#include <kernel/image_cache.h>
+#include <kernel/vdata.h>
+#include <lib/lib.h>
+
+#define USER_PD_INDEX (PROCESS_VIRT_PAGE_START / FOUR_MB_ALIGNED)
+#define VIDMAP_VIRT_ADDR (33 * FOUR_MB_ALIGNED)   // 33 Represents the PD entry that will correspond to 132 MB
 
 static pt_entry vmem_pt[NUM_PT_ENTRIES] __attribute__((aligned (FOUR_KB_ALIGNED)));
 
+/* The kernel half of every address space, built once by paging_init */
+static pd_entry kernel_template[NUM_PD_ENTRIES] __attribute__((aligned (FOUR_KB_ALIGNED)));
+
+static paging_stats_t stats;
+
 static pd_entry *get_process_pd(uint32_t slot_num) {
-    return (pd_entry*) (PAGING_STRUCT_ADDR + PROCESS_STRUCT_SIZE * slot_num);
+    return get_task_block_from_slot(slot_num)->page_directory;
 }
 
 static pt_entry *get_process_pt(uint32_t slot_num) {
-    return (pt_entry*) (PAGING_STRUCT_ADDR + PROCESS_STRUCT_SIZE * slot_num + FOUR_KB_ALIGNED);
+    return get_task_block_from_slot(slot_num)->vmem_page_table;
+}
+
+/**
+ * get_user_pt
+ * Finds the page table that maps a process's user page (128MB to 132MB).
+ *
+ * @param pd    The process's page directory
+ *
+ * @return      The page table (reachable through the kernel's identity map), or NULL if there is none
+ */
+static pt_entry *get_user_pt(pd_entry *pd) {
+    if(!pd[USER_PD_INDEX].present) return NULL;
+    return (pt_entry*) (pd[USER_PD_INDEX].physical_addr_31_to_12 << ADDRESS_SHIFT);
+}
+
+/**
+ * map_table
+ * Points the page directory entry covering a 4MB user region at a page table of 4kB pages.
+ *
+ * @param pd        The process's page directory
+ * @param vaddr     Any virtual address in the region
+ * @param pt        The page table for the region
+ */
+static void map_table(pd_entry *pd, uint32_t vaddr, pt_entry *pt) {
+    pd_entry table_entry;
+
+    // Access rights are decided page by page in the page table
+    table_entry.val             = 0;
+    table_entry.physical_addr_31_to_12 = (uint32_t) pt >> ADDRESS_SHIFT;
+    table_entry.user_accessible = 1;
+    table_entry.read_write      = 1;
+    table_entry.present         = 1;
+
+    pd[vaddr / FOUR_MB_ALIGNED] = table_entry;
 }
 
 /**
- * initialize_paging_structs
- * Initializes paging structures by doing:
+ * get_pte
+ * Finds the page table entry that maps a user address.
+ *
+ * @param pd        The page directory
+ * @param vaddr     The virtual address
+ *
+ * @return          The entry, or NULL if no page table covers the address
+ */
+static pt_entry *get_pte(pd_entry *pd, uint32_t vaddr) {
+    pd_entry table_entry = pd[vaddr / FOUR_MB_ALIGNED];
+
+    if(!table_entry.present || table_entry.page_size) return NULL;
+    return &((pt_entry*) (table_entry.physical_addr_31_to_12 << ADDRESS_SHIFT))[(vaddr >> ADDRESS_SHIFT) & (NUM_PT_ENTRIES - 1)];
+}
+
+/**
+ * paging_clone_kernel
+ * Starts a new address space: copies the kernel half from the template and leaves everything else
+ * unmapped. User mappings are then added with paging_map.
+ *
+ * @param pd    The page directory to fill in
+ */
+void paging_clone_kernel(pd_entry *pd) {
+    memcpy(pd, kernel_template, sizeof(kernel_template));
+}
+
+/**
+ * paging_map
+ * Maps one 4kB page, or changes an existing mapping. The TLB entry is only dropped if the page was
+ * mapped before and the address space is the active one.
+ *
+ * @param pd        The page directory. A page table must already cover vaddr
+ * @param vaddr     Virtual address of the page
+ * @param phys      Physical address of the frame
+ * @param flags     PAGE_* flags. PAGE_PRESENT is implied
+ *
+ * @return          0 on success, -1 if no page table covers vaddr
+ */
+int32_t paging_map(pd_entry *pd, uint32_t vaddr, uint32_t phys, uint32_t flags) {
+    pt_entry *entry = get_pte(pd, vaddr);
+    uint8_t was_present;
+
+    if(entry == NULL) return -1;
+
+    was_present = entry->present;
+    entry->val = (phys & ~(FOUR_KB_ALIGNED - 1)) | flags | PAGE_PRESENT;
+
+    if(was_present && tlb_pd_is_loaded(pd)) {
+        tlb_flush_page((void*) vaddr);
+    }
+    return 0;
+}
+
+/**
+ * paging_unmap
+ * Removes the mapping of one 4kB page.
+ *
+ * @param pd        The page directory
+ * @param vaddr     Virtual address of the page
+ *
+ * @return          Physical address of the frame that was mapped (the caller drops its reference), or 0 if none was
+ */
+uint32_t paging_unmap(pd_entry *pd, uint32_t vaddr) {
+    pt_entry *entry = get_pte(pd, vaddr);
+    uint32_t phys;
+
+    if(entry == NULL || !entry->present) return 0;
+
+    phys = entry->physical_addr_31_to_12 << ADDRESS_SHIFT;
+    entry->val = 0;
+
+    if(tlb_pd_is_loaded(pd)) {
+        tlb_flush_page((void*) vaddr);
+    }
+    return phys;
+}
+
+/**
+ * alloc_user_frame
+ * Gets a frame for a user page, dropping cached programs nobody runs if memory is exhausted.
+ *
+ * @return      The physical address of the frame, or 0 if there is no memory left
+ */
+uint32_t alloc_user_frame() {
+    uint32_t frame = frame_alloc();
+
+    if(frame == 0 && image_cache_reclaim() > 0) {
+        frame = frame_alloc();
+    }
+    return frame;
+}
+
+/**
+ * flush_if_loaded
+ * Flushes the user part of the TLB if a page directory is the active one. Other address spaces
+ * get a fresh TLB when they're loaded anyway.
+ *
+ * @param pd    The page directory that was changed
+ */
+static void flush_if_loaded(pd_entry *pd) {
+    if(tlb_pd_is_loaded(pd)) {
+        tlb_flush_all();
+    }
+}
+
+/**
+ * paging_init
+ * Builds the kernel half of the address space once, into the template every page directory is
+ * cloned from (see paging_clone_kernel):
  *    1) Set up 0-4 MB memory, including video memory
  *    2) set up 4-8 MB Kernel page (mapped directly from video memory)
- *    3) Set up pages for storing page directories/page structs (at 124-128 MB)
- *    4) set up program pages for the processes (at 128-132 MB)
- *    5) set up process VMEM page (at 132 MB). All processes have the same VMEM page.
- *    everything else is set to blank
- * 
- * @param local_pd_ptr  pointer to a Page Directory entry. We want it to be the 0th PD entry.
+ *    3) Identity map the frame pool (everything from 8 MB up, including the task blocks that hold
+ *       PCBs, kernel stacks and page structs), so the kernel can reach every physical frame
+ *    everything else is set to blank. Must be called after the frame allocator is set up.
  */
-void initialize_paging_structs(pd_entry *local_pd_ptr, pt_entry *local_pt_ptr, void *vmem_addr) {
+void paging_init() {
+    pd_entry *local_pd_ptr = kernel_template;
+
     /* Make all Page Directory (PD) entries blank for now */
     {
         int i;
@@ -60,7 +214,7 @@ void initialize_paging_structs(pd_entry *local_pd_ptr, pt_entry *local_pt_ptr, v
                 my_entry.present = 0;
             } else {
                 my_entry.physical_addr_31_to_12 = (uint32_t) addr >> ADDRESS_SHIFT;
-                my_entry.global            = 0; // Rodney: I changed this to 0
+                my_entry.global            = 1; // Same in every address space
                 my_entry.page_size_ignored = 0;
                 my_entry.dirty             = 0;
                 my_entry.accessed          = 0;
@@ -92,156 +246,306 @@ void initialize_paging_structs(pd_entry *local_pd_ptr, pt_entry *local_pt_ptr, v
         local_pd_ptr[1] = kernel_page_entry;
     }
 
-    /* Set up pages for storing page directories/page structs */
-    {
-        // Allocate 4MB at address 124MB
-        pd_entry kernel_page_entry;
-
-        kernel_page_entry.physical_addr_31_to_12 = PAGING_STRUCT_ADDR >> ADDRESS_SHIFT;
-        kernel_page_entry.global_ignored  = 1;
-        kernel_page_entry.page_size       = 1;
-        kernel_page_entry.dirty_ignored   = 0;
-        kernel_page_entry.accessed        = 0;
-        kernel_page_entry.cache_disabled  = 0;
-        kernel_page_entry.write_through   = 0;
-        kernel_page_entry.user_accessible = 0;
-        kernel_page_entry.read_write      = 1;
-        kernel_page_entry.present         = 1;
-        
-        local_pd_ptr[31] = kernel_page_entry;
-    }
-
-    /* Set up program pages */
+    /* Identity map the frame pool (supervisor only, so every PCB, kernel stack and physical
+     * frame is reachable from any process without temporary mappings) */
     {
         int i;
-        for(i = 0; i < MAX_PROCESSES; i++) {
-            pd_entry process_page_entry;
-
-            process_page_entry.physical_addr_31_to_12 = 2048 + 1024 * i; // 2048 represents address 8 MegaBytes. 1024 represents 4 MB. we want program 1 at 8 MB, program 2 at 12 MB, etc.
-            process_page_entry.global_ignored  = 0;
-            process_page_entry.page_size       = 1;
-            process_page_entry.dirty_ignored   = 0;
-            process_page_entry.accessed        = 0;
-            process_page_entry.cache_disabled  = 0;
-            process_page_entry.write_through   = 0;
-            process_page_entry.user_accessible = 0;
-            process_page_entry.read_write      = 1;
-            process_page_entry.present         = 1;
-
-            local_pd_ptr[2 + i] = process_page_entry; // 2 represents the offset so that the process pages start at 8 MB
+        uint32_t pages = 0;
+        if(frame_pool_end() > KERNEL_PAGE_END) {
+            pages = (frame_pool_end() - KERNEL_PAGE_END + FOUR_MB_ALIGNED - 1) / FOUR_MB_ALIGNED;
+        }
+
+        for(i = 0; i < pages; i++) {
+            pd_entry physmap_entry;
+
+            physmap_entry.physical_addr_31_to_12 = (KERNEL_PAGE_END + FOUR_MB_ALIGNED * i) >> ADDRESS_SHIFT;
+            physmap_entry.global_ignored  = 1;
+            physmap_entry.page_size       = 1;
+            physmap_entry.dirty_ignored   = 0;
+            physmap_entry.accessed        = 0;
+            physmap_entry.cache_disabled  = 0;
+            physmap_entry.write_through   = 0;
+            physmap_entry.user_accessible = 0;
+            physmap_entry.read_write      = 1;
+            physmap_entry.present         = 1;
+
+            local_pd_ptr[KERNEL_PAGE_END / FOUR_MB_ALIGNED + i] = physmap_entry;
         }
     }
+}
 
-    {
-        pd_entry video_mem_entry; /* An entry representing first 4 MB of physical memory */
-        int i;
+/**
+ * paging_map_mmio
+ * Identity maps the 4 MB page holding a device's registers into the kernel half, uncached. Must be
+ * called before any address space is cloned from the template.
+ *
+ * @param phys  Physical address of the registers
+ */
+void paging_map_mmio(uint32_t phys) {
+    pd_entry mmio_entry;
+
+    mmio_entry.physical_addr_31_to_12 = (phys & ~(FOUR_MB_ALIGNED - 1)) >> ADDRESS_SHIFT;
+    mmio_entry.global_ignored  = 1;
+    mmio_entry.page_size       = 1;
+    mmio_entry.dirty_ignored   = 0;
+    mmio_entry.accessed        = 0;
+    mmio_entry.cache_disabled  = 1;
+    mmio_entry.write_through   = 1;
+    mmio_entry.user_accessible = 0;
+    mmio_entry.read_write      = 1;
+    mmio_entry.present         = 1;
+
+    kernel_template[phys / FOUR_MB_ALIGNED] = mmio_entry;
+}
 
-        video_mem_entry.physical_addr_31_to_12 = (uint32_t) local_pt_ptr >> ADDRESS_SHIFT;
-        video_mem_entry.global_ignored  = 0;
-        video_mem_entry.page_size       = 0;
-        video_mem_entry.dirty_ignored   = 0;
-        video_mem_entry.accessed        = 0;
-        video_mem_entry.cache_disabled  = 0;
-        video_mem_entry.write_through   = 0;
-        video_mem_entry.user_accessible = 1;
-        video_mem_entry.read_write      = 1;
-        video_mem_entry.present         = 1;
+/**
+ * paging_kernel_pd
+ * Get the template page directory. It maps the kernel half only, so it can be loaded by a CPU
+ * that has no process to run.
+ *
+ * @return      The template
+ */
+pd_entry *paging_kernel_pd() {
+    return kernel_template;
+}
 
-        // Page directory entry for 132MB - 136MB (132MB = 4MB * 33)
-        local_pd_ptr[33] = video_mem_entry;
+/**
+ * clone_process_kernel
+ * Gives a process slot a fresh address space with just the kernel half, the vidmap page and the
+ * kernel's data page (read-only, see vdata.c).
+ *
+ * @param slot_num  number of the process
+ * @param vmem_addr address of video memory that the process's vidmap page should point to
+ */
+static void clone_process_kernel(uint32_t slot_num, void *vmem_addr) {
+    pd_entry *local_pd = get_process_pd(slot_num);
+    pt_entry *local_pt = get_process_pt(slot_num);
 
-        {
-            pt_entry my_entry;
+    paging_clone_kernel(local_pd);
 
-            my_entry.physical_addr_31_to_12 = (uint32_t) vmem_addr >> ADDRESS_SHIFT;
-            my_entry.global                 = 0;
-            my_entry.page_size_ignored      = 0;
-            my_entry.dirty                  = 0;
-            my_entry.accessed               = 0;
-            my_entry.cache_disabled         = 0;
-            my_entry.write_through          = 0;
-            my_entry.user_accessible        = 1;
-            my_entry.read_write             = 1;
-            my_entry.present                = 1;
-
-            local_pt_ptr[0] = my_entry;
-        }
+    memset(local_pt, 0, FOUR_KB_ALIGNED);
+    map_table(local_pd, VIDMAP_VIRT_ADDR, local_pt);
+    paging_map(local_pd, VIDMAP_VIRT_ADDR, (uint32_t) vmem_addr, PAGE_WRITE | PAGE_USER);
+    paging_map(local_pd, VDATA_VIRT_ADDR, (uint32_t) vdata_get_page(), PAGE_USER);
+}
 
-        for(i = 1; i < NUM_PT_ENTRIES; i++) {
-            // We only support up to MAX_PROCESSES, rest of the page table entries should be non present
-            pt_entry my_entry;
-            my_entry.present = 0;
+/**
+ * setup_process_paging
+ * Sets up paging for a single process. Its user page (128MB to 132MB) is a page table of 4kB pages
+ * that all start out not present; handle_page_fault gives the process a frame for each page the
+ * first time it touches it.
+ * 
+ * @param slot_num  number of the process. Used to find the process's page structures.
+ * @param vmem_addr address of video memory that the process's vidmap page should point to.
+ *
+ * @return          The process's page directory, or NULL if there isn't enough free memory
+ */
+pd_entry *setup_process_paging(uint32_t slot_num, void *vmem_addr) {
+    pd_entry *local_pd = get_process_pd(slot_num);
+    pt_entry *user_pt;
+
+    /* Set up the user page (128MB to 132MB) with nothing mapped yet */
+    user_pt = (pt_entry*) alloc_user_frame();
+    if(user_pt == NULL) return NULL;
+    memset(user_pt, 0, FOUR_KB_ALIGNED);
+
+    clone_process_kernel(slot_num, vmem_addr);
+    map_table(local_pd, PROCESS_VIRT_PAGE_START, user_pt);
+
+    // The slot's page directory may still be loaded from a process that used it before
+    flush_if_loaded(local_pd);
+
+    return local_pd;
+}
+
+/**
+ * fork_process_paging
+ * Gives a child process a copy of its parent's address space without copying any memory. Both page
+ * tables point at the same frames, write protected and marked copy-on-write; whichever process
+ * writes to a page first gets a private copy of it in handle_page_fault.
+ *
+ * @param parent_slot   number of the process being copied
+ * @param child_slot    number of the new process
+ * @param vmem_addr     address of video memory that the child's vidmap page should point to
+ *
+ * @return              The child's page directory, or NULL if there isn't enough free memory
+ */
+pd_entry *fork_process_paging(uint32_t parent_slot, uint32_t child_slot, void *vmem_addr) {
+    pd_entry *parent_pd = get_process_pd(parent_slot);
+    pd_entry *child_pd = get_process_pd(child_slot);
+    pt_entry *parent_user_pt = get_user_pt(parent_pd);
+    pt_entry *child_user_pt;
+    int i;
+
+    if(parent_user_pt == NULL) return NULL;
 
-            local_pt_ptr[i] = my_entry;
+    child_user_pt = (pt_entry*) alloc_user_frame();
+    if(child_user_pt == NULL) return NULL;
+
+    clone_process_kernel(child_slot, vmem_addr);
+    map_table(child_pd, PROCESS_VIRT_PAGE_START, child_user_pt);
+
+    for(i = 0; i < NUM_PT_ENTRIES; i++) {
+        pt_entry entry = parent_user_pt[i];
+
+        if(entry.present) {
+            if(entry.read_write) {
+                entry.read_write = 0;
+                entry.cow = 1;
+                parent_user_pt[i] = entry;
+            }
+            frame_get(entry.physical_addr_31_to_12 << ADDRESS_SHIFT);
         }
+        child_user_pt[i] = entry;
     }
+
+    // The parent's writable pages just became read-only
+    flush_if_loaded(parent_pd);
+    flush_if_loaded(child_pd);
+
+    return child_pd;
 }
 
 /**
- * setup_process_paging
- * Sets up paging for a single process
- * 
- * @param process_addr  a pointer to processes address.
+ * release_process_paging
+ * Drops a process's references to its user frames and frees its user page table.
+ * Frames still shared with other processes stay in use until they're done with them too.
+ *
+ * @param slot_num  number of the process whose address space goes away
  */
-pd_entry *setup_process_paging(void *process_addr, uint32_t slot_num, void *vmem_addr) {
+void release_process_paging(uint32_t slot_num) {
     pd_entry *local_pd = get_process_pd(slot_num);
-    pt_entry *local_pt = get_process_pt(slot_num);
-    initialize_paging_structs(local_pd, local_pt, vmem_addr);
-    /* Set up Process Page Directory Entry (128MB to 132MB -> process_addr) */
-    {
-        pd_entry process_page_entry;
-
-        process_page_entry.physical_addr_31_to_12 = ((uint32_t) process_addr & ~(FOUR_MB_ALIGNED - 1)) >> ADDRESS_SHIFT; // Rodney: Is bitmask redundant? Won't process_addr already have bottom 22 bits as 0?
-        process_page_entry.global_ignored  = 0;
-        process_page_entry.page_size       = 1;
-        process_page_entry.dirty_ignored   = 0;
-        process_page_entry.accessed        = 0;
-        process_page_entry.cache_disabled  = 0;
-        process_page_entry.write_through   = 0;
-        process_page_entry.user_accessible = 1;
-        process_page_entry.read_write      = 1;
-        process_page_entry.present         = 1;
-
-        local_pd[32] = process_page_entry; // 32 represents the PD entry that will correspond to 128 MB in physical memory (since 32 * 4 = 128)
+    pt_entry *user_pt = get_user_pt(local_pd);
+    uint32_t vaddr;
+    uint32_t frame;
+
+    if(user_pt == NULL) return;
+
+    for(vaddr = PROCESS_VIRT_PAGE_START; vaddr < PROCESS_VIRT_PAGE_START + PROCESS_PAGE_SIZE; vaddr += FOUR_KB_ALIGNED) {
+        frame = paging_unmap(local_pd, vaddr);
+        if(frame != 0) {
+            frame_put(frame);
+        }
     }
 
-    // Make process video memory user accessible
-    local_pt[0].user_accessible = 1;
+    local_pd[USER_PD_INDEX].present = 0;
+    frame_put((uint32_t) user_pt);
+}
 
-    return local_pd;
+/**
+ * handle_page_fault
+ * Resolves page faults in the user page of the current address space:
+ *    1) The first access to a page that isn't present yet maps the frame load_program_page picks for it:
+ *       the program's cached copy of the page (copy-on-write if the segment is writable), or a private
+ *       frame. Pages of read-only segments stay read-only, so writing to them is a real fault.
+ *    2) A write to a copy-on-write page gives the writer a copy of its own if other processes still
+ *       share the frame; if it is the last one, the page is simply made writable again.
+ * Works for faults from the kernel too (e.g. a syscall filling a user buffer), since CR0.WP makes
+ * supervisor writes honor read-only pages.
+ *
+ * @param error     The error code the CPU pushed for the page fault
+ *
+ * @return          0 if the fault was resolved and the access can be retried, -1 if it is a real fault
+ */
+int32_t handle_page_fault(uint32_t error) {
+    uint32_t addr;
+    uint32_t cr3;
+    uint32_t old_frame;
+    uint32_t frame;
+    pd_entry *pd;
+    pt_entry *entry;
+
+    read_cr2(addr);
+    read_cr3(cr3);
+    pd = (pd_entry*) cr3;
+
+    if(addr < PROCESS_VIRT_PAGE_START || addr >= PROCESS_VIRT_PAGE_START + PROCESS_PAGE_SIZE) return -1;
+
+    entry = get_pte(pd, addr);
+    if(entry == NULL) return -1;
+    addr &= ~(FOUR_KB_ALIGNED - 1);
+
+    if(!(error & PF_ERR_PRESENT)) {
+        uint8_t writable;
+        uint8_t shared;
+
+        frame = load_program_page(addr, &writable, &shared);
+
+        if(frame == 0) return -1;
+
+        if(shared) {
+            stats.shared_faults++;
+        } else {
+            stats.private_faults++;
+        }
+
+        // Shared frames stay read-only; writable ones are copied on the first write
+        if(!writable) {
+            paging_map(pd, addr, frame, PAGE_USER);
+        } else if(shared) {
+            paging_map(pd, addr, frame, PAGE_USER | PAGE_COW);
+        } else {
+            paging_map(pd, addr, frame, PAGE_USER | PAGE_WRITE);
+        }
+        return 0;
+    }
+
+    if(!(error & PF_ERR_WRITE) || !entry->cow) return -1;
+
+    stats.cow_faults++;
+    old_frame = entry->physical_addr_31_to_12 << ADDRESS_SHIFT;
+
+    if(frame_refcount(old_frame) == 1) {
+        // Everyone else already got their own copy
+        frame = old_frame;
+        stats.cow_reuses++;
+    } else {
+        frame = alloc_user_frame();
+        if(frame == 0) return -1;
+
+        // Both frames are identity mapped, so no temporary mapping is needed
+        memcpy((void*) frame, (void*) old_frame, FOUR_KB_ALIGNED);
+        frame_put(old_frame);
+        stats.cow_copies++;
+    }
+
+    paging_map(pd, addr, frame, PAGE_USER | PAGE_WRITE);
+    return 0;
 }
 
-void flush_tlb() {
-    asm volatile(
-        "mov %%cr3, %%eax\r\n"
-        "mov %%eax, %%cr3\r\n"
-        :
-        :
-        : "memory", "eax"
-    );
+/**
+ * paging_get_stats
+ * Reports how many copy-on-write faults were handled.
+ *
+ * @param stats_out     Filled in with the paging statistics
+ */
+void paging_get_stats(paging_stats_t *stats_out) {
+    *stats_out = stats;
 }
 
 /**
  * set_process_vmem_page
  * Updates the process's page tables to point to virtual memory.
  * 
- * @param slot_num  number of the process. Between 0 and (MAX_PROCESSES-1). Used to find process's page tables.
+ * @param slot_num  number of the process. Between 0 and (get_max_processes()-1). Used to find process's page tables.
  * @param vmem_addr address of video memory that will be saved by the process's page table.
  */
 void set_process_vmem_page(uint32_t slot_num, void *vmem_addr) {
     pt_entry *local_pt = get_process_pt(slot_num);
-    local_pt[0].physical_addr_31_to_12 = (uint32_t) vmem_addr >> ADDRESS_SHIFT;
-    local_pt[0].present = 1;
-    flush_tlb();
+
+    // Nothing changed, so the TLB can't be stale
+    if(local_pt[0].present && local_pt[0].physical_addr_31_to_12 == (uint32_t) vmem_addr >> ADDRESS_SHIFT) return;
+
+    paging_map(get_process_pd(slot_num), VIDMAP_VIRT_ADDR, (uint32_t) vmem_addr, PAGE_WRITE | PAGE_USER);
 }
 
 /**
  * get_process_vmem_page
  * Returns a static virtual memory address (132 MB) which is where our process VMEM (video memory) page is located
  *
- * @param process_slot  The number of the process to return the VMEM page for. Between 0 and (MAX_PROCESSES-1). This number is discarded though.
+ * @param process_slot  The number of the process to return the VMEM page for. Between 0 and (get_max_processes()-1). This number is discarded though.
  */
 void *get_process_vmem_page(uint32_t process_slot) {
     // Always 132MB
-    return (void*) (33 * FOUR_MB_ALIGNED); // 33 Represents the PD entry that will correspond to 132 MB, which is where the Process VMEM page is located.
+    return (void*) VIDMAP_VIRT_ADDR;
 }
@@ -0,0 +1,322 @@
+#include <arch/x86/smp.h>
+#include <arch/x86/apic.h>
+#include <arch/x86/mptable.h>
+#include <arch/x86/paging.h>
+#include <arch/x86/tlb.h>
+#include <arch/x86/fpu.h>
+#include <arch/x86/sysenter.h>
+#include <arch/x86/io.h>
+#include <kernel/sched.h>
+#include <lib/lib.h>
+
+/*
+ * Multiprocessor support. The boot CPU finds the other CPUs in the BIOS's MP configuration table
+ * (mptable.c) and starts them with INIT/STARTUP IPIs. They come up in real mode in the trampoline
+ * (smp_asm.S), which switches to protected mode and calls smp_ap_main on the CPU's idle task stack.
+ * From there each CPU runs the processes on its own run queue (see sched.c), timing its slices with
+ * its local APIC timer.
+ *
+ * If there is no MP table or no local APIC, only the boot CPU is used, exactly as before.
+ */
+
+/* Delays of the startup sequence from the MP specification (appendix B.4), in microseconds */
+#define SMP_INIT_DELAY_US       10000
+#define SMP_STARTUP_DELAY_US    200
+#define SMP_ONLINE_TIMEOUT_US   100000
+#define SMP_STARTUP_TRIES       2
+
+/* Unused port; writing it takes about a microsecond on the ISA bus */
+#define DELAY_PORT              0x80
+
+/* Trampoline code and its GDTR operand (smp_asm.S). Copied to SMP_TRAMPOLINE_ADDR */
+extern uint8_t smp_trampoline_start[];
+extern uint8_t smp_trampoline_gdtr[];
+extern uint8_t smp_trampoline_end[];
+
+/* CPUs listed in the MP table (the boot CPU is index 0), and how many of them are running */
+static uint32_t num_cpus = 1;
+static uint32_t num_online = 1;
+static uint8_t cpu_apic_id[SMP_MAX_CPUS];
+static volatile uint8_t cpu_online[SMP_MAX_CPUS] = { 1 };
+
+/* Index of the CPU being started, which it reads once it's running. SMP_MAX_CPUS if none is */
+static volatile uint32_t booting_cpu = SMP_MAX_CPUS;
+
+/* Initial stack of the CPU being started (read by the trampoline) */
+uint32_t smp_ap_stack;
+
+/* Task state segments of the other CPUs. The boot CPU uses tss (x86_desc.S) */
+static tss_t ap_tss[SMP_MAX_CPUS - 1];
+
+/**
+ * udelay
+ * Busy-waits for roughly the given time. Only used while starting the other CPUs, before the PIT runs.
+ *
+ * @param us    Microseconds to wait
+ */
+static void udelay(uint32_t us) {
+    while(us-- > 0) {
+        outportb(DELAY_PORT, 0);
+    }
+}
+
+/**
+ * smp_init
+ * Gets everything ready to start the other CPUs found by mp_init: maps the local APIC and copies
+ * the trampoline to low memory. Must be called after paging_init but before paging is enabled.
+ */
+void smp_init() {
+    uint32_t lapic_base = lapic_detect();
+    uint32_t i;
+
+    if(lapic_base == 0) return;
+
+    // Number the CPUs from the boot CPU, whichever the table says it is
+    cpu_apic_id[0] = lapic_id();
+    for(i = 0; i < mp_num_cpus(); i++) {
+        if(mp_cpu_apic_id(i) != cpu_apic_id[0] && num_cpus < SMP_MAX_CPUS) {
+            cpu_apic_id[num_cpus++] = mp_cpu_apic_id(i);
+        }
+    }
+    if(num_cpus < 2) return;
+
+    // Every address space needs the local APIC's registers, since interrupts arrive in any of them
+    paging_map_mmio(lapic_base);
+
+    // The trampoline loads the kernel's GDT itself; the real mode code can't reach the kernel page
+    memcpy((void*) SMP_TRAMPOLINE_ADDR, smp_trampoline_start, smp_trampoline_end - smp_trampoline_start);
+    {
+        uint8_t *gdtr = (uint8_t*) SMP_TRAMPOLINE_ADDR + (smp_trampoline_gdtr - smp_trampoline_start);
+        *(uint16_t*) gdtr = gdt_size;
+        *(uint32_t*) (gdtr + sizeof(uint16_t)) = (uint32_t) &gdt;
+    }
+}
+
+/**
+ * smp_boot_aps
+ * Starts the other CPUs, one at a time, and waits for each to reach its idle task. The scheduler
+ * must be initialized. A CPU that doesn't respond is given up on, along with the ones after it.
+ */
+void smp_boot_aps() {
+    uint32_t cpu;
+
+    if(num_cpus < 2) return;
+
+    lapic_init(1);
+    lapic_timer_calibrate(SCHED_TICK_HZ);
+
+    for(cpu = 1; cpu < num_cpus; cpu++) {
+        uint32_t waited;
+        int i;
+
+        booting_cpu = cpu;
+        smp_ap_stack = (uint32_t) sched_get_idle_stack(cpu);
+
+        lapic_send_init(cpu_apic_id[cpu]);
+        udelay(SMP_INIT_DELAY_US);
+
+        for(i = 0; i < SMP_STARTUP_TRIES && !cpu_online[cpu]; i++) {
+            lapic_send_startup(cpu_apic_id[cpu], SMP_TRAMPOLINE_ADDR);
+            udelay(SMP_STARTUP_DELAY_US);
+        }
+
+        for(waited = 0; waited < SMP_ONLINE_TIMEOUT_US && !cpu_online[cpu]; waited++) {
+            udelay(1);
+        }
+        if(!cpu_online[cpu]) break;
+
+        num_online++;
+    }
+
+    // A CPU that shows up late finds no work and halts
+    booting_cpu = SMP_MAX_CPUS;
+}
+
+/**
+ * smp_load_tss
+ * Points a CPU's TSS descriptor at its TSS and loads it. The CPU's index can be told from its task
+ * register from then on (see smp_cpu_id).
+ *
+ * @param cpu   Index of the calling CPU (not the boot CPU)
+ */
+static void smp_load_tss(uint32_t cpu) {
+    seg_desc_t the_tss_desc;
+    tss_t *cpu_tss = &ap_tss[cpu - 1];
+
+    the_tss_desc.granularity    = 0;
+    the_tss_desc.opsize         = 0;
+    the_tss_desc.reserved       = 0;
+    the_tss_desc.avail          = 0;
+    the_tss_desc.present        = 1;
+    the_tss_desc.sys            = 0;
+    the_tss_desc.type           = 0x9;
+
+    // Make accessible from ring 3, like the boot CPU's
+    the_tss_desc.dpl            = 0x3;
+
+    SET_TSS_PARAMS(the_tss_desc, cpu_tss, tss_size);
+    ap_tss_desc_ptr[cpu - 1] = the_tss_desc;
+
+    cpu_tss->ldt_segment_selector = KERNEL_LDT;
+    cpu_tss->ss0 = KERNEL_DS;
+    cpu_tss->esp0 = (uint32_t) sched_get_idle_stack(cpu);
+    ltr(AP_TSS(cpu));
+}
+
+/**
+ * smp_ap_main
+ * Entry point of the other CPUs, called by the trampoline in protected mode with paging off. Sets up
+ * the CPU like kernel.c set up the boot CPU, then becomes its idle task. Does not return.
+ */
+void smp_ap_main() {
+    uint32_t cpu = booting_cpu;
+
+    if(cpu == 0 || cpu >= num_cpus) {
+        for(;;) {
+            asm volatile("cli; hlt");
+        }
+    }
+
+    enable_paging(paging_kernel_pd());
+    tlb_init();
+    lidt(idt_desc_ptr);
+    lldt(KERNEL_LDT);
+    smp_load_tss(cpu);
+    fpu_init_cpu();
+    sysenter_init_cpu();
+    lapic_init(0);
+
+    cpu_online[cpu] = 1;
+    sched_run_idle();
+}
+
+/**
+ * smp_cpu_id
+ * Get the index of the calling CPU, from the TSS it has loaded.
+ *
+ * @return      0 on the boot CPU, 1 to SMP_MAX_CPUS - 1 on the others
+ */
+uint32_t smp_cpu_id() {
+    uint16_t selector;
+
+    asm volatile("str %0" : "=r"(selector));
+    if(selector < AP_TSS_BASE) return 0;
+    return (selector - AP_TSS_BASE) / sizeof(seg_desc_t) + 1;
+}
+
+/**
+ * smp_num_cpus
+ * Get the number of CPUs running. CPUs are numbered from 0 without gaps.
+ *
+ * @return      The number of CPUs (1 until smp_boot_aps has run)
+ */
+uint32_t smp_num_cpus() {
+    return num_online;
+}
+
+/**
+ * smp_get_tss
+ * Get the TSS of a CPU, whose esp0 must point at the kernel stack of the process it runs.
+ *
+ * @param cpu   The CPU's index
+ *
+ * @return      Its TSS
+ */
+tss_t *smp_get_tss(uint32_t cpu) {
+    return (cpu == 0) ? &tss : &ap_tss[cpu - 1];
+}
+
+/**
+ * smp_send_others
+ * Raises an interrupt on every other running CPU.
+ *
+ * @param vector    The interrupt vector
+ */
+static void smp_send_others(uint8_t vector) {
+    uint32_t self;
+    uint32_t cpu;
+
+    if(num_online < 2) return;
+
+    // The shorthand would also reach CPUs that didn't start
+    if(num_online == num_cpus) {
+        lapic_send_ipi_others(vector);
+        return;
+    }
+
+    self = smp_cpu_id();
+    for(cpu = 0; cpu < num_online; cpu++) {
+        if(cpu != self) {
+            lapic_send_ipi(cpu_apic_id[cpu], vector);
+        }
+    }
+}
+
+/**
+ * smp_send_reschedule
+ * Tells another CPU that its run queue changed.
+ *
+ * @param cpu   The CPU's index
+ */
+void smp_send_reschedule(uint32_t cpu) {
+    if(cpu < num_online) {
+        lapic_send_ipi(cpu_apic_id[cpu], SMP_RESCHED_VEC);
+    }
+}
+
+/**
+ * smp_broadcast_tick
+ * Passes a PIT interrupt on to the other CPUs, so that they can enforce their timeslices. Not
+ * needed if they have their local APIC timers for that.
+ */
+void smp_broadcast_tick() {
+    if(lapic_timer_available()) return;
+    smp_send_others(SMP_TICK_VEC);
+}
+
+/**
+ * smp_flush_tlb_others
+ * Makes the other CPUs drop their user TLB entries after a mapping of one of their processes was
+ * changed. Doesn't wait for them: the IPI is taken before the CPU runs any user code again.
+ */
+void smp_flush_tlb_others() {
+    smp_send_others(SMP_TLB_VEC);
+}
+
+/**
+ * smp_tick_handler
+ * Handles a tick IPI from the boot CPU.
+ */
+void smp_tick_handler() {
+    // Acknowledge before scheduling, since we may not return here until this process runs again
+    lapic_eoi();
+    scheduler();
+}
+
+/**
+ * smp_resched_handler
+ * Handles a reschedule IPI.
+ */
+void smp_resched_handler() {
+    lapic_eoi();
+    sched_ipi();
+}
+
+/**
+ * smp_tlb_handler
+ * Handles a TLB shootdown IPI.
+ */
+void smp_tlb_handler() {
+    tlb_flush_all();
+    lapic_eoi();
+}
+
+/**
+ * smp_timer_handler
+ * Handles the local APIC timer, which fires when the current process's timeslice is over.
+ */
+void smp_timer_handler() {
+    // Acknowledge before scheduling, since we may not return here until this process runs again
+    lapic_eoi();
+    sched_timeslice_expired();
+}
@@ -0,0 +1,56 @@
+#include <arch/x86/sysenter.h>
+#include <arch/x86/cpu.h>
+#include <arch/x86/smp.h>
+#include <arch/x86/x86_desc.h>
+
+/*
+ * Fast system calls. Besides INT $0x80, user programs may enter the kernel with sysenter when the
+ * CPU has it (ece391syscall.S checks CPUID the same way as sysenter_init). sysenter skips the IDT
+ * and the iret frame; it just loads CS, EIP and ESP from MSRs. The stack it loads can't follow the
+ * current process's kernel stack without rewriting an MSR on every context switch, so it points at
+ * the esp0 field of the CPU's TSS instead, which sysenter_handler loads the real stack pointer from.
+ * The GDT already has the layout sysexit needs: user CS and SS follow the kernel's.
+ */
+
+/* Set once the boot CPU has found sysenter */
+static uint32_t available = 0;
+
+/**
+ * sysenter_init_cpu
+ * Points the calling CPU's sysenter MSRs at sysenter_handler. Its TSS must be loaded, and
+ * sysenter_init must have run on the boot CPU.
+ */
+void sysenter_init_cpu() {
+    if(!available) return;
+
+    wrmsr(MSR_SYSENTER_CS, KERNEL_CS);
+    wrmsr(MSR_SYSENTER_ESP, (uint32_t) &smp_get_tss(smp_cpu_id())->esp0);
+    wrmsr(MSR_SYSENTER_EIP, (uint32_t) sysenter_handler);
+}
+
+/**
+ * sysenter_init
+ * Checks whether the CPU has sysenter/sysexit and, if so, enables them on the boot CPU.
+ */
+void sysenter_init() {
+    uint32_t eax, ebx, ecx, edx;
+
+    cpuid(CPUID_FEATURES, eax, ebx, ecx, edx);
+    available = (edx & CPUID_EDX_SEP) != 0;
+    if((eax & SYSENTER_CPUID_FAMILY_MASK) == SYSENTER_CPUID_FAMILY_P6 &&
+       (eax & SYSENTER_CPUID_MODEL_STEP_MASK) < SYSENTER_CPUID_FIRST_P6_SEP) {
+        available = 0;
+    }
+
+    sysenter_init_cpu();
+}
+
+/**
+ * sysenter_available
+ * Checks whether user programs can make system calls with sysenter.
+ *
+ * @return      1 if they can, 0 if the CPU doesn't support it
+ */
+uint32_t sysenter_available() {
+    return available;
+}
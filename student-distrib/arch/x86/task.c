@@ -2,15 +2,197 @@
 #include <lib/lib.h>
 #include <arch/x86/task.h>
 #include <fs/fs.h>
+#include <fs/ece391_fs.h>
 #include <lib/file.h>
 #include <tty/terminal.h>
 #include <drivers/pit.h>
-#include <arch/x86/i8259.h>
+#include <arch/x86/irq.h>
 #include <kernel/syscall.h>
+#include <kernel/sched.h>
+#include <kernel/timer.h>
+#include <arch/x86/frame.h>
+#include <arch/x86/tlb.h>
+#include <arch/x86/elf.h>
+#include <arch/x86/smp.h>
+#include <arch/x86/spinlock.h>
+
+/* Size of the process table, decided at boot from the amount of physical memory */
+static uint32_t max_processes = 0;
+
+/* Task block of every slot used so far. Slots 0 to num_slots-1 have one; it is kept when the slot is freed */
+static task_block_t *task_blocks[MAX_PROCESSES_LIMIT];
+static uint32_t num_slots = 0;
+
+/* Stack of unused process slots, so allocating and freeing a PCB is O(1) */
+static uint16_t free_slots[MAX_PROCESSES_LIMIT];
+static uint32_t num_free_slots = 0;
+
+/* Protects the free slot stack and the task block table */
+static spinlock_t pcb_lock = SPINLOCK_INIT;
 
 inline uint32_t get_next_pid() {
     static uint32_t next_pid = 0;
-    return next_pid++;
+    uint32_t pid;
+
+    atomic_fetch_add(&next_pid, 1, pid);
+    return pid;
+}
+
+/**
+ * task_init
+ * Sizes the process table to fit in physical memory. Task blocks are only allocated as slots are
+ * first used, so small machines don't set aside memory for processes they can't run anyway.
+ * The frame allocator must have been given the machine's memory already.
+ */
+void task_init() {
+    frame_stats_t frames;
+
+    frame_get_stats(&frames);
+    max_processes = frames.total / (PROCESS_MIN_MEMORY / FRAME_SIZE);
+    if(max_processes > MAX_PROCESSES_LIMIT) max_processes = MAX_PROCESSES_LIMIT;
+
+    num_slots = 0;
+    num_free_slots = 0;
+}
+
+/**
+ * get_max_processes
+ * Get the number of process slots that fit in physical memory.
+ *
+ * @return      The size of the process table
+ */
+uint32_t get_max_processes() {
+    return max_processes;
+}
+
+/**
+ * get_num_slots
+ * Get the number of process slots that have been used so far. Every slot below this number has a
+ * PCB (in use or not), so this is the bound for loops over all processes.
+ *
+ * @return      The number of slots with a task block
+ */
+uint32_t get_num_slots() {
+    return num_slots;
+}
+
+/**
+ * allocate_task_block
+ * Gets a task block for the next never-used slot.
+ *
+ * @return      A pointer to the new slot's PCB, or NULL if the table is full or memory is exhausted
+ */
+static pcb_t *allocate_task_block() {
+    task_block_t *block;
+    pcb_t *pcb;
+
+    if(num_slots >= max_processes) return NULL;
+
+    block = (task_block_t*) frame_alloc_pages(TASK_BLOCK_ORDER);
+    if(block == NULL && image_cache_reclaim() > 0) {
+        block = (task_block_t*) frame_alloc_pages(TASK_BLOCK_ORDER);
+    }
+    if(block == NULL) return NULL;
+
+    // Frames are handed out as they were freed (e.g. old user pages), so start from a clean PCB
+    memset(block, 0, sizeof(task_block_t));
+
+    pcb = &block->pcb;
+    pcb->slot_num = num_slots;
+    pcb->status = PROCESS_NONE;
+
+    // Loops over the slots don't take pcb_lock, so the block must be in the table before num_slots
+    // counts it. x86 doesn't reorder stores with each other, so only the compiler has to be kept from doing so.
+    task_blocks[num_slots] = block;
+    asm volatile("" : : : "memory");
+    num_slots++;
+    return pcb;
+}
+
+/**
+ * allocate_pcb
+ * Takes a free process slot off the free list, or sets up a new slot if none is free.
+ *
+ * @return      A pointer to the slot's PCB (with slot_num set), or NULL if every slot is in use or memory is exhausted
+ */
+pcb_t *allocate_pcb() {
+    uint32_t flags;
+    pcb_t *pcb = NULL;
+
+    spin_lock_irqsave(&pcb_lock, flags);
+    if(num_free_slots > 0) {
+        pcb = get_pcb_from_slot(free_slots[--num_free_slots]);
+    } else {
+        pcb = allocate_task_block();
+    }
+    if(pcb != NULL) {
+        pcb->in_use = 1;
+        pcb->process_pd_ptr = NULL;
+        pcb->image = NULL;
+        pcb->forked = 0;
+        pcb->wait_queue = NULL;
+
+        // A reused slot still has the descriptors of the process that had it before
+        memset(pcb->fa, 0, sizeof(pcb->fa));
+        pcb->rtc_enabled = 0;
+    }
+    spin_unlock_irqrestore(&pcb_lock, flags);
+
+    return pcb;
+}
+
+/**
+ * free_pcb
+ * Releases a process's user memory and returns its slot to the free list. The current process's
+ * slot can't be handed out while its CPU still runs on the slot's kernel stack, so it is only marked
+ * as exited; the scheduler calls release_pcb_slot once it has switched away.
+ *
+ * @param pcb   The PCB of the process slot to release
+ */
+void free_pcb(pcb_t *pcb) {
+    fpu_release(pcb);
+    if(pcb->process_pd_ptr != NULL) {
+        release_process_paging(pcb->slot_num);
+        pcb->process_pd_ptr = NULL;
+    }
+    if(pcb->image != NULL) {
+        image_cache_put(pcb->image);
+        pcb->image = NULL;
+    }
+    pcb->in_use = 0;
+
+    if(pcb == get_current_pcb()) {
+        pcb->status = PROCESS_EXITED;
+    } else {
+        release_pcb_slot(pcb);
+    }
+}
+
+/**
+ * release_pcb_slot
+ * Puts a freed process slot back on the free list.
+ *
+ * @param pcb   The PCB of the slot. Nothing may run on its kernel stack any more
+ */
+void release_pcb_slot(pcb_t *pcb) {
+    uint32_t flags;
+
+    spin_lock_irqsave(&pcb_lock, flags);
+    pcb->status = PROCESS_NONE;
+    free_slots[num_free_slots++] = pcb->slot_num;
+    spin_unlock_irqrestore(&pcb_lock, flags);
+}
+
+/**
+ * get_task_block_from_slot
+ * Get the task block (kernel stack, PCB and paging structures) that belongs to a process slot.
+ *
+ * @param pcb_slot  The process's current process slot
+ *
+ * @return          A pointer to the process's task block
+ */
+inline task_block_t *get_task_block_from_slot(uint32_t pcb_slot) {
+    return task_blocks[pcb_slot];
 }
 
 /**
@@ -26,7 +208,7 @@ inline pcb_t *get_pcb_from_esp(void *process_esp) {
     // Subtract 1 first in case stack hasn't been used yet (otherwise
     // the bitmask won't do anything), then AND out the bits representing
     // 8kB worth of memory space
-    return (pcb_t *) ((uint32_t) (process_esp - 1) & PCB_BITMASK);
+    return (pcb_t *) (((uint32_t) process_esp - 1) & PCB_BITMASK);
 }
 
 /**
@@ -38,9 +220,8 @@ inline pcb_t *get_pcb_from_esp(void *process_esp) {
  * @return          A pointer to the process's PCB
  */
 inline pcb_t *get_pcb_from_slot(uint32_t pcb_slot) {
-    // Take the end of the kernel page, subtract (8kB * (process # + 1)) to get
-    // to the end of that process's kernel stack, which is also where its PCB is
-    return (pcb_t*) (KERNEL_PAGE_END - (KERNEL_STACK_SIZE * (pcb_slot + 1)));
+    // The PCB is at the end of the process's kernel stack, which is the start of its task block
+    return &get_task_block_from_slot(pcb_slot)->pcb;
 }
 
 /**
@@ -78,23 +259,8 @@ inline void *get_current_kernel_stack_base() {
  * @return          A pointer to the start of the process's kernel stack
  */
 inline void *get_kernel_stack_base_from_slot(uint32_t pcb_slot) {
-    // Starting from the end of the kernel page, subtract (8kB * process #)
-    // to get to the beginning of a process stack
-    return (void*) (KERNEL_PAGE_END - (KERNEL_STACK_SIZE * pcb_slot));
-}
-
-/**
- * get_process_page_from_slot
- * Get a pointer to the beginning of a process's 4MB memory page.
- * 
- * @param task_slot     The process's current process slot
- *
- * @return              A pointer to the start of the process's memory page
- */
-inline void *get_process_page_from_slot(uint32_t task_slot) {
-    // Starting from the end of the kernel page, add (4MB * process #)
-    // to get to the beginning of a process page
-    return (void*) (KERNEL_PAGE_END + (PROCESS_PAGE_SIZE * task_slot));
+    // The stack grows down from the top of the kernel stack area in the task block
+    return (void*) (get_task_block_from_slot(pcb_slot)->kernel_stack + KERNEL_STACK_SIZE);
 }
 
 /**
@@ -132,37 +298,36 @@ void open_stdin_and_stdout(pcb_t *pcb) {
 
 /**
  * kernel_run_first_program
- * Clears all PCBs, then sets up an execution environment and runs a program. Does not return.
+ * Sets up an execution environment and runs a program on every terminal. Does not return.
+ * task_init and sched_init must have been called first, and the other CPUs started.
  * 
  * @param command   Pointer to a string containing the name of a command (and arguments, space separated, if desired)
  */
 void kernel_run_first_program(const int8_t* command) {
     cli();
 
-    // Clear kernel PCBs
-    int i;
-    for(i = 0; i < MAX_PROCESSES; i++) {
-        pcb_t *current_pcb = get_pcb_from_slot(i);
-        current_pcb->in_use = 0;
-        current_pcb->slot_num = i;
-        current_pcb->status = PROCESS_NONE;
-    }
     multiple_terminal_init();
+    timer_init();
 
+    int i;
+    pcb_t *first_pcb = NULL;
     for(i = 0; i < NUM_TERMINALS; i++) {
-        pcb_t *child_pcb = get_pcb_from_slot(i);
+        pcb_t *child_pcb = allocate_pcb();
+        if(child_pcb == NULL) return;
+        if(first_pcb == NULL) first_pcb = child_pcb;
 
         // Save program name and args in the child process's PCB
         parse_command(command, child_pcb->program_name, child_pcb->args);
 
-        // Load program and determine entrypoint
-        uint32_t entrypoint = load_program_into_slot(child_pcb->program_name, child_pcb->slot_num);
-        if(entrypoint == NULL) return;
-        child_pcb->entrypoint = entrypoint;
-
         // Process paging
         void *vmem_ptr = get_terminal_output_buffer(i);
-        child_pcb->process_pd_ptr = setup_process_paging(get_process_page_from_slot(child_pcb->slot_num), child_pcb->slot_num, vmem_ptr);
+        child_pcb->process_pd_ptr = setup_process_paging(child_pcb->slot_num, vmem_ptr);
+        if(child_pcb->process_pd_ptr == NULL) return;
+
+        // Find the program and determine entrypoint. Its pages are loaded as the shell touches them.
+        uint32_t entrypoint = load_program(child_pcb, child_pcb->program_name);
+        if(entrypoint == NULL) return;
+        child_pcb->entrypoint = entrypoint;
 
         // Set up this process's PCB
         child_pcb->parent = NULL;
@@ -171,16 +336,25 @@ void kernel_run_first_program(const int8_t* command) {
         child_pcb->pid = get_next_pid();
         child_pcb->status = PROCESS_RUNNING;
         child_pcb->terminal_num = i;
+        sched_task_init(child_pcb, NULL);
         open_stdin_and_stdout(child_pcb);
+
+        // The first time the scheduler switches to this shell, it starts the program
+        prepare_kernel_stack(child_pcb, get_kernel_stack_base_from_slot(child_pcb->slot_num), enter_user_program);
+
+        // Every shell is runnable from the start
+        sched_enqueue(child_pcb);
     }
-    pcb_t *child_pcb = get_pcb_from_slot(0);
-    enable_paging(child_pcb->process_pd_ptr);
+    // The first shell is on the boot CPU; the other CPUs were sent IPIs for theirs as they were enqueued
+    pcb_t *child_pcb = first_pcb;
+    sched_start(child_pcb);
+    tlb_load_pd(child_pcb->process_pd_ptr);
 
     // Prepare for context switch
     set_kernel_stack(get_kernel_stack_base_from_slot(child_pcb->slot_num));
 
     // Enable scheduling/sleep
-    pit_init(100);
+    pit_init(SCHED_TICK_HZ);
     enable_irq(PIT_IRQ);
 
     // Start the program
@@ -209,6 +383,13 @@ int32_t halt_program(int32_t status) {
 
     pcb_t *parent_pcb = child_pcb->parent;
 
+    // Forked processes run alongside their parent, which isn't waiting for them. Just give the CPU away.
+    if(child_pcb->forked) {
+        sched_dequeue(child_pcb);
+        free_pcb(child_pcb);
+        schedule();
+    }
+
     // If this process does not have a parent, then it should be restarted
     if(parent_pcb == NULL) { 
         reset_terminal(child_pcb->terminal_num);
@@ -221,6 +402,10 @@ int32_t halt_program(int32_t status) {
         child_pcb->status = PROCESS_RUNNING;
         open_stdin_and_stdout(child_pcb);
 
+        // The new program starts with a clean FPU
+        fpu_release(child_pcb);
+        fpu_switch(child_pcb);
+
         // Prepare for context switch
         set_kernel_stack(get_kernel_stack_base_from_slot(child_pcb->slot_num));
 
@@ -228,105 +413,89 @@ int32_t halt_program(int32_t status) {
         switch_to_ring_3(PROCESS_LINK_START, child_pcb->entrypoint);
     }
 
-    child_pcb->status = PROCESS_NONE;
+    // The child can never run again; the parent picks up where it left off.
+    // The slot is only reused once context_switch has taken us off its kernel stack.
+    sched_account_switch(child_pcb, parent_pcb, 1);
+    sched_dequeue(child_pcb);
+    free_pcb(child_pcb);
+
+    // Wake the parent up with the exit status; its execute returns it
+    parent_pcb->child = NULL;
+    parent_pcb->child_status = status;
     parent_pcb->status = PROCESS_RUNNING;
+    sched_enqueue(parent_pcb);
 
-    // Change the page table and TSS esp0/kernel stack to that of the parent process
-    enable_paging(parent_pcb->process_pd_ptr);
-    set_kernel_stack(get_kernel_stack_base_from_slot(parent_pcb->slot_num));
-
-    /*
-    A little bit of ASM hackery here.
-    We have to do several things:
-    - Restore the parent process's esp and ebp
-    - Somehow jump to where the parent process left off
-    - Turn the status exit code into a 32 bit number and return it
-
-    Because we're using inline assembly, it's not a one-to-one translation to what
-    actually gets output. Loading something as a parameter into inline assembly is
-    complicated, and what makes things more annoying is parameters are based off of
-    their offset from ebp. So we have to make sure we take care of the exit code before
-    we restore ebp, otherwise we'll have garbage (hence why we do "mov status, %eax" first).
-    Also things may get loaded into intermediate registers; hence we push/pop the exit code
-    into eax.
-
-    When we restore esp and ebp for the parent process's kernel stack, the leave instruction
-    sets esp back to ebp, then pops the previous ebp from the stack. What's now on top of the
-    stack is the parent process's return address from the execute syscall. So in effect,
-    setting eax, restoring the registers and doing a leave/ret is essentially just returning
-    from the execute function without actually going back there.
-
-    Then we go back into the system call interrupt handler which restores the rest of the
-    registers for us (save eax because that holds the return value from the system call).
-    */
-    asm volatile(
-        "mov %0, %%esp\r\n"
-        "push %2\r\n"
-        "mov %1, %%ebp\r\n"
-        "pop %%eax\r\n"
-        "leave\r\n"
-        "ret\r\n"
-        :
-        : "r"(parent_pcb->regs.esp), "r"(parent_pcb->regs.ebp), "r"(status)
-        : "memory", "cc"
-    );
-
-    // We never reach this point; this is just to shut gcc up
+    context_switch(child_pcb, parent_pcb);
+
+    // We never reach this point, since nothing switches back to a halted process
     return -1;
 }
 
 /**
  * set_kernel_stack
- * Updates the TSS to use the given kernel stack, then flushes the TSS.
+ * Updates the calling CPU's TSS to use the given kernel stack. The CPU reads esp0 from the TSS on
+ * every switch to ring 0, so the TSS descriptor itself never has to be reloaded.
  * 
  * @param stack     Pointer to the stack to use when handling a syscall.
  */
 void set_kernel_stack(const void *stack) {
-    // Set TSS values
-    tss.ss0 = KERNEL_DS;
-    tss.esp0 = (uint32_t) stack;
-
-    // Reset the TSS entry in GDT (might not be necessary, but I had problems otherwise)
-    seg_desc_t the_tss_desc;
-    the_tss_desc.granularity    = 0;
-    the_tss_desc.opsize         = 0;
-    the_tss_desc.reserved       = 0;
-    the_tss_desc.avail          = 0;
-    the_tss_desc.seg_lim_19_16  = TSS_SIZE & 0x000F0000;
-    the_tss_desc.present        = 1;
-    the_tss_desc.sys            = 0;
-    the_tss_desc.type           = 0x9;
-
-    // Make accessible from ring 3
-    the_tss_desc.dpl            = 0x3;
-
-    SET_TSS_PARAMS(the_tss_desc, &tss, tss_size);
-    tss_desc_ptr = the_tss_desc;
-
-    // Flush the TSS
-    ltr(KERNEL_TSS);
+    smp_get_tss(smp_cpu_id())->esp0 = (uint32_t) stack;
+}
+
+/**
+ * prepare_kernel_stack
+ * Sets up a kernel stack that has never run so that the first switch_to to it "returns" into entry.
+ * 
+ * @param pcb           The PCB whose saved esp should point at the new stack
+ * @param stack_base    The top (highest address) of the kernel stack
+ * @param entry         Function to start running on the stack. It must never return.
+ */
+void prepare_kernel_stack(pcb_t *pcb, void *stack_base, void (*entry)(void)) {
+    uint32_t *esp = (uint32_t*) stack_base;
+
+    // Same layout switch_to leaves behind: return address, then ebp, ebx, esi, edi
+    *--esp = 0;                     // entry's return address; entry never returns
+    *--esp = (uint32_t) entry;
+    *--esp = 0;                     // ebp (0 ends stack traces here)
+    *--esp = 0;                     // ebx
+    *--esp = 0;                     // esi
+    *--esp = 0;                     // edi
+
+    pcb->regs.esp = (uint32_t) esp;
+}
+
+/**
+ * enter_user_program
+ * Where a new process starts running on its kernel stack (see prepare_kernel_stack).
+ * Jumps into the program loaded in the current process's page. Does not return.
+ */
+void enter_user_program() {
+    pcb_t *pcb = get_current_pcb();
+
+    switch_to_ring_3(PROCESS_LINK_START, pcb->entrypoint);
 }
 
 /**
  * get_executable_entrypoint
- * Verifies that a binary is in ELF format and determines its starting address.
+ * Verifies that a binary is a 32-bit x86 ELF executable and determines its starting address.
  * 
- * @param executable    Pointer to an executable in memory
+ * @param header    Pointer to the executable's ELF header
  *
- * @return              NULL if not a valid binary, else a 32-bit integer representing the start address
+ * @return          NULL if not a valid binary, else a 32-bit integer representing the start address
  */
-uint32_t get_executable_entrypoint(const void *executable) {
-    const int8_t *ptr = (const int8_t*) executable;
-
+uint32_t get_executable_entrypoint(const elf32_header_t *header) {
     // Check for ELF header
-    if(strncmp(ptr, ELF_MAGIC_HEADER, ELF_MAGIC_HEADER_LEN)) {
+    if(strncmp((const int8_t*) header->ident, ELF_MAGIC, ELF_MAGIC_LEN)) {
         return NULL;
     }
 
-    // Read entry point address
-    uint32_t addr = *((uint32_t*) &ptr[ELF_ENTRYPOINT_OFFSET]);
+    if(header->ident[ELF_IDENT_CLASS] != ELF_CLASS_32 || header->ident[ELF_IDENT_DATA] != ELF_DATA_LSB) return NULL;
+    if(header->type != ELF_TYPE_EXEC || header->machine != ELF_MACHINE_386) return NULL;
+
+    // The program has to start in its user page
+    if(header->entry < PROCESS_VIRT_PAGE_START || header->entry >= PROCESS_VIRT_PAGE_START + PROCESS_PAGE_SIZE) return NULL;
 
-    return addr;
+    return header->entry;
 }
 
 /**
@@ -369,24 +538,133 @@ int32_t parse_command(const int8_t *command, int8_t *buf_name, int8_t *buf_args)
     return len_args;
 }
 /**
- * load_program_into_slot
- * Load a program into a given process slot.
+ * load_program
+ * Prepares a process to run a program by reading the PT_LOAD segments from its ELF program headers.
+ * Nothing is copied yet: the process's user pages start out not present, and are filled by
+ * load_program_page the first time the program touches them, so starting a program costs only as
+ * much as the pages it actually uses.
  * 
+ * @param pcb       The process that will run the program
  * @param filename  Pointer to a string containing a filename to load
- * @param pcb_slot  An integer representing which process slot to use
  *
  * @return          NULL if not a valid program or nonexistent; start address otherwise
  */
-uint32_t load_program_into_slot(const int8_t *filename, uint32_t pcb_slot) {
-    // Get memory page and copy file into the correct location in that page
-    void *process_page = get_process_page_from_slot(pcb_slot);
-    int32_t retval = read_file_by_name(filename, process_page + PROCESS_LINK_OFFSET, PROCESS_PAGE_SIZE - PROCESS_LINK_OFFSET);
+uint32_t load_program(pcb_t *pcb, const int8_t *filename) {
+    dentry_t dentry;
+    elf32_header_t header;
+    elf32_phdr_t phdr;
+    uint32_t entrypoint;
+    int32_t size;
+    int i;
 
     // File doesn't exist
-    if(retval < 0) return NULL;
+    if(read_dentry_by_name(filename, &dentry) < 0) return NULL;
+    size = get_file_size(dentry.inode_num);
+    if(size < 0) return NULL;
+
+    // Can't possibly be a valid program (shorter than an ELF header)
+    if(read_data(dentry.inode_num, 0, (uint8_t*) &header, sizeof(header)) < (int32_t) sizeof(header)) return NULL;
+
+    entrypoint = get_executable_entrypoint(&header);
+    if(entrypoint == NULL || header.phentsize != sizeof(elf32_phdr_t)) return NULL;
+
+    pcb->num_segments = 0;
+    for(i = 0; i < header.phnum; i++) {
+        elf_segment_t *segment = &pcb->segments[pcb->num_segments];
+
+        if(read_data(dentry.inode_num, header.phoff + i * sizeof(phdr), (uint8_t*) &phdr, sizeof(phdr)) < (int32_t) sizeof(phdr)) return NULL;
+        if(phdr.type != ELF_PT_LOAD || phdr.memsz == 0) continue;
+        if(pcb->num_segments == ELF_MAX_LOAD_SEGMENTS) return NULL;
+
+        // The file part has to be in the file, and the whole segment in the user page
+        if(phdr.filesz > phdr.memsz || phdr.offset > size || phdr.filesz > size - phdr.offset) return NULL;
+        if(phdr.vaddr < PROCESS_VIRT_PAGE_START || phdr.vaddr >= PROCESS_VIRT_PAGE_START + PROCESS_PAGE_SIZE) return NULL;
+        if(phdr.memsz > PROCESS_VIRT_PAGE_START + PROCESS_PAGE_SIZE - phdr.vaddr) return NULL;
+
+        segment->vaddr = phdr.vaddr;
+        segment->memsz = phdr.memsz;
+        segment->offset = phdr.offset;
+        segment->filesz = phdr.filesz;
+        segment->flags = phdr.flags;
+        pcb->num_segments++;
+    }
+    if(pcb->num_segments == 0) return NULL;
+
+    pcb->image_inode = dentry.inode_num;
+    pcb->image = image_cache_get(dentry.inode_num, size);
+
+    return entrypoint;
+}
+
+/**
+ * load_program_page
+ * Provides the frame for a user page of the current process the first time it is touched.
+ *    - Pages made up entirely of file data from one segment are shared with every other process
+ *      running the program through the image cache.
+ *    - Pages holding .bss, or the edges of several segments, get a private frame with the file data
+ *      copied in and everything else zeroed. .bss is never read from the filesystem.
+ *    - Pages outside every segment (e.g. the stack) get a private zeroed frame.
+ * 
+ * @param page_addr     Virtual address of the page (4kB aligned, in the user page)
+ * @param writable      Set to 1 if the program may write to the page, 0 if it is read-only
+ * @param shared        Set to 1 if the frame is shared (it then has to be mapped read-only, copy-on-write if writable)
+ *
+ * @return              The physical address of the frame, with a reference for the caller, or 0 if memory is exhausted
+ */
+uint32_t load_program_page(uint32_t page_addr, uint8_t *writable, uint8_t *shared) {
+    pcb_t *pcb = get_current_pcb();
+    uint32_t page_end = page_addr + FOUR_KB_ALIGNED;
+    elf_segment_t *only_segment = NULL;
+    uint32_t num_overlapping = 0;
+    uint32_t frame;
+    int i;
+
+    *writable = 0;
+    *shared = 0;
+
+    for(i = 0; i < pcb->num_segments; i++) {
+        elf_segment_t *segment = &pcb->segments[i];
+        if(segment->vaddr < page_end && page_addr < segment->vaddr + segment->memsz) {
+            only_segment = segment;
+            num_overlapping++;
+            if(segment->flags & ELF_PF_W) *writable = 1;
+        }
+    }
+
+    // Not part of the program: stack or scratch memory
+    if(num_overlapping == 0) {
+        *writable = 1;
+    }
 
-    // Can't possibly be a valid program (<= size of ELF header)
-    if(retval <= ELF_MAGIC_HEADER_LEN) return NULL;
+    // Only share pages that look the same in every process: file data all the way, with
+    // the file offset lined up with the page
+    if(num_overlapping == 1 && pcb->image != NULL) {
+        uint32_t file_end = only_segment->vaddr + only_segment->filesz;
+
+        if(((only_segment->vaddr - only_segment->offset) & (FOUR_KB_ALIGNED - 1)) == 0 && page_addr < file_end &&
+           (page_end <= file_end || only_segment->filesz == only_segment->memsz)) {
+            frame = image_cache_page(pcb->image, (page_addr + only_segment->offset - only_segment->vaddr) >> ADDRESS_SHIFT);
+            if(frame != 0) {
+                frame_get(frame);
+                *shared = 1;
+                return frame;
+            }
+        }
+    }
+
+    frame = alloc_user_frame();
+    if(frame == 0) return 0;
+    memset((void*) frame, 0, FOUR_KB_ALIGNED);
+
+    for(i = 0; i < pcb->num_segments; i++) {
+        elf_segment_t *segment = &pcb->segments[i];
+        uint32_t start = (segment->vaddr > page_addr) ? segment->vaddr : page_addr;
+        uint32_t end = (segment->vaddr + segment->filesz < page_end) ? segment->vaddr + segment->filesz : page_end;
+
+        if(start < end) {
+            read_data(pcb->image_inode, segment->offset + (start - segment->vaddr), (uint8_t*) frame + (start - page_addr), end - start);
+        }
+    }
 
-    return get_executable_entrypoint(process_page + PROCESS_LINK_OFFSET);
+    return frame;
 }
@@ -0,0 +1,114 @@
+#include <arch/x86/tlb.h>
+#include <arch/x86/cpu.h>
+#include <arch/x86/smp.h>
+#include <lib/lib.h>
+
+/*
+ * TLB management. The kernel's mappings (kernel page, physical memory map, video memory) are
+ * the same in every address space and are marked global, so with CR4.PGE on they survive CR3
+ * reloads; a context switch only costs the TLB entries of user pages. Changes to a single
+ * mapping drop just that page with invlpg, and switching to the page directory that is already
+ * loaded does nothing at all.
+ *
+ * Each CPU counts its own flushes, with interrupts off, so the counters need no lock.
+ */
+
+static tlb_stats_t stats[SMP_MAX_CPUS];
+
+/**
+ * tlb_init
+ * Turns on global pages if the CPU supports them. Call once paging is enabled.
+ */
+void tlb_init() {
+    uint32_t eax, ebx, ecx, edx;
+    uint32_t cr4;
+
+    cpuid(CPUID_FEATURES, eax, ebx, ecx, edx);
+    if(edx & CPUID_EDX_PGE) {
+        read_cr4(cr4);
+        write_cr4(cr4 | CR4_PGE);
+    }
+}
+
+/**
+ * tlb_pd_is_loaded
+ * Checks whether a page directory is the active one, i.e. whether changing it can leave stale TLB entries.
+ *
+ * @param pd    The page directory
+ *
+ * @return      1 if it is loaded in CR3, 0 otherwise
+ */
+uint8_t tlb_pd_is_loaded(pd_entry *pd) {
+    uint32_t cr3;
+
+    read_cr3(cr3);
+    return cr3 == (uint32_t) pd;
+}
+
+/**
+ * tlb_load_pd
+ * Switches to another address space. Reloading CR3 flushes every non-global TLB entry, so it is
+ * skipped if the page directory is already the active one.
+ *
+ * @param pd    The page directory to use
+ */
+void tlb_load_pd(pd_entry *pd) {
+    uint32_t flags;
+
+    cli_and_save(flags);
+    if(tlb_pd_is_loaded(pd)) {
+        stats[smp_cpu_id()].cr3_skips++;
+    } else {
+        write_cr3(pd);
+        stats[smp_cpu_id()].cr3_loads++;
+    }
+    restore_flags(flags);
+}
+
+/**
+ * tlb_flush_all
+ * Flushes every non-global TLB entry by reloading CR3, for changes to many user mappings at once.
+ */
+void tlb_flush_all() {
+    uint32_t flags;
+    uint32_t cr3;
+
+    cli_and_save(flags);
+    read_cr3(cr3);
+    write_cr3(cr3);
+    stats[smp_cpu_id()].full_flushes++;
+    restore_flags(flags);
+}
+
+/**
+ * tlb_flush_page
+ * Drops the TLB entry of one page, e.g. after remapping or write protecting it. Works for global pages too.
+ *
+ * @param addr  Any virtual address in the page
+ */
+void tlb_flush_page(void *addr) {
+    uint32_t flags;
+
+    cli_and_save(flags);
+    invlpg(addr);
+    stats[smp_cpu_id()].page_flushes++;
+    restore_flags(flags);
+}
+
+/**
+ * tlb_get_stats
+ * Reports how much TLB flushing has been done, summed over the CPUs.
+ *
+ * @param stats_out     Filled in with the TLB statistics
+ */
+void tlb_get_stats(tlb_stats_t *stats_out) {
+    uint32_t cpu;
+
+    memset(stats_out, 0, sizeof(*stats_out));
+    for(cpu = 0; cpu < smp_num_cpus(); cpu++) {
+        stats_out->full_flushes += stats[cpu].full_flushes;
+        stats_out->page_flushes += stats[cpu].page_flushes;
+        stats_out->cr3_loads += stats[cpu].cr3_loads;
+        stats_out->cr3_skips += stats[cpu].cr3_skips;
+    }
+}
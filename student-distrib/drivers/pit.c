@@ -1,101 +1,195 @@
 #include <drivers/pit.h>
-#include <arch/x86/task.h>
 #include <lib/lib.h>
-#include <arch/x86/i8259.h>
+#include <arch/x86/irq.h>
 #include <arch/x86/io.h>
-#include <tty/terminal.h>
+#include <kernel/sched.h>
+#include <kernel/timer.h>
+#include <kernel/vdata.h>
+#include <arch/x86/smp.h>
+#include <arch/x86/spinlock.h>
 
 static volatile uint32_t system_ticks = 0;
 
-/**
- * context_switch
- * Saves the current process's state and loads another process for execution.
- *
- * @param last_pcb 	A pointer to the PCB of the process being swapped out
- * @param pcb 		A pointer to the PCB of the process being run
- */
-static void context_switch(pcb_t *last_pcb, pcb_t *pcb) {
-	cli();
+/* Number of PIT interrupts taken. With one-shot programming this is much lower than system_ticks when idle */
+static volatile uint32_t pit_interrupts = 0;
 
-	set_process_vmem_page(pcb->slot_num, get_terminal_output_buffer(pcb->terminal_num));
-	enable_paging(pcb->process_pd_ptr);
+/* PIT input clocks per tick (PIT_FREQUENCY / hertz). 0 until pit_init is called */
+static uint32_t tick_divisor = 0;
 
-	asm volatile(
-		"mov %%esp, %0\r\n"
-		"mov %%ebp, %1\r\n"
-		: "=g"(last_pcb->regs.esp), "=g"(last_pcb->regs.ebp)
-		: 
-		: "memory"
-	);
+/* Clocks the one-shot currently counting down was programmed with (0 if none is armed), and the tick it ends on */
+static uint32_t armed_count = 0;
+static uint32_t armed_deadline = 0;
 
-	// Prepare for context switch
-	set_kernel_stack(get_kernel_stack_base_from_slot(pcb->slot_num));
+/* Clocks that have elapsed but don't add up to a whole tick yet */
+static uint32_t count_remainder = 0;
 
-	if(pcb->regs.esp == NULL) {
-		send_eoi(PIT_IRQ);
+/* Protects the counter and the tick accounting: every CPU asks for its next event, but only the boot
+ * CPU takes the interrupt */
+static spinlock_t pit_lock = SPINLOCK_INIT;
 
-	    // Start the program
-	    switch_to_ring_3(PROCESS_LINK_START, pcb->entrypoint);
-	}
+/**
+ * pit_arm
+ * Starts a one-shot countdown on channel 0. IRQ0 fires when it reaches 0.
+ *
+ * @param count 	Number of PIT input clocks until the interrupt (1 to PIT_MAX_COUNT)
+ */
+static void pit_arm(uint32_t count) {
+	// Binary counting mode, interrupt on terminal count, 16-bit divisor, channel 0.
+	// Counting starts as soon as the high byte is written.
+	outportb(PIT_CMD_REG_PORT, PIT_BINARY_VAL | PIT_CMD_MODE0 | PIT_CMD_RW_BOTH | PIT_CMD_COUNTER0);
+	outportb(PIT_CH0_DATA_PORT, (uint8_t) (count & LOW_EIGHT_BIT_BITMASK));
+	outportb(PIT_CH0_DATA_PORT, (uint8_t) ((count >> 8) & LOW_EIGHT_BIT_BITMASK)); // 8 represents shifting to get bits 8-15 into bits 0-7, to apply bitmask.
+
+	armed_count = count;
+}
 
-	asm volatile(
-		"mov %0, %%esp\r\n"
-		"mov %1, %%ebp\r\n"
-		:
-		: "r"(pcb->regs.esp), "r"(pcb->regs.ebp)
-		: "memory"
-	);
+/**
+ * pit_account
+ * Turns elapsed PIT clocks into system ticks, carrying over any partial tick.
+ *
+ * @param count 	Number of PIT input clocks that have passed
+ */
+static void pit_account(uint32_t count) {
+	count_remainder += count;
+	system_ticks += count_remainder / tick_divisor;
+	count_remainder %= tick_divisor;
 }
 
 /**
- * scheduler
- * Finds a process that should next be run and preempts the current process if one is available.
+ * pit_program
+ * Body of pit_set_next_event. The PIT lock must be held.
+ *
+ * @param ticks 	Ticks until the event, or PIT_NO_EVENT to only wake up as often as the hardware requires
  */
-void scheduler() {
-	int i;
-
-	pcb_t *former_pcb = get_current_pcb();
-	int last_slot_checked = former_pcb->slot_num - 1;
-	if(last_slot_checked < 0) last_slot_checked += MAX_PROCESSES;
-	for(i = former_pcb->slot_num + 1; i != last_slot_checked; i = (i+1) % MAX_PROCESSES) {
-		pcb_t *current_pcb = get_pcb_from_slot(i);
-		if(current_pcb->in_use && current_pcb->status == PROCESS_RUNNING) {
-			context_switch(former_pcb, current_pcb);
-			break;
+static void pit_program(uint32_t ticks) {
+	uint32_t deadline;
+	uint32_t count;
+
+	// Not initialized yet
+	if(tick_divisor == 0) return;
+
+	deadline = (ticks == PIT_NO_EVENT) ? (uint32_t) -1 : system_ticks + ticks;
+
+	if(armed_count != 0) {
+		uint8_t status;
+		uint32_t current;
+
+		// What's armed already fires early enough
+		if(ticks == PIT_NO_EVENT || (int32_t) (armed_deadline - deadline) <= 0) return;
+
+		// Find out how far the running countdown got so that no time is lost when we restart it
+		outportb(PIT_CMD_REG_PORT, PIT_CMD_READBACK | PIT_READBACK_COUNTER0);
+		status = inportb(PIT_CH0_DATA_PORT);
+		current = inportb(PIT_CH0_DATA_PORT);
+		current |= inportb(PIT_CH0_DATA_PORT) << 8;
+
+		// Already expired: the interrupt is pending and the handler will program the next event
+		if(status & PIT_STATUS_OUT) return;
+
+		if(!(status & PIT_STATUS_NULL_COUNT) && current <= armed_count) {
+			pit_account(armed_count - current);
 		}
 	}
 
-	send_eoi(PIT_IRQ);
+	// Line the event up with a tick boundary
+	if(ticks == PIT_NO_EVENT || (int32_t) (deadline - system_ticks) > PIT_MAX_COUNT / tick_divisor + 1) {
+		count = PIT_MAX_COUNT;
+	} else if((int32_t) (deadline - system_ticks) <= 0) {
+		count = tick_divisor - count_remainder;
+	} else {
+		count = (deadline - system_ticks) * tick_divisor - count_remainder;
+	}
+	if(count > PIT_MAX_COUNT) count = PIT_MAX_COUNT;
 
-	// Unable to find a suitable process to switch to, exit
+	armed_deadline = system_ticks + (count_remainder + count) / tick_divisor;
+	pit_arm(count);
+}
+
+/**
+ * pit_set_next_event
+ * Makes sure the PIT interrupts no later than the given number of ticks from the current tick.
+ * An earlier event that is already armed is kept. Must be called with interrupts disabled.
+ *
+ * @param ticks 	Ticks until the event, or PIT_NO_EVENT to only wake up as often as the hardware requires
+ */
+void pit_set_next_event(uint32_t ticks) {
+	spin_lock(&pit_lock);
+	pit_program(ticks);
+	spin_unlock(&pit_lock);
 }
 
 /**
  * pit_init
- * Initializes the PIT so it can be used for preemptive multitasking.
+ * Initializes the PIT for tickless operation. Instead of interrupting at a fixed rate, the PIT is
+ * programmed one-shot for the next event, and system_ticks is kept in units of 1/hertz seconds.
  *
- * @param hertz 	The rate that the PIT should be run at (currently ignored)
+ * @param hertz 	The length of one tick (and so the scheduling granularity). 19 Hz to 1193182 Hz.
  */
 void pit_init(uint32_t hertz) {
-	// 100 Hz = 10ms per tick/context switch
-	// For now, we ignore the given parameter
-	hertz = 100;
+	uint32_t flags;
+	spin_lock_irqsave(&pit_lock, flags);
+
+	// The divisor must fit in the 16-bit counter
+	if(hertz == 0 || PIT_FREQUENCY / hertz > PIT_MAX_COUNT) {
+		tick_divisor = PIT_MAX_COUNT;
+	} else if(hertz > PIT_FREQUENCY) {
+		tick_divisor = 1;
+	} else {
+		tick_divisor = PIT_FREQUENCY / hertz;
+	}
+
+	count_remainder = 0;
+	armed_count = 0;
+	pit_program(1);
 
-	uint16_t divisor = PIT_FREQUENCY / hertz;
+	spin_unlock_irqrestore(&pit_lock, flags);
+}
 
-	// Put the PIT into binary counting mode, square wave generator, 16-bit receiving mode for the divisor, and use channel 0
-	outportb(PIT_CMD_REG_PORT, PIT_BINARY_VAL | PIT_CMD_MODE3 | PIT_CMD_RW_BOTH | PIT_CMD_COUNTER0);
+/**
+ * pit_get_ticks
+ * Get the number of ticks (of the length given to pit_init) since the PIT was started.
+ *
+ * @return 		The current tick count
+ */
+uint32_t pit_get_ticks() {
+	return system_ticks;
+}
 
-	// Send the clock divisor
-	outportb(PIT_CH0_DATA_PORT, (uint8_t) (divisor & LOW_EIGHT_BIT_BITMASK));
-	outportb(PIT_CH0_DATA_PORT, (uint8_t) ((divisor >> 8) & LOW_EIGHT_BIT_BITMASK)); // 8 represents shifting to get bits 8-15 into bits 0-7, to apply bitmask.
+/**
+ * pit_get_interrupts
+ * Get the number of PIT interrupts handled so far.
+ *
+ * @return 		The PIT interrupt count
+ */
+uint32_t pit_get_interrupts() {
+	return pit_interrupts;
 }
 
 /**
  * pit_handler
- * Interrupt handler for the PIT - just increments the number of ticks that have passed and runs the scheduler.
+ * Interrupt handler for the PIT - accounts for the time the one-shot covered, publishes it in the data
+ * page, fires the timers that are due, passes the tick on to the other CPUs and runs the scheduler, which programs the next one-shot.
  */
 void pit_handler() {
-	system_ticks++;
+	uint32_t ticks;
+	uint32_t partial;
+
+	spin_lock(&pit_lock);
+	pit_interrupts++;
+
+	// The whole countdown has elapsed
+	pit_account(armed_count);
+	armed_count = 0;
+	ticks = system_ticks;
+	partial = (count_remainder << VDATA_PARTIAL_SHIFT) / tick_divisor;
+	spin_unlock(&pit_lock);
+
+	// Outside the lock, since it takes the scheduler's
+	vdata_update(ticks, partial);
+	timer_run(ticks);
+
+	// Acknowledge before scheduling, since we may not return here until this process runs again
+	send_eoi(PIT_IRQ);
+	smp_broadcast_tick();
 	scheduler();
 }
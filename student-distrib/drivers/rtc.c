@@ -1,10 +1,15 @@
 #include <drivers/rtc.h>
 #include <lib/lib.h>
-#include <arch/x86/i8259.h>
+#include <arch/x86/irq.h>
 #include <arch/x86/io.h>
 #include <arch/x86/x86_desc.h>
 #include <arch/x86/interrupt.h>
 #include <arch/x86/task.h>
+#include <kernel/wait_queue.h>
+#include <kernel/sched.h>
+#include <kernel/softirq.h>
+#include <drivers/pit.h>
+#include <arch/x86/spinlock.h>
 #include <types.h>
 
 /* References:
@@ -13,7 +18,41 @@
     https://courses.engr.illinois.edu/ece391/secure/references/mc146818.pdf  (we didn't really use this, but it is the most detailed reference)
 */
 
-static volatile int rtc_test_enabled = 0;
+/* The processes' RTCs are virtual: each reader has a deadline on one shared clock, and the hardware
+ * only runs while somebody waits for a deadline, at the lowest rate that serves the fastest waiting
+ * reader. Waiting readers sit in a min-heap by deadline, so an interrupt only costs as much as the
+ * readers whose deadline it reaches.
+ *
+ * The clock counts in units of 1/MAX_FREQ seconds. Each hardware interrupt advances it by one period
+ * of the rate the RTC runs at; while the RTC is stopped, it is caught up from the PIT when it's read. */
+
+/* Interval indexes: interval 2^i (in clock units) has index i */
+#define RTC_NUM_INTERVALS 10            // MAX_FREQ / MIN_FREQ is 2^9
+
+/* Protects the CMOS index/data port pair, the clock and the heap, since the handler and tasklet (on
+ * the boot CPU) and the processes using the RTC (on any CPU) all touch them */
+static spinlock_t rtc_lock = SPINLOCK_INIT;
+
+/* The virtual clock, and how far each interrupt advances it (0 while the RTC is stopped) */
+static uint32_t rtc_now = 0;
+static uint32_t rtc_period = 0;
+
+/* PIT tick up to which the clock was caught up while the RTC is stopped */
+static uint32_t rtc_stopped_tick = 0;
+
+/* Readers sleeping in rtc_read, as a min-heap by deadline */
+static pcb_t *rtc_heap[MAX_PROCESSES_LIMIT];
+static uint32_t rtc_heap_size = 0;
+
+/* Number of waiting readers (plus the test, if it runs) per interval index. The fastest one sets the rate */
+static uint32_t rtc_waiting[RTC_NUM_INTERVALS];
+
+/* Interval and next deadline of the Ctrl+4 test, which prints a '1' per tick. Interval 0 when it's off */
+static uint32_t rtc_test_interval = 0;
+static uint32_t rtc_test_deadline = 0;
+
+static void rtc_tasklet_func(void *data);
+static tasklet_t rtc_tasklet = TASKLET_INIT(rtc_tasklet_func, NULL);
 
 /**
 * void test_rtc(void)
@@ -27,108 +66,277 @@ test_rtc(void)
     putc('1');
 }
 
+/**
+ * rtc_deadline_passed
+ * Checks whether the clock has reached a deadline, allowing for it to wrap around.
+ *
+ * @param deadline  The deadline
+ *
+ * @return          1 if it has, 0 if not
+ */
+static inline uint32_t rtc_deadline_passed(uint32_t deadline) {
+    return (int32_t) (deadline - rtc_now) <= 0;
+}
+
+/**
+ * rtc_interval_index
+ * Get the index of an interval.
+ *
+ * @param interval  The interval, a power of 2 from 1 to MAX_FREQ / MIN_FREQ
+ *
+ * @return          Its index
+ */
+static uint32_t rtc_interval_index(uint32_t interval) {
+    uint32_t i = 0;
+
+    while((1 << i) < interval) i++;
+    return i;
+}
+
+/**
+ * rtc_heap_push
+ * Adds a waiting reader to the heap. The RTC lock must be held.
+ *
+ * @param pcb   The reader. Its rtc_deadline must be set.
+ */
+static void rtc_heap_push(pcb_t *pcb) {
+    uint32_t i = rtc_heap_size++;
+
+    // Move parents with later deadlines down until its place is found
+    while(i > 0) {
+        uint32_t parent = (i - 1) / 2;
+        if((int32_t) (rtc_heap[parent]->rtc_deadline - pcb->rtc_deadline) <= 0) break;
+
+        rtc_heap[i] = rtc_heap[parent];
+        i = parent;
+    }
+    rtc_heap[i] = pcb;
+}
+
+/**
+ * rtc_heap_pop
+ * Removes the reader with the earliest deadline from the heap. The RTC lock must be held.
+ *
+ * @return      The reader. The heap must not be empty.
+ */
+static pcb_t *rtc_heap_pop() {
+    pcb_t *top = rtc_heap[0];
+    pcb_t *last = rtc_heap[--rtc_heap_size];
+    uint32_t i = 0;
+
+    // Move the last reader down from the root, promoting the earlier child each step
+    for(;;) {
+        uint32_t child = 2 * i + 1;
+        if(child >= rtc_heap_size) break;
+        if(child + 1 < rtc_heap_size && (int32_t) (rtc_heap[child + 1]->rtc_deadline - rtc_heap[child]->rtc_deadline) < 0) {
+            child++;
+        }
+        if((int32_t) (last->rtc_deadline - rtc_heap[child]->rtc_deadline) <= 0) break;
+
+        rtc_heap[i] = rtc_heap[child];
+        i = child;
+    }
+    if(rtc_heap_size > 0) {
+        rtc_heap[i] = last;
+    }
+    return top;
+}
+
+/**
+ * rtc_write_register
+ * Writes an RTC register, keeping NMIs disabled while it's selected. The RTC lock must be held.
+ *
+ * @param reg   The register (RTC_REG_*)
+ * @param mask  Bits to change
+ * @param value New value of those bits
+ */
+static void rtc_write_register(uint8_t reg, uint8_t mask, uint8_t value) {
+    uint8_t prev;
+
+    outportb(RTC_STATUS_PORT, RTC_DISABLE_NMI | reg);   // select the register, and disable NMI
+    prev = inportb(RTC_DATA_PORT);                      // read the current value
+    outportb(RTC_STATUS_PORT, RTC_DISABLE_NMI | reg);   // set the index again (a read will reset the index to register D)
+    outportb(RTC_DATA_PORT, (prev & ~mask) | value);
+}
+
+/**
+ * rtc_catch_up
+ * Advances the clock by the PIT ticks that passed while the RTC was stopped, since there were no
+ * interrupts to do it. The RTC lock must be held.
+ */
+static void rtc_catch_up() {
+    uint32_t now = pit_get_ticks();
+    uint32_t elapsed = now - rtc_stopped_tick;
+
+    if(rtc_period != 0) return;
+
+    // Deadlines are never further ahead than MAX_FREQ / MIN_FREQ, so past a second it makes no difference
+    if(elapsed > SCHED_TICK_HZ) elapsed = SCHED_TICK_HZ;
+
+    rtc_now += elapsed * MAX_FREQ / SCHED_TICK_HZ;
+    rtc_stopped_tick = now;
+}
+
+/**
+ * rtc_update_rate
+ * Runs the RTC at the rate of the fastest waiting reader (or the test), or stops it and masks its
+ * IRQ if nobody waits. The RTC lock must be held.
+ */
+static void rtc_update_rate() {
+    uint32_t i;
+    uint32_t hertz;
+    uint8_t rate = 15;              // rate passed to the RTC. Rate of 15 corresponds to 2 Hz. We use formula: htz = 32768 >> (rate - 1)
+
+    for(i = 0; i < RTC_NUM_INTERVALS && rtc_waiting[i] == 0; i++);
+
+    if(i == RTC_NUM_INTERVALS) {
+        if(rtc_period != 0) {
+            // Nobody waits: stop the periodic interrupt at the source and mask the IRQ
+            rtc_write_register(RTC_REG_B, RTC_ENABLE_INTERRUPTS, 0);
+            disable_irq(RTC_IRQ);
+            rtc_period = 0;
+            rtc_stopped_tick = pit_get_ticks();
+        }
+        return;
+    }
+
+    if(rtc_period == (1 << i)) return;
+
+    // Calculate appropriate 'rate' value for the htz we want
+    for(hertz = MAX_FREQ >> i; hertz != MIN_FREQ; hertz >>= 1) {
+        rate--;
+    }
+    rtc_write_register(RTC_REG_A, 0x0F, rate);     // 0x0F is the bitmask for the rate, bits 0-3
+
+    if(rtc_period == 0) {
+        rtc_catch_up();
+        rtc_write_register(RTC_REG_B, RTC_ENABLE_INTERRUPTS, RTC_ENABLE_INTERRUPTS);
+
+        // Reading register C clears an interrupt left pending from before it was stopped
+        outportb(RTC_STATUS_PORT, RTC_REG_C);
+        inportb(RTC_DATA_PORT);
+        enable_irq(RTC_IRQ);
+    }
+    rtc_period = 1 << i;
+}
 
 /**
- * set_rtc_test_enabled
- *   DESCRIPTION:  set whether RTC test is running.
- *   INPUTS:       enabled - 1 if test is running, else 0
+ * set_rtc_test_rate
+ *   DESCRIPTION:  starts or stops the RTC test, which prints a '1' at the given rate.
+ *   INPUTS:       hertz - rate of the test (a power of 2 from MIN_FREQ to MAX_FREQ), or 0 to stop it
  *   OUTPUTS:      none
  *   RETURN VALUE: none
- *   SIDE EFFECTS: enables RTC test
+ *   SIDE EFFECTS: runs the RTC while the test is running
  */  
-void set_rtc_test_enabled(int enabled) {
+void set_rtc_test_rate(uint32_t hertz) {
     uint32_t flags;
 
-    cli_and_save(flags);
-    rtc_test_enabled = enabled;
-    restore_flags(flags);
+    spin_lock_irqsave(&rtc_lock, flags);
+    if(rtc_test_interval != 0) {
+        rtc_waiting[rtc_interval_index(rtc_test_interval)]--;
+    }
+
+    rtc_test_interval = (hertz != 0) ? MAX_FREQ / hertz : 0;
+
+    if(rtc_test_interval != 0) {
+        rtc_catch_up();
+        rtc_test_deadline = rtc_now + rtc_test_interval;
+        rtc_waiting[rtc_interval_index(rtc_test_interval)]++;
+    }
+    rtc_update_rate();
+    spin_unlock_irqrestore(&rtc_lock, flags);
 }
 
 /**
- * rtc_handler
- *   DESCRIPTION:  this code runs when RTC Interrupt happens. Makes screen flash
- *   INPUTS:       none
+ * rtc_tasklet_func
+ *   DESCRIPTION:  wakes up the readers whose deadline the clock has reached, runs the test, and
+ *                 slows down or stops the RTC if the fastest readers were among them.
+ *   INPUTS:       data - unused
  *   OUTPUTS:      none
  *   RETURN VALUE: none
  *   SIDE EFFECTS: makes screen flash when it tests interrupts.
- */  
-void rtc_handler() {
+ */
+static void rtc_tasklet_func(void *data) {
     uint32_t flags;
+    uint8_t test_due = 0;
 
-    cli_and_save(flags);
+    spin_lock_irqsave(&rtc_lock, flags);
 
-    outportb(RTC_STATUS_PORT, RTC_REG_C);
-    inportb(RTC_DATA_PORT);
+    while(rtc_heap_size > 0 && rtc_deadline_passed(rtc_heap[0]->rtc_deadline)) {
+        pcb_t *pcb = rtc_heap_pop();
 
-    //test_interrupts(); // This causes screen to flash. Can comment it out to stop flashing.
-    if(rtc_test_enabled) {
-        test_rtc();     
+        rtc_waiting[rtc_interval_index(pcb->rtc_interval)]--;
+        pcb->rtc_queued = 0;
+        wait_queue_wake_all(&pcb->rtc_wait);
     }
 
-    //rtc_tick_flag = 0; // Rodney: newly added for 3.2
+    if(rtc_test_interval != 0 && rtc_deadline_passed(rtc_test_deadline)) {
+        rtc_test_deadline = rtc_now + rtc_test_interval;
+        test_due = 1;
+    }
 
-    /* Update number of ticks left before interrupt fires for each process */
-    int i;
-    for(i = 0; i < MAX_PROCESSES; i++) {
-        pcb_t *pcb = get_pcb_from_slot(i);
-        if(pcb->in_use && pcb->rtc_enabled && pcb->remaining_rtc_ticks > 0) {
-            pcb->remaining_rtc_ticks--;
-        }
+    rtc_update_rate();
+    spin_unlock_irqrestore(&rtc_lock, flags);
+
+    //test_interrupts(); // This causes screen to flash. Can comment it out to stop flashing.
+    if(test_due) {
+        test_rtc();
     }
-    
-    send_eoi(RTC_IRQ);
-    restore_flags(flags);
 }
 
 /**
- * rtc_init
- * Initializs the RTC and sets interrupt rate.
- */
-void rtc_init() {
-    int     htz = MAX_FREQ;       // hertz
-    uint8_t rate = 15;            // rate passed to the RTC. Rate of 15 corresponds to 2 Hz. We use formula: htz = 32768 >> (rate - 1)
-    char    prev;                 // just a temporary variable
+ * rtc_handler
+ *   DESCRIPTION:  this code runs when RTC Interrupt happens. Acknowledges the RTC and advances the
+ *                 clock; only if that reaches a deadline is the RTC tasklet scheduled to act on it.
+ *   INPUTS:       none
+ *   OUTPUTS:      none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: may schedule the RTC tasklet
+ */  
+void rtc_handler() {
+    uint8_t due;
 
-    // Calculate appropriate 'rate' value for the htz we want
-    while (htz != MIN_FREQ){
-        htz >>= 1;                          // divides by 2
-        rate--;
-    }
+    spin_lock(&rtc_lock);
+
+    outportb(RTC_STATUS_PORT, RTC_REG_C);
+    inportb(RTC_DATA_PORT);
+
+    rtc_now += rtc_period;
+    due = (rtc_heap_size > 0 && rtc_deadline_passed(rtc_heap[0]->rtc_deadline)) ||
+          (rtc_test_interval != 0 && rtc_deadline_passed(rtc_test_deadline));
+
+    spin_unlock(&rtc_lock);
+    send_eoi(RTC_IRQ);
 
-    // set the interrupt rate
-    outportb(RTC_STATUS_PORT, RTC_DISABLE_NMI | RTC_REG_A);
-    prev = inportb(RTC_DATA_PORT);                              // get initial value of register A
-    outportb(RTC_STATUS_PORT, RTC_DISABLE_NMI | RTC_REG_A);     // reset index to A
-    outportb(RTC_DATA_PORT, (prev & 0xF0) | rate);              // 0xF0 is bitmask for bits 4-7
+    if(due) {
+        tasklet_schedule(&rtc_tasklet);
+    }
 }
 
 /**
  * rtc_open
- *   DESCRIPTION:  Initializes the RTC with a frequency of 2 Hz
+ *   DESCRIPTION:  Sets the process's virtual RTC to a frequency of 2 Hz
  *   INPUTS:       f - file struct representing an RTC
  *                 filename - name of RTC file
  *   OUTPUTS:      none
  *   RETURN VALUE: -1 on failure
  *                  0 on success (for now we are always succesful)
- *   SIDE EFFECTS: changes the frequency of the RTC to 2 Hz, installs a handler
+ *   SIDE EFFECTS: none; the RTC itself only runs while somebody waits in rtc_read
  */ 
 int32_t rtc_open(file_t *f, const int8_t * filename) {
-    outportb(RTC_STATUS_PORT, RTC_DISABLE_NMI | RTC_REG_B);     // select register B, and disable NMI
-    char prev = inportb(RTC_DATA_PORT);                         // read the current value of register B
-    outportb(RTC_STATUS_PORT, RTC_DISABLE_NMI | RTC_REG_B);     // set the index again (a read will reset the index to register D)
-    outportb(RTC_DATA_PORT, prev | RTC_ENABLE_INTERRUPTS);      // write the previous value ORed with 0x40. This turns on bit 6 of register B
+    uint32_t flags;
 
-    // Need to initialize RTC before enabling IRQ
-    install_interrupt_handler(IRQ_INT_NUM(RTC_IRQ), rtc_handler_wrapper, KERNEL_CS, PRIVILEGE_KERNEL);
-    enable_irq(RTC_IRQ);
-    
-    rtc_init();
+    spin_lock_irqsave(&rtc_lock, flags);
+    rtc_catch_up();
 
     // Set virtualized RTC rate to 2 Hz
     pcb_t *pcb = get_current_pcb();
     pcb->rtc_enabled = 1;
     pcb->rtc_interval = MAX_FREQ / 2;  // we divide by 2 cuz, when a program opens RTC, it should be set to 2 Hz by default.
-    pcb->remaining_rtc_ticks = pcb->rtc_interval;
+    pcb->rtc_deadline = rtc_now + pcb->rtc_interval;
+    pcb->rtc_queued = 0;
+    wait_queue_init(&pcb->rtc_wait);
+    spin_unlock_irqrestore(&rtc_lock, flags);
     return 0;
 }
 
@@ -149,7 +357,8 @@ int32_t rtc_close(file_t *f) {
 
 /**
  * rtc_read
- *   DESCRIPTION:  Returns (only when) the next RTC tick occurs
+ *   DESCRIPTION:  Returns (only when) the next RTC tick occurs: one interval after the previous
+ *                 read returned, or after the RTC was opened
  *   INPUTS:       f - file struct representing an RTC
  *                 buf - buffer to read to
  *                 nbytes - number of bytes to read
@@ -162,22 +371,29 @@ int32_t rtc_read(file_t *f, void *buf, int32_t nbytes) {
     if(pcb->rtc_enabled == 0) return -1;
 
     uint32_t flags;
+    uint32_t remaining;
 
-    // We're in a system call, so interrupts have been disabled.
-    // We need to temporarily enable interrupts so that we can
-    // actually receive the RTC tick.
-    cli_and_save(flags);
-    sti();
+    spin_lock_irqsave(&rtc_lock, flags);
+    rtc_catch_up();
 
-    // wait for RTC tick
-    while(pcb->remaining_rtc_ticks) {
-        //asm volatile("hlt;");
-    }
+    // The tick may have arrived already. A deadline further ahead than the interval was set before
+    // rtc_write shortened it (or so long ago that the clock wrapped), so it counts as arrived too.
+    remaining = pcb->rtc_deadline - rtc_now;
+    if(remaining != 0 && remaining <= pcb->rtc_interval) {
+        pcb->rtc_queued = 1;
+        rtc_heap_push(pcb);
+        rtc_waiting[rtc_interval_index(pcb->rtc_interval)]++;
+        rtc_update_rate();
+        spin_unlock_irqrestore(&rtc_lock, flags);
+
+        // Sleep until the RTC tasklet takes us off the heap. Other processes run in the meantime.
+        wait_event(&pcb->rtc_wait, pcb->rtc_queued == 0);
 
-    cli();
-    pcb->remaining_rtc_ticks = pcb->rtc_interval;
+        spin_lock_irqsave(&rtc_lock, flags);
+    }
 
-    restore_flags(flags);
+    pcb->rtc_deadline = rtc_now + pcb->rtc_interval;
+    spin_unlock_irqrestore(&rtc_lock, flags);
     return 0;                   // acknowledge RTC tick
 }
 
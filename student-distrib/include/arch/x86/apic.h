@@ -0,0 +1,66 @@
+#ifndef _X86_APIC_H
+#define _X86_APIC_H
+
+#include <types.h>
+
+/* Local APIC References:
+		Intel SDM Volume 3, chapter 10 (Advanced Programmable Interrupt Controller)
+		http://wiki.osdev.org/APIC
+*/
+
+/* Local APIC registers, as byte offsets from its MMIO base */
+#define LAPIC_REG_ID            0x020
+#define LAPIC_REG_VERSION       0x030
+#define LAPIC_REG_TPR           0x080    /* Task priority: interrupts at or below it are held back */
+#define LAPIC_REG_EOI           0x0B0
+#define LAPIC_REG_SVR           0x0F0    /* Spurious interrupt vector, and the software enable bit */
+#define LAPIC_REG_ESR           0x280    /* Error status */
+#define LAPIC_REG_ICR_LOW       0x300    /* Interrupt command: writing the low half sends the IPI */
+#define LAPIC_REG_ICR_HIGH      0x310
+#define LAPIC_REG_LVT_TIMER     0x320
+#define LAPIC_REG_LVT_LINT0     0x350
+#define LAPIC_REG_LVT_LINT1     0x360
+#define LAPIC_REG_LVT_ERROR     0x370
+#define LAPIC_REG_TIMER_INIT    0x380    /* Timer initial count: writing it starts the countdown (0 stops it) */
+#define LAPIC_REG_TIMER_CURRENT 0x390
+#define LAPIC_REG_TIMER_DIVIDE  0x3E0
+
+#define LAPIC_ID_SHIFT          24       /* The ID register keeps the APIC ID in its top byte */
+#define LAPIC_SVR_ENABLE        0x100
+#define LAPIC_LVT_MASKED        0x10000
+#define LAPIC_TIMER_DIVIDE_16   0x3      /* The timer counts the bus clock divided by 16 */
+
+/* Delivery modes, for the local vector table and the interrupt command register */
+#define LAPIC_DELIVERY_FIXED    0x000
+#define LAPIC_DELIVERY_NMI      0x400
+#define LAPIC_DELIVERY_INIT     0x500
+#define LAPIC_DELIVERY_STARTUP  0x600
+#define LAPIC_DELIVERY_EXTINT   0x700
+
+/* Interrupt command register bits */
+#define LAPIC_ICR_PENDING       0x1000   /* Delivery status: the previous IPI hasn't been accepted yet */
+#define LAPIC_ICR_ASSERT        0x4000
+#define LAPIC_ICR_LEVEL         0x8000
+#define LAPIC_ICR_ALL_BUT_SELF  0xC0000  /* Destination shorthand: every CPU except the sender */
+#define LAPIC_ICR_DEST_SHIFT    24       /* Destination APIC ID, in the high half */
+
+/* Spurious interrupts need no EOI, so this vector just returns (see null_interrupt_handler) */
+#define LAPIC_SPURIOUS_VEC      0xFF
+
+/* One-shot local timer, used for the other CPUs' timeslices (see smp_timer_handler) */
+#define LAPIC_TIMER_VEC         0xE0
+
+uint32_t lapic_detect();
+uint32_t lapic_get_base();
+void lapic_init(uint8_t bsp);
+uint8_t lapic_id();
+void lapic_eoi();
+void lapic_send_ipi(uint8_t apic_id, uint8_t vector);
+void lapic_send_ipi_others(uint8_t vector);
+void lapic_send_init(uint8_t apic_id);
+void lapic_send_startup(uint8_t apic_id, uint32_t addr);
+void lapic_timer_calibrate(uint32_t hertz);
+uint32_t lapic_timer_available();
+void lapic_timer_set(uint32_t ticks);
+
+#endif
@@ -0,0 +1,153 @@
+#ifndef _X86_CPU_H
+#define _X86_CPU_H
+
+#include <types.h>
+
+/* CPUID leaves */
+#define CPUID_FEATURES          0x1
+
+/* CPUID leaf 1 feature bits in edx */
+#define CPUID_EDX_FPU           (1 << 0)
+#define CPUID_EDX_TSC           (1 << 4)
+#define CPUID_EDX_APIC          (1 << 9)
+#define CPUID_EDX_SEP           (1 << 11)
+#define CPUID_EDX_PGE           (1 << 13)
+#define CPUID_EDX_FXSR          (1 << 24)
+#define CPUID_EDX_SSE           (1 << 25)
+
+/* Model specific registers */
+#define MSR_APIC_BASE           0x1B
+#define MSR_APIC_BASE_BSP       (1 << 8)    // This is the bootstrap processor
+#define MSR_APIC_BASE_ENABLE    (1 << 11)   // Local APIC enabled
+#define MSR_APIC_BASE_ADDR_MASK 0xFFFFF000
+#define MSR_SYSENTER_CS         0x174       // Kernel code segment sysenter loads (SS is the next descriptor)
+#define MSR_SYSENTER_ESP        0x175       // Stack pointer sysenter loads
+#define MSR_SYSENTER_EIP        0x176       // Where sysenter jumps to
+
+/* Control register bits */
+#define CR0_MP                  (1 << 1)    // Monitor coprocessor: wait/fwait honor TS
+#define CR0_EM                  (1 << 2)    // Emulate FPU: every FPU instruction traps
+#define CR0_TS                  (1 << 3)    // Task switched: next FPU/SSE instruction raises #NM
+#define CR0_NE                  (1 << 5)    // Report FPU errors as exceptions instead of through the PIC
+
+#define CR4_PGE                 (1 << 7)    // Global pages: TLB entries marked global survive CR3 reloads
+#define CR4_OSFXSR              (1 << 9)    // OS saves SSE state with fxsave/fxrstor
+#define CR4_OSXMMEXCPT          (1 << 10)   // OS handles SIMD floating point exceptions
+
+/* Execute cpuid
+ * Runs the given leaf and stores the results into the variables a, b, c and d */
+#define cpuid(leaf, a, b, c, d)         \
+do {                                    \
+	asm volatile("cpuid"                \
+			: "=a"(a), "=b"(b),     \
+			  "=c"(c), "=d"(d)      \
+			: "a"(leaf), "c"(0)     \
+			);                      \
+} while(0)
+
+/* Read/write a model specific register. Only the low 32 bits are used */
+#define rdmsr(msr, val)                 \
+do {                                    \
+	uint32_t __high;                    \
+	asm volatile("rdmsr"                \
+			: "=a"(val), "=d"(__high) \
+			: "c"(msr)              \
+			);                      \
+	(void) __high;                      \
+} while(0)
+
+#define wrmsr(msr, val)                 \
+do {                                    \
+	asm volatile("wrmsr"                \
+			:                       \
+			: "c"(msr), "a"(val), "d"(0) \
+			: "memory"              \
+			);                      \
+} while(0)
+
+/* Spin-wait hint: tells the CPU (and a hypervisor) that this is a busy loop */
+#define cpu_relax()                     \
+do {                                    \
+	asm volatile("pause" : : : "memory"); \
+} while(0)
+
+/* Read/write control register 0 */
+#define read_cr0(val)                   \
+do {                                    \
+	asm volatile("movl %%cr0, %0"       \
+			: "=r"(val)             \
+			);                      \
+} while(0)
+
+#define write_cr0(val)                  \
+do {                                    \
+	asm volatile("movl %0, %%cr0"       \
+			:                       \
+			: "r"(val)              \
+			: "memory"              \
+			);                      \
+} while(0)
+
+/* Read/write control register 4 */
+#define read_cr4(val)                   \
+do {                                    \
+	asm volatile("movl %%cr4, %0"       \
+			: "=r"(val)             \
+			);                      \
+} while(0)
+
+#define write_cr4(val)                  \
+do {                                    \
+	asm volatile("movl %0, %%cr4"       \
+			:                       \
+			: "r"(val)              \
+			: "memory"              \
+			);                      \
+} while(0)
+
+/* Read/write control register 3 (page directory base) */
+#define read_cr3(val)                   \
+do {                                    \
+	asm volatile("movl %%cr3, %0"       \
+			: "=r"(val)             \
+			);                      \
+} while(0)
+
+#define write_cr3(val)                  \
+do {                                    \
+	asm volatile("movl %0, %%cr3"       \
+			:                       \
+			: "r"(val)              \
+			: "memory"              \
+			);                      \
+} while(0)
+
+/* Read control register 2 (the address that caused the last page fault) */
+#define read_cr2(val)                   \
+do {                                    \
+	asm volatile("movl %%cr2, %0"       \
+			: "=r"(val)             \
+			);                      \
+} while(0)
+
+/* Drop the TLB entry for the page containing addr */
+#define invlpg(addr)                    \
+do {                                    \
+	asm volatile("invlpg (%0)"          \
+			:                       \
+			: "r"(addr)             \
+			: "memory"              \
+			);                      \
+} while(0)
+
+/* Clear the task-switched flag in CR0, allowing FPU/SSE instructions without a trap */
+#define clts()                          \
+do {                                    \
+	asm volatile("clts"                 \
+			:                       \
+			:                       \
+			: "memory"              \
+			);                      \
+} while(0)
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef _X86_ELF_H
+#define _X86_ELF_H
+
+#include <types.h>
+
+/* ELF32 References:
+		System V ABI, Intel386 Architecture Processor Supplement
+		http://wiki.osdev.org/ELF
+*/
+
+#define ELF_MAGIC           "\x7f\x45\x4c\x46"
+#define ELF_MAGIC_LEN       4
+#define ELF_IDENT_LEN       16
+#define ELF_IDENT_CLASS     4       /* Index of the class byte in the ident field */
+#define ELF_IDENT_DATA      5       /* Index of the data encoding byte in the ident field */
+
+#define ELF_CLASS_32        1       /* 32-bit objects */
+#define ELF_DATA_LSB        1       /* Little endian */
+#define ELF_TYPE_EXEC       2       /* Executable file */
+#define ELF_MACHINE_386     3       /* Intel 80386 */
+
+#define ELF_PT_LOAD         1       /* Program header type of a segment that is loaded into memory */
+
+#define ELF_PF_X            0x1     /* Segment permission: execute */
+#define ELF_PF_W            0x2     /* Segment permission: write */
+#define ELF_PF_R            0x4     /* Segment permission: read */
+
+/* Most PT_LOAD segments a program may have. Programs normally have two: text and data */
+#define ELF_MAX_LOAD_SEGMENTS 4
+
+/* ELF file header */
+typedef struct __attribute__((packed)) elf32_header_t {
+	uint8_t  ident[ELF_IDENT_LEN];
+	uint16_t type;
+	uint16_t machine;
+	uint32_t version;
+	uint32_t entry;
+	uint32_t phoff;
+	uint32_t shoff;
+	uint32_t flags;
+	uint16_t ehsize;
+	uint16_t phentsize;
+	uint16_t phnum;
+	uint16_t shentsize;
+	uint16_t shnum;
+	uint16_t shstrndx;
+} elf32_header_t;
+
+/* ELF program header */
+typedef struct __attribute__((packed)) elf32_phdr_t {
+	uint32_t type;
+	uint32_t offset;
+	uint32_t vaddr;
+	uint32_t paddr;
+	uint32_t filesz;
+	uint32_t memsz;
+	uint32_t flags;
+	uint32_t align;
+} elf32_phdr_t;
+
+/* A PT_LOAD segment, as the loader keeps it. Bytes past filesz (up to memsz) are .bss and read as 0 */
+typedef struct elf_segment_t {
+	uint32_t vaddr;
+	uint32_t memsz;
+	uint32_t offset;
+	uint32_t filesz;
+	uint32_t flags;
+} elf_segment_t;
+
+#endif
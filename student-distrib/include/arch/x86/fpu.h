@@ -0,0 +1,33 @@
+#ifndef _X86_FPU_H
+#define _X86_FPU_H
+
+#include <types.h>
+
+#define FPU_NM_VEC          7       // "Device not available" exception
+#define FPU_STATE_SIZE      512     // Size of an fxsave area
+#define FPU_STATE_ALIGN     16      // fxsave/fxrstor need a 16-byte aligned area
+
+/* Saved FPU/MMX/SSE registers, in fxsave format (fnsave format on CPUs without fxsave) */
+typedef struct fpu_state_t {
+	uint8_t data[FPU_STATE_SIZE];
+} __attribute__((aligned (FPU_STATE_ALIGN))) fpu_state_t;
+
+/* Counters for how often lazy FPU switching actually had to do work */
+typedef struct fpu_stats_t {
+	uint32_t traps;       // #NM exceptions taken
+	uint32_t saves;       // Times a process's registers were saved to its PCB
+	uint32_t restores;    // Times a process's registers were loaded back from its PCB
+} fpu_stats_t;
+
+struct pcb_t;
+
+void fpu_init();
+void fpu_init_cpu();
+void fpu_switch(struct pcb_t *next);
+void fpu_release(struct pcb_t *pcb);
+void fpu_fork(struct pcb_t *parent, struct pcb_t *child);
+void fpu_get_stats(fpu_stats_t *stats);
+void fpu_handler();
+extern void fpu_handler_wrapper(void);
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef _X86_FRAME_H
+#define _X86_FRAME_H
+
+#include <types.h>
+#include <arch/x86/paging.h>
+
+#define FRAME_SIZE FOUR_KB_ALIGNED
+
+/* Largest block the allocator hands out: 2^10 frames, i.e. a 4 MB page */
+#define FRAME_MAX_ORDER 10
+
+/* Frames have to be reachable through the kernel's identity map of physical memory, which
+ * ends where user space starts (128 MB). Memory above that is left unused. */
+#define FRAME_PHYS_LIMIT 0x8000000
+#define FRAME_MAX_FRAMES (FRAME_PHYS_LIMIT / FRAME_SIZE)
+
+/* How much of the frame pool is in use */
+typedef struct frame_stats_t {
+	uint32_t total;       // Frames in the pool
+	uint32_t free;        // Frames not in use
+	uint32_t shared;      // Frames in use by more than one page table
+	uint32_t free_large;  // Free blocks of the largest order (4 MB)
+} frame_stats_t;
+
+void frame_init();
+void frame_add_region(uint32_t start, uint32_t end);
+uint32_t frame_pool_end();
+uint32_t frame_alloc_pages(uint32_t order);
+void frame_free_pages(uint32_t addr, uint32_t order);
+uint32_t frame_alloc();
+void frame_get(uint32_t addr);
+void frame_put(uint32_t addr);
+uint32_t frame_refcount(uint32_t addr);
+void frame_get_stats(frame_stats_t *stats);
+
+#endif
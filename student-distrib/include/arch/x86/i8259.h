@@ -7,6 +7,7 @@
 #define _I8259_H
 
 #include <types.h>
+#include <arch/x86/irq.h>
 
 /* Rodney added ports that each PIC sits on */
 #define MASTER_8259_PORT_COMMAND 0x20
@@ -39,11 +40,10 @@
 
 /* Initialize both PICs */
 void i8259_init(void);
-/* Enable (unmask) the specified IRQ */
-void enable_irq(uint32_t irq_num);
-/* Disable (mask) the specified IRQ */
-void disable_irq(uint32_t irq_num);
-/* Send end-of-interrupt signal for the specified IRQ */
-void send_eoi(uint32_t irq_num);
+/* Mask every IRQ on both PICs, for when the I/O APIC takes over */
+void i8259_mask_all(void);
+
+/* The 8259 as the interrupt controller (see irq.h) */
+extern irq_chip_t i8259_chip;
 
 #endif /* _I8259_H */
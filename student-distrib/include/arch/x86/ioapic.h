@@ -0,0 +1,40 @@
+#ifndef _X86_IOAPIC_H
+#define _X86_IOAPIC_H
+
+#include <types.h>
+#include <arch/x86/irq.h>
+
+/* I/O APIC References:
+		Intel 82093AA I/O Advanced Programmable Interrupt Controller datasheet
+		http://wiki.osdev.org/IOAPIC
+*/
+
+/* Registers are accessed indirectly: write the register number to IOREGSEL, then use IOWIN */
+#define IOAPIC_IOREGSEL         0x00
+#define IOAPIC_IOWIN            0x10
+
+#define IOAPIC_REG_VERSION      0x01
+#define IOAPIC_REG_REDTBL(pin)  (0x10 + 2 * (pin))    /* Low half of a pin's redirection entry; the high half follows */
+
+#define IOAPIC_MAX_REDIR_SHIFT  16      /* Version register: number of pins - 1, in bits 16-23 */
+
+/* Redirection entry bits (low half). Delivery mode 0 is fixed, destination mode 0 is physical */
+#define IOAPIC_REDIR_ACTIVE_LOW 0x2000
+#define IOAPIC_REDIR_LEVEL      0x8000
+#define IOAPIC_REDIR_MASKED     0x10000
+#define IOAPIC_REDIR_DEST_SHIFT 24      /* Destination APIC ID, in the high half */
+
+/* Interrupt mode configuration register (MP specification 3.6.2.1), on machines that start in PIC mode */
+#define IMCR_SELECT_PORT        0x22
+#define IMCR_DATA_PORT          0x23
+#define IMCR_SELECT             0x70
+#define IMCR_APIC_MODE          0x01    /* Route the 8259 and NMI through the local APICs */
+
+/* IDT vector of an IRQ at a priority class. The local APIC delivers pending interrupts of a higher
+ * class (vector / 16) first; classes 3 to 6 are used, below the IPIs */
+#define IOAPIC_VECTOR(class, irq)   (((class) << 4) | (irq))
+
+/* The I/O APIC as the interrupt controller (see irq.h) */
+extern irq_chip_t ioapic_chip;
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef _X86_IRQ_H
+#define _X86_IRQ_H
+
+#include <types.h>
+
+/* Number of ISA IRQ lines */
+#define NUM_IRQS 16
+
+/* An interrupt controller: how to route, mask and acknowledge device IRQs. One is picked at boot
+ * by irq_init and every IRQ goes through it */
+typedef struct irq_chip_t {
+	const int8_t *name;
+	void (* init) (void);                   // Set up the hardware with every IRQ masked
+	void (* map_registers) (void);          // Map MMIO registers before paging is enabled (NULL if there are none)
+	uint8_t (* vector) (uint32_t irq);      // IDT vector the IRQ arrives on
+	void (* enable) (uint32_t irq);
+	void (* disable) (uint32_t irq);
+	void (* eoi) (uint32_t irq);
+} irq_chip_t;
+
+void irq_init();
+void irq_map_registers();
+const int8_t *irq_chip_name();
+uint8_t irq_vector(uint32_t irq);
+void irq_set_handler(uint32_t irq, void *handler);
+
+/* Enable (unmask) the specified IRQ */
+void enable_irq(uint32_t irq_num);
+/* Disable (mask) the specified IRQ */
+void disable_irq(uint32_t irq_num);
+/* Send end-of-interrupt signal for the specified IRQ */
+void send_eoi(uint32_t irq_num);
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef _X86_LATENCY_H
+#define _X86_LATENCY_H
+
+#include <types.h>
+#include <arch/x86/x86_desc.h>
+
+/* Interrupt handlers whose run time is measured, one histogram each. Passed by interrupt_wrapper.S */
+#define LATENCY_SRC_KEYBOARD        0
+#define LATENCY_SRC_RTC             1
+#define LATENCY_SRC_PIT             2
+#define LATENCY_SRC_FPU             3
+#define LATENCY_SRC_TICK_IPI        4
+#define LATENCY_SRC_RESCHED_IPI     5
+#define LATENCY_SRC_TLB_IPI         6
+#define LATENCY_SRC_LAPIC_TIMER     7
+#define LATENCY_NUM_SRCS            8
+
+/* Histogram buckets, in TSC cycles: bucket 0 is under 2^10, bucket i covers [2^(i+9), 2^(i+10)),
+ * and the last one everything from 2^20 up */
+#define LATENCY_HIST_BUCKETS        12
+#define LATENCY_HIST_MIN_SHIFT      10
+
+/* Distinct call sites whose longest interrupts-disabled window is kept, per CPU */
+#define LATENCY_TOP_WINDOWS         8
+
+#ifndef ASM
+
+/* Start of one handler run, kept on the interrupted stack by interrupt_wrapper.S */
+typedef struct latency_sample_t {
+	uint32_t start;         // TSC (low half) on entry
+	uint32_t switches;      // The CPU's context switch count on entry
+} latency_sample_t;
+
+/* Run times of one interrupt handler, summed over the CPUs */
+typedef struct latency_irq_stats_t {
+	const int8_t *name;
+	uint32_t count;                         // Runs measured
+	uint32_t switched;                      // Runs not measured because the handler switched processes
+	uint32_t max;                           // Longest run, in cycles
+	uint32_t hist[LATENCY_HIST_BUCKETS];
+} latency_irq_stats_t;
+
+/* The longest stretch one call site kept interrupts disabled */
+typedef struct latency_window_t {
+	const int8_t *site;     // Where interrupts were disabled: a file, "syscall", "exception", or a handler
+	uint32_t line;          // Line in the file, syscall or exception number (0 for handlers)
+	uint32_t max;           // Longest window, in cycles
+	uint32_t count;         // Windows measured from this site
+} latency_window_t;
+
+void latency_init();
+uint32_t latency_enabled();
+
+void latency_irqs_off(const int8_t *site, uint32_t line);
+void latency_irqs_on();
+
+void latency_irq_enter(uint32_t src, latency_sample_t *sample);
+void latency_irq_exit(uint32_t src, latency_sample_t *sample);
+void latency_syscall_enter(uint32_t num);
+void latency_exception_enter(uint32_t eflags, uint32_t num);
+void latency_exception_exit(uint32_t eflags);
+
+void latency_get_irq_stats(uint32_t src, latency_irq_stats_t *stats);
+uint32_t latency_get_windows(latency_window_t *windows);
+
+#endif /* ASM */
+
+#endif
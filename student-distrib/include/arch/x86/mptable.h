@@ -0,0 +1,125 @@
+#ifndef _X86_MPTABLE_H
+#define _X86_MPTABLE_H
+
+#include <types.h>
+#include <arch/x86/x86_desc.h>
+
+/* MP Specification References:
+		Intel MultiProcessor Specification, version 1.4 (chapter 4, MP configuration table)
+		http://wiki.osdev.org/Symmetric_Multiprocessing
+*/
+
+/* ISA IRQs whose wiring is read from the table */
+#define MP_ISA_IRQS             16
+
+/* Where the MP floating pointer structure may be */
+#define BDA_EBDA_SEGMENT        0x40E   /* BIOS data area: segment of the extended BIOS data area */
+#define BDA_BASE_MEM_KB         0x413   /* BIOS data area: kB of base memory */
+#define BIOS_ROM_START          0xF0000
+#define BIOS_ROM_END            0x100000
+#define MP_SEARCH_LENGTH        1024    /* Bytes of the EBDA / of the last kB of base memory searched */
+#define MP_SEARCH_ALIGN         16
+
+#define MP_FLOATING_SIGNATURE   0x5F504D5F  /* "_MP_" */
+#define MP_CONFIG_SIGNATURE     0x504D4350  /* "PCMP" */
+
+/* Configuration table entry types, and their sizes */
+#define MP_ENTRY_PROCESSOR      0
+#define MP_ENTRY_BUS            1
+#define MP_ENTRY_IOAPIC         2
+#define MP_ENTRY_IO_INT         3
+#define MP_ENTRY_LOCAL_INT      4
+#define MP_PROCESSOR_SIZE       20
+#define MP_OTHER_ENTRY_SIZE     8
+
+/* Floating pointer feature byte 2: the machine boots in PIC mode, with an IMCR to switch it out of */
+#define MP_FEATURE2_IMCR        0x80
+
+/* Processor entry flags */
+#define MP_PROC_ENABLED         0x1
+#define MP_PROC_BSP             0x2
+
+/* I/O APIC entry flags */
+#define MP_IOAPIC_ENABLED       0x1
+
+/* I/O interrupt entry: interrupt type, and the polarity/trigger flags */
+#define MP_INT_TYPE_INT         0       /* Vectored interrupt (as opposed to NMI, SMI or ExtINT) */
+#define MP_INT_POLARITY_MASK    0x3
+#define MP_INT_POLARITY_LOW     0x3
+#define MP_INT_TRIGGER_MASK     0xC
+#define MP_INT_TRIGGER_LEVEL    0xC
+
+/* MP floating pointer structure. Found by its signature; points at the configuration table */
+typedef struct __attribute__((packed)) mp_floating_t {
+	uint32_t signature;
+	uint32_t config;        // Physical address of the configuration table, 0 if a default configuration is used
+	uint8_t length;         // In 16-byte units
+	uint8_t revision;
+	uint8_t checksum;       // All bytes add up to 0
+	uint8_t features[5];    // features[0] != 0: default configuration number; features[1]: MP_FEATURE2_*
+} mp_floating_t;
+
+/* MP configuration table header. The entries follow it */
+typedef struct __attribute__((packed)) mp_config_t {
+	uint32_t signature;
+	uint16_t length;        // Header and entries in bytes
+	uint8_t revision;
+	uint8_t checksum;       // All bytes add up to 0
+	uint8_t oem_id[8];
+	uint8_t product_id[12];
+	uint32_t oem_table;
+	uint16_t oem_table_size;
+	uint16_t entry_count;
+	uint32_t lapic_addr;    // Physical address of the local APICs
+	uint16_t ext_length;
+	uint8_t ext_checksum;
+	uint8_t reserved;
+} mp_config_t;
+
+/* Processor entry of the configuration table: one per CPU */
+typedef struct __attribute__((packed)) mp_processor_t {
+	uint8_t type;           // MP_ENTRY_PROCESSOR
+	uint8_t apic_id;
+	uint8_t apic_version;
+	uint8_t flags;          // MP_PROC_ENABLED, MP_PROC_BSP
+	uint32_t signature;
+	uint32_t features;
+	uint32_t reserved[2];
+} mp_processor_t;
+
+/* Bus entry: names the bus type of a bus ID */
+typedef struct __attribute__((packed)) mp_bus_t {
+	uint8_t type;           // MP_ENTRY_BUS
+	uint8_t bus_id;
+	uint8_t bus_type[6];    // Padded with spaces, e.g. "ISA   "
+} mp_bus_t;
+
+/* I/O APIC entry */
+typedef struct __attribute__((packed)) mp_ioapic_t {
+	uint8_t type;           // MP_ENTRY_IOAPIC
+	uint8_t apic_id;
+	uint8_t apic_version;
+	uint8_t flags;          // MP_IOAPIC_ENABLED
+	uint32_t addr;          // Physical address of its registers
+} mp_ioapic_t;
+
+/* I/O interrupt entry: which I/O APIC pin a bus IRQ is wired to */
+typedef struct __attribute__((packed)) mp_io_int_t {
+	uint8_t type;           // MP_ENTRY_IO_INT
+	uint8_t int_type;       // MP_INT_TYPE_INT, ...
+	uint16_t flags;         // Polarity and trigger mode
+	uint8_t src_bus;
+	uint8_t src_irq;
+	uint8_t dst_ioapic;
+	uint8_t dst_pin;
+} mp_io_int_t;
+
+void mp_init();
+uint32_t mp_num_cpus();
+uint8_t mp_cpu_apic_id(uint32_t cpu);
+uint32_t mp_ioapic_addr();
+uint32_t mp_has_imcr();
+uint8_t mp_isa_irq_pin(uint32_t irq);
+uint16_t mp_isa_irq_flags(uint32_t irq);
+
+#endif
@@ -10,6 +10,9 @@
 #define MULTIBOOT_HEADER_MAGIC      0x1BADB002
 #define MULTIBOOT_BOOTLOADER_MAGIC      0x2BADB002
 
+/* Memory map entry type of RAM that is free to use */
+#define MULTIBOOT_MEMORY_AVAILABLE      1
+
 #ifndef ASM
 
 /* Types */
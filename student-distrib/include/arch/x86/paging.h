@@ -19,8 +19,16 @@
 #define NUM_BITS_ADDR       20     /* number of bits to address Page Table or Page. 
                                       However, we only use the top 10 bits if it's a 4MB Page      */
 
-#define PAGING_STRUCT_ADDR (FOUR_MB_ALIGNED * 31)  /* We store paging structs at 124 MB            */
-#define PROCESS_STRUCT_SIZE (FOUR_KB_ALIGNED * 4)  /* Our Process structs are 16 KB                */
+#define PAGE_FAULT_VEC      14     /* Page fault exception */
+#define PF_ERR_PRESENT      0x1    /* Page fault error code: the page was present (protection violation) */
+#define PF_ERR_WRITE        0x2    /* Page fault error code: the access was a write */
+#define PF_ERR_USER         0x4    /* Page fault error code: the access came from ring 3 */
+
+/* Flags for paging_map, the low bits of a page table entry */
+#define PAGE_PRESENT        0x1
+#define PAGE_WRITE          0x2
+#define PAGE_USER           0x4
+#define PAGE_COW            0x200  /* The cow bit of pt_entry */
 
 // Taken from lib.c
 #define VIDEO_PHYSICAL_ADDR 0xB8000              /* Physical address of video memory. We think video memory is 4 kb */
@@ -59,16 +67,35 @@ typedef struct __attribute__((packed, aligned(4))) pt_entry {
 			uint32_t dirty                  : 1;
 			uint32_t page_size_ignored      : 1;
 			uint32_t global                 : 1;
-			uint32_t reserved               : NUM_RESERVED_BITS;
+			uint32_t cow                    : 1;   /* Available to the OS: read-only because it is shared copy-on-write */
+			uint32_t reserved               : NUM_RESERVED_BITS - 1;
 			uint32_t physical_addr_31_to_12 : NUM_BITS_ADDR;
 		} __attribute__((packed)) ;
 	};
 } pt_entry;
 
+/* How the page fault handler resolved faults on user pages */
+typedef struct paging_stats_t {
+	uint32_t shared_faults; // First touches of a page mapped from the image cache
+	uint32_t private_faults;// First touches of a page that got its own frame (stack, .bss, segment edges)
+	uint32_t cow_faults;    // Writes to copy-on-write pages
+	uint32_t cow_copies;    // Faults that had to copy the page because it was still shared
+	uint32_t cow_reuses;    // Faults where the writer was the last user, so the page was just made writable
+} paging_stats_t;
+
 extern void enable_paging(pd_entry *table_ptr);
-void flush_tlb();
-void initialize_paging_structs(pd_entry *local_pd_ptr, pt_entry *local_pt_ptr, void *vmem_addr);
-pd_entry *setup_process_paging(void *process_addr, uint32_t slot_num, void *vmem_addr);
+void paging_init();
+void paging_clone_kernel(pd_entry *pd);
+void paging_map_mmio(uint32_t phys);
+pd_entry *paging_kernel_pd();
+int32_t paging_map(pd_entry *pd, uint32_t vaddr, uint32_t phys, uint32_t flags);
+uint32_t paging_unmap(pd_entry *pd, uint32_t vaddr);
+pd_entry *setup_process_paging(uint32_t slot_num, void *vmem_addr);
+pd_entry *fork_process_paging(uint32_t parent_slot, uint32_t child_slot, void *vmem_addr);
+void release_process_paging(uint32_t slot_num);
+int32_t handle_page_fault(uint32_t error);
+uint32_t alloc_user_frame();
+void paging_get_stats(paging_stats_t *stats);
 void set_process_vmem_page(uint32_t slot_num, void *vmem_addr);
 void *get_process_vmem_page(uint32_t process_slot);
 
@@ -0,0 +1,39 @@
+#ifndef _X86_SMP_H
+#define _X86_SMP_H
+
+#include <types.h>
+#include <arch/x86/x86_desc.h>
+
+/* SMP References:
+		Intel MultiProcessor Specification, version 1.4 (appendix B, operating system programming guidelines)
+		http://wiki.osdev.org/Symmetric_Multiprocessing
+*/
+
+/* The other CPUs start in real mode at this (4 kB aligned, below 1 MB) physical address */
+#define SMP_TRAMPOLINE_ADDR     0x7000
+
+/* Inter-processor interrupt vectors */
+#define SMP_TICK_VEC            0xF0    /* The boot CPU passes on a PIT tick (only without local APIC timers) */
+#define SMP_RESCHED_VEC         0xF1    /* Another CPU changed this CPU's run queue */
+#define SMP_TLB_VEC             0xF2    /* Another CPU changed a kernel-maintained mapping (vidmap) */
+
+void smp_init();
+void smp_boot_aps();
+void smp_ap_main();
+uint32_t smp_cpu_id();
+uint32_t smp_num_cpus();
+tss_t *smp_get_tss(uint32_t cpu);
+void smp_send_reschedule(uint32_t cpu);
+void smp_broadcast_tick();
+void smp_flush_tlb_others();
+
+void smp_tick_handler();
+void smp_resched_handler();
+void smp_tlb_handler();
+void smp_timer_handler();
+extern void smp_tick_handler_wrapper(void);
+extern void smp_resched_handler_wrapper(void);
+extern void smp_tlb_handler_wrapper(void);
+extern void smp_timer_handler_wrapper(void);
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef _X86_SPINLOCK_H
+#define _X86_SPINLOCK_H
+
+#include <types.h>
+#include <lib/lib.h>
+
+/* A busy-waiting lock for data shared between CPUs. Kernel code runs with interrupts off, so a lock
+ * is never taken by an interrupt handler on the CPU that already holds it; the _irqsave variants are
+ * for the few places that may be entered with interrupts on. Holders must not sleep. */
+typedef struct spinlock_t {
+	volatile uint32_t locked;
+} spinlock_t;
+
+#define SPINLOCK_INIT { 0 }
+
+/* Initialize a lock to the unlocked state */
+#define spin_lock_init(lock)            \
+do {                                    \
+	(lock)->locked = 0;                 \
+} while(0)
+
+/* Take a lock, spinning until it is free. The test-and-set is only retried once a plain read sees
+ * the lock free, so waiters don't keep stealing the cache line from the holder. */
+#define spin_lock(lock)                 \
+do {                                    \
+	asm volatile("1: lock btsl $0, %0 \n      \
+			jnc 3f               \n      \
+			2: pause             \n      \
+			testl $1, %0         \n      \
+			jnz 2b               \n      \
+			jmp 1b               \n      \
+			3:"                     \
+			: "+m"((lock)->locked)  \
+			:                       \
+			: "memory", "cc"        \
+			);                      \
+} while(0)
+
+/* Release a lock. Stores aren't reordered with older stores on x86, so a plain store is enough */
+#define spin_unlock(lock)               \
+do {                                    \
+	asm volatile("movl $0, %0"          \
+			: "=m"((lock)->locked)  \
+			:                       \
+			: "memory"              \
+			);                      \
+} while(0)
+
+/* Disable interrupts on this CPU (saving the flags) and take a lock */
+#define spin_lock_irqsave(lock, flags)  \
+do {                                    \
+	cli_and_save(flags);                \
+	spin_lock(lock);                    \
+} while(0)
+
+/* Release a lock and restore the interrupt flag saved by spin_lock_irqsave */
+#define spin_unlock_irqrestore(lock, flags) \
+do {                                    \
+	spin_unlock(lock);                  \
+	restore_flags(flags);               \
+} while(0)
+
+/* Atomically add "val" to the 32-bit counter at "ptr" and store its previous value into "old" */
+#define atomic_fetch_add(ptr, val, old) \
+do {                                    \
+	(old) = (val);                      \
+	asm volatile("lock xaddl %0, %1"    \
+			: "+r"(old), "+m"(*(ptr)) \
+			:                       \
+			: "memory", "cc"        \
+			);                      \
+} while(0)
+
+#endif
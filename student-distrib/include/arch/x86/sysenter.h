@@ -0,0 +1,18 @@
+#ifndef _X86_SYSENTER_H
+#define _X86_SYSENTER_H
+
+#include <types.h>
+
+/* Family, model and stepping in CPUID leaf 1's eax. Pentium Pros before model 3 stepping 3 report
+ * SEP without actually having sysenter */
+#define SYSENTER_CPUID_FAMILY_MASK      0xF00
+#define SYSENTER_CPUID_FAMILY_P6        0x600
+#define SYSENTER_CPUID_MODEL_STEP_MASK  0xFF
+#define SYSENTER_CPUID_FIRST_P6_SEP     0x33
+
+void sysenter_init();
+void sysenter_init_cpu();
+uint32_t sysenter_available();
+extern void sysenter_handler(void);
+
+#endif
@@ -3,18 +3,27 @@
 
 #include <types.h>
 #include <arch/x86/paging.h>
+#include <arch/x86/fpu.h>
+#include <arch/x86/elf.h>
 #include <fs/fs.h>
+#include <kernel/wait_queue.h>
+#include <kernel/timer.h>
+#include <kernel/image_cache.h>
 
 #define PCB_BITMASK (~0x1FFF)
-#define ELF_MAGIC_HEADER "\x7f\x45\x4c\x46"
-#define ELF_MAGIC_HEADER_LEN 4
-#define ELF_ENTRYPOINT_OFFSET 24
 
 #define KERNEL_PAGE_END 0x800000
 #define PROCESS_PAGE_SIZE 0x400000
 #define KERNEL_STACK_SIZE 0x2000
 
-#define MAX_PROCESSES 6
+/* Each process slot gets a 16 kB task block (kernel stack + PCB, page directory, vmem page table) from the
+ * frame allocator the first time it is used. Its user pages are allocated from the same pool on demand. */
+#define TASK_BLOCK_SIZE 0x4000
+#define TASK_BLOCK_ORDER 2                    // log2(TASK_BLOCK_SIZE / FRAME_SIZE)
+#define PROCESS_MIN_MEMORY 0x10000            // Task block, user page table and a few user pages
+#define MAX_PROCESSES_LIMIT 1024
+#define DEFAULT_MEM_UPPER_KB (127 * 1024)     // Assume 128MB of RAM if the bootloader doesn't tell us
+
 #define MAX_FILE_DESCRIPTORS 8
 #define MAX_PROGRAM_NAME_LENGTH 128  // Rodney: I picked this length arbitrarily
 #define MAX_ARGS_LENGTH 128
@@ -26,24 +35,28 @@
 #define PROCESS_NONE 0
 #define PROCESS_RUNNING 1
 #define PROCESS_BLOCKED 2
+#define PROCESS_EXITED 3     // Halted, but its CPU may still be on its kernel stack (see release_pcb_slot)
 
 typedef struct pcb_t pcb_t;
 
 /* This is our PCB that each process will have (called process descriptor in lecture) */
 struct pcb_t {
+	// Registers saved for context switching. Must stay first: switch_to in task_asm.S stores the
+	// kernel esp at offset 0 (the other callee-saved registers are on the kernel stack itself)
+	struct {
+		uint32_t esp;
+	} regs;
+
 	// Linked list of processes
 	pcb_t *parent;
 	pcb_t *child;
 
+	// Exit status of the last child that halted, handed back to the parent's execute
+	int32_t child_status;
+
 	// Paging directory pointer
 	pd_entry *process_pd_ptr;
 
-	// Registers saved for context switching
-	struct {
-		uint32_t esp;
-		uint32_t ebp;
-	} regs;
-
 	struct {
 		uint32_t ss;
 		uint32_t esp;
@@ -61,43 +74,94 @@ struct pcb_t {
 
 	// Bookkeeping information
 	uint32_t entrypoint;
+	uint32_t image_inode;          // Program file, read into user pages on demand (see load_program_page)
+	elf_segment_t segments[ELF_MAX_LOAD_SEGMENTS];  // Its PT_LOAD segments
+	uint8_t num_segments;
+	image_cache_t *image;          // Cached pages of the program file shared with other processes running it, or NULL
 	uint32_t slot_num;
 	uint32_t pid;
 	uint8_t in_use;
 	uint8_t terminal_num;
+	uint8_t forked;                // Created by fork: nobody waits for it to halt
 
 	uint8_t rtc_enabled;
 	uint32_t rtc_interval;         // How many ticks a process has to wait before "RTC read" returns. So 1024 Hz means rtc_interval 1. 512 Hz means rtc_interval 2
-	uint32_t remaining_rtc_ticks;  // Ticks left until the interrupt should fire again.
+	uint32_t rtc_deadline;         // Virtual RTC time (see drivers/rtc.c) at which the next rtc_read returns
+	uint8_t rtc_queued;            // Set while the process waits in rtc_read, on the RTC's deadline heap
+	wait_queue_t rtc_wait;         // This process sleeps here in rtc_read until rtc_queued is cleared
+
+	timer_t sleep_timer;           // Wakes the process up from the sleep syscall
 
 	// Current process state
 	uint32_t status;
+
+	// Run queue linkage and priority (see kernel/sched.c)
+	pcb_t *rq_next;
+	pcb_t *rq_prev;
+	uint32_t priority;              // Current run queue level: the base level from nice, minus the foreground boost
+	int32_t nice;                   // Offset from SCHED_DEFAULT_PRIORITY, set with the nice syscall
+	uint8_t aged;                   // Raised above its base level for having waited too long (see sched_age)
+	uint32_t queued_tick;           // When it last joined the back of its FIFO
+	uint8_t on_runqueue;
+	uint8_t cpu;                    // The CPU whose run queue it is on. A process never moves to another CPU
+
+	// CPU accounting (see kernel/sched.c). All times are in PIT ticks.
+	uint32_t cpu_ticks;             // Time spent on the CPU
+	uint32_t voluntary_switches;    // Times it gave up the CPU by blocking or exiting
+	uint32_t involuntary_switches;  // Times it was preempted
+	uint32_t last_run_tick;         // When it last got the CPU
+	uint32_t slice_start_tick;      // When its current timeslice started
+	uint32_t quantum;               // Timeslice length, or 0 to use the system-wide quantum
+
+	// Next process sleeping on the same wait queue, and that queue or NULL (see kernel/wait_queue.c)
+	pcb_t *wait_next;
+	wait_queue_t *wait_queue;
+
+	// FPU/SSE registers, saved here only when another process needs the FPU (see arch/x86/fpu.c)
+	uint8_t fpu_used;
+	fpu_state_t fpu_state;
 };
 
-/* Kernel Task Structure. We did not use this in the code yet */
-typedef struct task_kernel_stack_t {
-	pcb_t pcb;
-	uint8_t stack[KERNEL_STACK_SIZE - sizeof(pcb_t)];
-} task_kernel_stack_t;
+/* Kernel Task Structure. One of these is allocated from the frame allocator for each process slot */
+typedef struct task_block_t {
+	// The PCB sits at the bottom of the kernel stack so it can be found by masking esp
+	union {
+		pcb_t pcb;
+		uint8_t kernel_stack[KERNEL_STACK_SIZE];
+	};
+	pd_entry page_directory[NUM_PD_ENTRIES];
+	pt_entry vmem_page_table[NUM_PT_ENTRIES];
+} task_block_t;
 
 uint32_t get_next_pid();
 
+void task_init();
+uint32_t get_max_processes();
+uint32_t get_num_slots();
+pcb_t *allocate_pcb();
+void free_pcb(pcb_t *pcb);
+void release_pcb_slot(pcb_t *pcb);
+task_block_t *get_task_block_from_slot(uint32_t pcb_slot);
+
 void open_stdin_and_stdout();
 void kernel_run_first_program(const int8_t* command);
 
 int32_t halt_program(int32_t status);
 
 void set_kernel_stack(const void *stack);
-uint32_t get_executable_entrypoint(const void *executable);
+uint32_t get_executable_entrypoint(const elf32_header_t *header);
 pcb_t *get_pcb_from_esp(void *process_esp);
 pcb_t *get_pcb_from_slot(uint32_t pcb_slot);
 pcb_t *get_current_pcb();
-void *get_process_page_from_slot(uint32_t task_slot);
 void *get_current_kernel_stack_base();
 void *get_kernel_stack_base_from_slot(uint32_t pcb_slot);
 int32_t parse_command(const int8_t* command, int8_t *buf_name, int8_t *buf_args);
-uint32_t load_program_into_slot(const int8_t *filename, uint32_t pcb_slot);
+uint32_t load_program(pcb_t *pcb, const int8_t *filename);
+uint32_t load_program_page(uint32_t page_addr, uint8_t *writable, uint8_t *shared);
+void prepare_kernel_stack(pcb_t *pcb, void *stack_base, void (*entry)(void));
+void enter_user_program();
 
 extern void switch_to_ring_3(uint32_t esp, uint32_t eip);
+extern void switch_to(pcb_t *prev, pcb_t *next);
 
 #endif
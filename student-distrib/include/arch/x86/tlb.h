@@ -0,0 +1,22 @@
+#ifndef _X86_TLB_H
+#define _X86_TLB_H
+
+#include <types.h>
+#include <arch/x86/paging.h>
+
+/* How much TLB flushing address space changes have caused */
+typedef struct tlb_stats_t {
+	uint32_t full_flushes;    // CR3 reloads that only flushed the TLB (same page directory)
+	uint32_t page_flushes;    // Single pages dropped with invlpg
+	uint32_t cr3_loads;       // Switches to a different page directory (flushes every non-global entry)
+	uint32_t cr3_skips;       // Switches skipped because the page directory was already loaded
+} tlb_stats_t;
+
+void tlb_init();
+void tlb_load_pd(pd_entry *pd);
+uint8_t tlb_pd_is_loaded(pd_entry *pd);
+void tlb_flush_all();
+void tlb_flush_page(void *addr);
+void tlb_get_stats(tlb_stats_t *stats);
+
+#endif
@@ -16,6 +16,12 @@
 #define KERNEL_TSS 0x0030
 #define KERNEL_LDT 0x0038
 
+/* Maximum number of CPUs. The boot CPU uses KERNEL_TSS; every other CPU gets
+ * its own TSS descriptor, in the GDT entries following the LDT */
+#define SMP_MAX_CPUS 8
+#define AP_TSS_BASE 0x0040
+#define AP_TSS(cpu) (AP_TSS_BASE + 8 * ((cpu) - 1))
+
 /* Size of the task state segment (TSS) */
 #define TSS_SIZE 104
 
@@ -151,6 +157,7 @@ extern uint32_t ldt;
 extern uint32_t tss_size;
 extern seg_desc_t tss_desc_ptr;
 extern tss_t tss;
+extern seg_desc_t ap_tss_desc_ptr[SMP_MAX_CPUS - 1];
 
 /* Sets runtime-settable parameters in the GDT entry for the LDT */
 #define SET_LDT_PARAMS(str, addr, lim) \
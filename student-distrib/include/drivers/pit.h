@@ -5,6 +5,7 @@
 
 #define PIT_IRQ 0
 #define PIT_CH0_DATA_PORT 0x40
+#define PIT_CH2_DATA_PORT 0x42
 #define PIT_CMD_REG_PORT 0x43
 
 #define PIT_BINARY_VAL                      0x00    // Binary counter values
@@ -27,13 +28,27 @@
 #define PIT_CMD_COUNTER2                    0x80
 #define PIT_CMD_READBACK                    0xc0
 
+#define PIT_READBACK_COUNTER0               0x02    // Read-back command: select counter 0 (latches count and status)
+#define PIT_STATUS_OUT                      0x80    // Read-back status: state of the OUT pin (high once a one-shot expired)
+#define PIT_STATUS_NULL_COUNT               0x40    // Read-back status: new count not loaded into the counter yet
+
+/* Channel 2 is gated and read back through the keyboard controller's port B */
+#define PIT_CH2_GATE_PORT                   0x61
+#define PIT_CH2_GATE                        0x01    // Counting only runs while the gate is high
+#define PIT_CH2_SPEAKER                     0x02    // Connects OUT2 to the PC speaker
+#define PIT_CH2_OUT                         0x20    // State of OUT2
+
 #define PIT_FREQUENCY         1193182
+#define PIT_MAX_COUNT         0xFFFF   // Longest one-shot we can program (about 55ms)
 
-#define LOW_EIGHT_BIT_BITMASK 0xFF
+#define PIT_NO_EVENT          0        // pit_set_next_event: nothing pending, sleep as long as possible
 
-void scheduler();
+#define LOW_EIGHT_BIT_BITMASK 0xFF
 
 void pit_init(uint32_t hertz);
+void pit_set_next_event(uint32_t ticks);
+uint32_t pit_get_ticks();
+uint32_t pit_get_interrupts();
 void pit_handler();
 extern void pit_handler_wrapper(void);
 
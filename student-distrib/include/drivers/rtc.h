@@ -18,7 +18,7 @@
 #define MIN_FREQ    2
 #define MAX_FREQ 1024
 
-void set_rtc_test_enabled(int enabled);
+void set_rtc_test_rate(uint32_t hertz);
 void rtc_handler();
 extern void rtc_handler_wrapper(void);
 
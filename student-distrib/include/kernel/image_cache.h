@@ -0,0 +1,41 @@
+#ifndef _IMAGE_CACHE_H
+#define _IMAGE_CACHE_H
+
+#include <types.h>
+#include <arch/x86/paging.h>
+
+/* Number of different programs whose pages can be cached at the same time */
+#define IMAGE_CACHE_ENTRIES 16
+
+/* Pages of one program file, shared by every process running it. Entries are allocated from a slab
+ * cache of their own when a program is first started. The frames are loaded from the
+ * filesystem the first time any of those processes touches them, and mapped copy-on-write. */
+typedef struct image_cache_t {
+	uint32_t inode;        // Program file
+	uint32_t size;         // File size in bytes
+	uint32_t users;        // Processes running the program. The entry can only be evicted at 0
+	uint32_t last_used;    // Bumped on every lookup, for LRU eviction
+	uint32_t *pages;       // One frame per 4kB of the file (0 if not loaded yet), from kmalloc
+} image_cache_t;
+
+/* Number of 4kB pages (and entries in the page index) of a file */
+#define IMAGE_CACHE_NUM_PAGES(size) (((size) + FOUR_KB_ALIGNED - 1) / FOUR_KB_ALIGNED)
+
+/* Counters for the image cache */
+typedef struct image_cache_stats_t {
+	uint32_t hits;          // Programs started that were already cached
+	uint32_t misses;        // Programs started that weren't
+	uint32_t evictions;     // Unused programs dropped to make room
+	uint32_t pages_loaded;  // Pages read from the filesystem into the cache
+	uint32_t pages_mapped;  // Page faults resolved by mapping a cached page
+} image_cache_stats_t;
+
+void image_cache_init();
+image_cache_t *image_cache_get(uint32_t inode, uint32_t size);
+void image_cache_hold(image_cache_t *image);
+void image_cache_put(image_cache_t *image);
+uint32_t image_cache_page(image_cache_t *image, uint32_t index);
+uint32_t image_cache_reclaim();
+void image_cache_get_stats(image_cache_stats_t *stats);
+
+#endif
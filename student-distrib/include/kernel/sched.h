@@ -0,0 +1,104 @@
+#ifndef _SCHED_H
+#define _SCHED_H
+
+#include <types.h>
+#include <arch/x86/task.h>
+#include <arch/x86/spinlock.h>
+
+/* Number of priority levels. Level 0 is the highest priority; one bit per level must fit in the bitmap */
+#define SCHED_NUM_PRIORITIES 32
+#define SCHED_DEFAULT_PRIORITY 16
+
+/* Range of nice values. The base priority level of a process is SCHED_DEFAULT_PRIORITY + nice */
+#define SCHED_NICE_MIN (-SCHED_DEFAULT_PRIORITY)
+#define SCHED_NICE_MAX (SCHED_NUM_PRIORITIES - 1 - SCHED_DEFAULT_PRIORITY)
+
+/* Levels gained by processes on the active terminal, so the one the user is typing into stays responsive */
+#define SCHED_FOREGROUND_BOOST 8
+
+/* Ticks a process may wait behind higher levels before it is raised for one timeslice, so that busy
+ * processes on the active terminal can't starve the others */
+#define SCHED_STARVATION_TICKS 20
+
+/* PIT tick rate. Timeslices and CPU accounting are measured in these ticks */
+#define SCHED_TICK_HZ 100
+
+/* Length of a timeslice in PIT ticks. Only enforced while more than one process is runnable */
+#define SCHED_DEFAULT_QUANTUM_TICKS 1
+#define SCHED_MAX_QUANTUM_TICKS 1000
+
+/* Scopes for sched_set_quantum / the set_quantum syscall */
+#define SCHED_QUANTUM_PROCESS 0    // The calling process (and the children it executes afterwards)
+#define SCHED_QUANTUM_SYSTEM 1     // Every process that hasn't picked its own quantum
+
+/* One FIFO list of runnable processes */
+typedef struct runqueue_list_t {
+	pcb_t *head;
+	pcb_t *tail;
+} runqueue_list_t;
+
+/* Per-priority FIFO run queues. Bit i of the bitmap is set iff queues[i] is non-empty */
+typedef struct runqueue_t {
+	uint32_t bitmap;
+	uint32_t nr_running;
+	runqueue_list_t queues[SCHED_NUM_PRIORITIES];
+} runqueue_t;
+
+/* How much time the CPUs have spent in their idle tasks */
+typedef struct sched_idle_stats_t {
+	uint32_t idle_ticks;      // PIT ticks spent idle, summed over all CPUs
+	uint32_t idle_entries;    // Number of times a CPU went idle
+	uint32_t total_ticks;     // PIT ticks since the PIT was started
+	uint32_t pit_interrupts;  // PIT interrupts taken in that time
+	uint32_t num_cpus;        // CPUs online (idle_ticks can be up to total_ticks times this)
+} sched_idle_stats_t;
+
+/* How busy one CPU is */
+typedef struct sched_cpu_stats_t {
+	uint32_t nr_running;      // Runnable processes on its run queue
+	uint32_t idle_ticks;      // PIT ticks spent idle
+	uint32_t idle_entries;    // Number of times it went idle
+	uint32_t switches;        // Context switches
+	uint32_t aged;            // Times a waiting process was raised to keep it from starving
+} sched_cpu_stats_t;
+
+void runqueue_init(runqueue_t *rq);
+void runqueue_enqueue(runqueue_t *rq, pcb_t *pcb);
+void runqueue_dequeue(runqueue_t *rq, pcb_t *pcb);
+void runqueue_requeue(runqueue_t *rq, pcb_t *pcb);
+pcb_t *runqueue_peek(runqueue_t *rq);
+
+void sched_init();
+void sched_start(pcb_t *pcb);
+void *sched_get_idle_stack(uint32_t cpu);
+void sched_run_idle();
+uint32_t sched_select_cpu();
+void sched_enqueue(pcb_t *pcb);
+void sched_dequeue(pcb_t *pcb);
+void sched_wake_up(pcb_t *pcb);
+void sched_prepare_block();
+void sched_block();
+void sched_cancel_block();
+
+void sched_task_init(pcb_t *pcb, pcb_t *parent);
+void sched_account_switch(pcb_t *prev, pcb_t *next, uint8_t voluntary);
+uint32_t sched_get_quantum(pcb_t *pcb);
+int32_t sched_set_quantum(pcb_t *pcb, uint32_t ticks, uint32_t scope);
+uint32_t sched_get_cpu_ticks(pcb_t *pcb);
+void sched_update_priority(pcb_t *pcb);
+int32_t sched_nice(pcb_t *pcb, int32_t increment);
+void sched_foreground_changed();
+void sched_preempt();
+void sched_ipi();
+
+void context_switch(pcb_t *last_pcb, pcb_t *pcb);
+void schedule();
+void scheduler();
+void sched_timeslice_expired();
+void sched_deferred_switch();
+uint32_t sched_switch_count();
+
+void sched_get_idle_stats(sched_idle_stats_t *stats);
+void sched_get_cpu_stats(uint32_t cpu, sched_cpu_stats_t *stats);
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef _SLAB_H
+#define _SLAB_H
+
+#include <types.h>
+#include <arch/x86/spinlock.h>
+
+/* Size classes of kmalloc: powers of two from KMALLOC_MIN_SIZE to KMALLOC_MAX_SIZE. Bigger
+ * requests get whole blocks from the frame allocator. */
+#define KMALLOC_MIN_SHIFT 4
+#define KMALLOC_MAX_SHIFT 10
+#define KMALLOC_MIN_SIZE (1 << KMALLOC_MIN_SHIFT)
+#define KMALLOC_MAX_SIZE (1 << KMALLOC_MAX_SHIFT)
+#define KMALLOC_NUM_CLASSES (KMALLOC_MAX_SHIFT - KMALLOC_MIN_SHIFT + 1)
+
+/* A cache sizes its slabs to hold at least this many objects */
+#define SLAB_MIN_OBJECTS 8
+
+struct slab_t;
+
+/* A cache of equally sized objects, carved out of slabs of one or more frames. Owned by the caller,
+ * which must keep it alive while any of its objects are. */
+typedef struct kmem_cache_t {
+	const int8_t *name;
+	uint32_t object_size;       // Size asked for
+	uint32_t stride;            // Distance between objects: object_size rounded up to the alignment
+	uint32_t first_offset;      // Offset of the first object in a slab, past the slab header
+	uint32_t order;             // Slabs are 2^order frames
+	uint32_t objects_per_slab;
+	struct slab_t *partial;     // Slabs with at least one free object, including empty ones
+	uint32_t empty_slabs;       // Slabs with no object in use, kept around for the next allocation
+	uint32_t num_slabs;
+	uint32_t in_use;            // Objects currently allocated
+	uint32_t allocs;            // Objects ever allocated
+	uint32_t frees;             // Objects ever freed
+	spinlock_t lock;            // Protects the slabs and the counters
+	struct kmem_cache_t *next;  // All caches, for the statistics
+} kmem_cache_t;
+
+/* Totals over every cache plus the large kmalloc blocks */
+typedef struct slab_stats_t {
+	uint32_t caches;
+	uint32_t slabs;
+	uint32_t slab_frames;   // Frames held by slabs
+	uint32_t objects;       // Objects in use
+	uint32_t allocs;        // Objects ever allocated
+	uint32_t frees;         // Objects ever freed
+	uint32_t large_blocks;  // kmalloc blocks too big for a size class, currently in use
+	uint32_t large_frames;  // Frames held by them
+} slab_stats_t;
+
+void slab_init();
+void kmem_cache_init(kmem_cache_t *cache, const int8_t *name, uint32_t size, uint32_t align);
+void *kmem_cache_alloc(kmem_cache_t *cache);
+void kmem_cache_free(kmem_cache_t *cache, void *object);
+void *kmalloc(uint32_t size);
+void kfree(void *ptr);
+void slab_get_stats(slab_stats_t *stats);
+
+#endif
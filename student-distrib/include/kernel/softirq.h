@@ -0,0 +1,32 @@
+#ifndef _SOFTIRQ_H
+#define _SOFTIRQ_H
+
+#include <types.h>
+
+typedef void (*tasklet_func_t)(void *data);
+
+/* Work an interrupt handler defers until interrupts are back on. A tasklet is queued at most once
+ * at a time, and runs on the CPU that queued it. Owned by the caller, which must keep it alive */
+typedef struct tasklet_t {
+	struct tasklet_t *next;     // Linkage in the CPU's queue
+	tasklet_func_t func;        // Runs with interrupts enabled; must not sleep
+	void *data;
+	uint8_t queued;             // Set from tasklet_schedule until func starts
+} tasklet_t;
+
+#define TASKLET_INIT(func, data) { NULL, (func), (data), 0 }
+
+/* Counters for deferred work, summed over the CPUs */
+typedef struct softirq_stats_t {
+	uint32_t scheduled;   // tasklet_schedule calls that queued a tasklet
+	uint32_t merged;      // tasklet_schedule calls for a tasklet already queued
+	uint32_t run;         // Tasklets run
+	uint32_t batches;     // Times a queue was drained
+} softirq_stats_t;
+
+void tasklet_schedule(tasklet_t *tasklet);
+void softirq_run();
+uint32_t softirq_active();
+void softirq_get_stats(softirq_stats_t *stats);
+
+#endif
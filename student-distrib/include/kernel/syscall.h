@@ -13,10 +13,19 @@
 #define SYSCALL_VIDMAP 8
 #define SYSCALL_SET_HANDLER 9
 #define SYSCALL_SIGRETURN 10
+#define SYSCALL_SET_QUANTUM 11
+#define SYSCALL_NICE 12
+#define SYSCALL_SLEEP 13
+#define SYSCALL_FORK 14
 
 #define SYSCALL_EINVAL -1
 
+/* What syscall_handler_wrapper leaves on top of the kernel stack: ebx, ecx, edx, esi, edi, ebp, then the
+ * iret frame (eip, cs, eflags, esp, ss) */
+#define SYSCALL_FRAME_SIZE (11 * 4)
+
 extern void syscall_handler_wrapper(void);
+extern void fork_child_return(void);
 
 int32_t syscall_read(int32_t fd, void *buf, int32_t nbytes);
 int32_t syscall_write(int32_t fd, const void *buf, int32_t nbytes);
@@ -28,5 +37,9 @@ int32_t syscall_getargs(uint8_t *buf, int32_t nbytes);
 int32_t syscall_vidmap(uint8_t **screen_start);
 int32_t syscall_set_handler(int32_t signum, void *handler_address);
 int32_t syscall_sigreturn();
+int32_t syscall_set_quantum(uint32_t ticks, uint32_t scope);
+int32_t syscall_nice(int32_t increment);
+int32_t syscall_sleep(uint32_t ms);
+int32_t syscall_fork();
 
 #endif
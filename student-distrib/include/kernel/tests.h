@@ -4,6 +4,10 @@
 #define FILE_NAME_LIMIT   32
 #define BUFFER_4K       4096
 
+#define SCHED_BENCH_MAX_TASKS     256
+#define SCHED_BENCH_ITER_SHIFT     12   /* 2^12 picks per run queue size */
+#define SWITCH_BENCH_ITER_SHIFT    12   /* 2^12 round trips per context switch variant */
+
 void test_suite();
 
 void list_all_files();      // Test #1
@@ -11,5 +15,10 @@ void read_files_by_name();  // Test #2
 void read_file_by_index();  // Test #3
 void start_rtc_test();      // Test #4
 void stop_rtc_test();       // Test #5
+void sched_benchmark();     // Test #6
+void kernel_stats();        // Test #7
+void process_stats();       // Test #8
+void switch_benchmark();    // Test #9
+void latency_stats();       // Test #10 (Ctrl+0)
 
 #endif
@@ -0,0 +1,50 @@
+#ifndef _TIMER_H
+#define _TIMER_H
+
+#include <types.h>
+
+/* Shape of the timer wheel. Each level has TIMER_WHEEL_SLOTS slots, and a slot on level n covers
+ * TIMER_WHEEL_SLOTS^n ticks, so timers up to TIMER_WHEEL_SLOTS^TIMER_WHEEL_LEVELS ticks out can be
+ * stored (about 46 hours at 100 Hz). Later deadlines are clamped to that. */
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_MAX_TICKS ((1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1)
+
+/* timer_next_event: no timer is pending */
+#define TIMER_NO_EVENT 0
+
+typedef void (*timer_callback_t)(void *data);
+
+/* A one-shot kernel timer. Owned by the caller, which must keep it alive while it is pending */
+typedef struct timer_t {
+	struct timer_t *next;       // Linkage in a wheel slot
+	struct timer_t *prev;
+	uint32_t expires;           // PIT tick the timer fires on
+	timer_callback_t callback;  // Runs in the PIT interrupt with interrupts disabled
+	void *data;
+	uint8_t queued;             // Set while the timer is pending
+	uint8_t level;              // Wheel slot it is queued in
+	uint8_t slot;
+} timer_t;
+
+/* Counters for the timer wheel */
+typedef struct timer_stats_t {
+	uint32_t pending;     // Timers currently on the wheel
+	uint32_t added;       // Timers ever added
+	uint32_t cancelled;   // Timers cancelled before they fired
+	uint32_t expired;     // Timers that fired
+	uint32_t cascaded;    // Times a timer was moved down a level
+} timer_stats_t;
+
+void timer_init();
+void timer_setup(timer_t *timer, timer_callback_t callback, void *data);
+void timer_add(timer_t *timer, uint32_t expires);
+int32_t timer_cancel(timer_t *timer);
+uint8_t timer_pending(timer_t *timer);
+void timer_run(uint32_t now);
+uint32_t timer_next_event(uint32_t now);
+void timer_get_stats(timer_stats_t *stats);
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef _VDATA_H
+#define _VDATA_H
+
+#include <types.h>
+
+/* Where the data page is mapped, read-only, in every process: the page after the vidmap page (132MB + 4kB).
+ * User programs rely on this address and on the layout of vdata_t (see ece391syscall.h) */
+#define VDATA_VIRT_ADDR       0x8401000
+#define VDATA_VERSION         1
+
+/* vdata_update's partial tick is in units of 1/(1 << VDATA_PARTIAL_SHIFT) ticks */
+#define VDATA_PARTIAL_SHIFT   16
+
+/* Kernel data user programs can read without a system call. The kernel is the only writer; seq is
+ * odd while it is updating the page, so readers retry if seq was odd or changed while they read */
+typedef struct vdata_t {
+	volatile uint32_t seq;
+	uint32_t version;         // VDATA_VERSION
+	uint32_t tick_hz;         // Ticks per second
+	uint32_t ticks;           // Ticks since the PIT was started
+	uint32_t tsc_stamp;       // Low half of the TSC at the start of that tick
+	uint32_t tsc_khz;         // TSC cycles per millisecond, or 0 if the TSC wasn't calibrated
+	uint32_t num_cpus;        // CPUs online
+	uint32_t nr_running;      // Runnable processes, summed over the CPUs' run queues
+	uint32_t switches;        // Context switches, summed over the CPUs
+	uint32_t idle_ticks;      // Ticks spent idle, summed over the CPUs
+} vdata_t;
+
+void vdata_init();
+void vdata_update(uint32_t ticks, uint32_t partial);
+vdata_t *vdata_get_page();
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef _WAIT_QUEUE_H
+#define _WAIT_QUEUE_H
+
+#include <types.h>
+#include <arch/x86/spinlock.h>
+
+struct pcb_t;
+
+/* FIFO of processes blocked until some event happens. Processes are linked through pcb_t.wait_next */
+typedef struct wait_queue_t {
+	spinlock_t lock;
+	struct pcb_t *head;
+	struct pcb_t *tail;
+} wait_queue_t;
+
+void wait_queue_init(wait_queue_t *wq);
+void wait_queue_prepare(wait_queue_t *wq);
+void wait_queue_sleep(wait_queue_t *wq);
+void wait_queue_finish(wait_queue_t *wq);
+int32_t wait_queue_wake_one(wait_queue_t *wq);
+int32_t wait_queue_wake_all(wait_queue_t *wq);
+
+/* Sleep on a wait queue until "condition" is true. The process is queued and marked blocked before
+ * the condition is checked, so a wake-up from another CPU in between makes the sleep return at once
+ * instead of being lost */
+#define wait_event(wq, condition)       \
+do {                                    \
+	for(;;) {                           \
+		wait_queue_prepare(wq);         \
+		if(condition) break;            \
+		wait_queue_sleep(wq);           \
+	}                                   \
+	wait_queue_finish(wq);              \
+} while(0)
+
+#endif
@@ -6,6 +6,7 @@
 #define _LIB_H
 
 #include "types.h"
+#include <arch/x86/latency.h>
 
 extern void putc(uint8_t ch);
 int32_t printf(int8_t *format, ...);
@@ -39,7 +40,8 @@ do {                                    \
 
 /* Save flags and then clear interrupt flag
  * Saves the EFLAGS register into the variable "flags", and then
- * disables interrupts on this processor */
+ * disables interrupts on this processor. If they were on, the
+ * window they stay off for is measured (see latency.c) */
 #define cli_and_save(flags)             \
 do {                                    \
 	asm volatile("pushfl        \n      \
@@ -49,6 +51,8 @@ do {                                    \
 			:                       \
 			: "memory", "cc"        \
 			);                      \
+	if((flags) & EFLAGS_INTERRUPT)      \
+		latency_irqs_off(__FILE__, __LINE__); \
 } while(0)
 
 /* Set interrupt flag - enable interrupts on this processor */
@@ -66,6 +70,8 @@ do {                                    \
  * after a cli_and_save_flags(flags) */
 #define restore_flags(flags)            \
 do {                                    \
+	if((flags) & EFLAGS_INTERRUPT)      \
+		latency_irqs_on();              \
 	asm volatile("pushl %0      \n      \
 			popfl"                  \
 			:                       \
@@ -74,4 +80,31 @@ do {                                    \
 			);                      \
 } while(0)
 
+/* Let pending interrupts in for a moment, then disable them again. For long-running kernel code
+ * that holds no locks; an interrupt taken here may switch to another process before returning.
+ * sti only takes effect after the next instruction, hence the nop */
+#define interrupt_window()              \
+do {                                    \
+	latency_irqs_on();                  \
+	asm volatile("sti            \n      \
+			nop             \n      \
+			cli"                    \
+			:                       \
+			:                       \
+			: "memory", "cc"        \
+			);                      \
+	latency_irqs_off(__FILE__, __LINE__); \
+} while(0)
+
+/* Read time-stamp counter
+ * Stores the 64-bit cycle count since reset into the variable "val" */
+#define rdtsc(val)                      \
+do {                                    \
+	asm volatile("rdtsc"                \
+			: "=A"(val)             \
+			:                       \
+			: "memory"              \
+			);                      \
+} while(0)
+
 #endif /* _LIB_H */
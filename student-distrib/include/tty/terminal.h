@@ -12,6 +12,8 @@
 
 #define KEYBOARD_SIZE 128
 #define KEYBOARD_BUFFER_SIZE 128
+#define KEYBOARD_SCANCODE_BUFFER_SIZE 64   // Scancodes received but not yet processed
+#define TERMINAL_WRITE_CHUNK 128   // Bytes terminal_write copies from the caller at a time
 
 #define TERMINAL_COLUMNS 80
 #define TERMINAL_ROWS 25
@@ -43,6 +45,7 @@ void keyboard_handler();
 extern void keyboard_handler_wrapper(void);
 
 void switch_active_terminal(uint8_t new_terminal);
+uint8_t get_active_terminal();
 void reset_terminal(uint8_t terminal_num);
 void multiple_terminal_init();
 
@@ -6,7 +6,10 @@
 #include <arch/x86/x86_desc.h>
 #include <arch/x86/paging.h>
 #include <lib/lib.h>
-#include <arch/x86/i8259.h>
+#include <arch/x86/irq.h>
+#include <arch/x86/mptable.h>
+#include <arch/x86/apic.h>
+#include <arch/x86/latency.h>
 #include <kernel/debug.h>
 #include <fs/ece391_fs.h>
 #include <tty/terminal.h>
@@ -16,6 +19,15 @@
 #include <kernel/tests.h> // added for 3.2
 #include <arch/x86/task.h>
 #include <drivers/pit.h>
+#include <arch/x86/fpu.h>
+#include <arch/x86/sysenter.h>
+#include <arch/x86/frame.h>
+#include <arch/x86/tlb.h>
+#include <kernel/slab.h>
+#include <kernel/image_cache.h>
+#include <kernel/sched.h>
+#include <kernel/vdata.h>
+#include <arch/x86/smp.h>
 
 /* Macros. */
 /* Check if the bit BIT in FLAGS is set. */
@@ -26,7 +38,52 @@
 #define KEYBOARD_SIZE 128
 
 static pd_entry kernel_pd[NUM_PD_ENTRIES] __attribute__((aligned (FOUR_KB_ALIGNED)));
-static pt_entry kernel_pt[NUM_PT_ENTRIES] __attribute__((aligned (FOUR_KB_ALIGNED)));
+
+/* Give the frame allocator every usable range of RAM above the kernel page,
+   as reported by the bootloader's memory map (or mem_upper without one).
+   Everything below 8 MB (low memory, the kernel and the modules loaded
+   right after it) is left alone. */
+static void
+init_physical_memory (multiboot_info_t *mbi)
+{
+    frame_init ();
+
+    if (CHECK_FLAG (mbi->flags, 6))
+    {
+        memory_map_t *mmap;
+
+        for (mmap = (memory_map_t *) mbi->mmap_addr;
+                (unsigned long) mmap < mbi->mmap_addr + mbi->mmap_length;
+                mmap = (memory_map_t *) ((unsigned long) mmap
+                    + mmap->size + sizeof (mmap->size)))
+        {
+            uint32_t start = mmap->base_addr_low;
+            uint32_t end;
+
+            /* Only usable RAM that a 32-bit address can reach */
+            if (mmap->type != MULTIBOOT_MEMORY_AVAILABLE || mmap->base_addr_high != 0)
+                continue;
+            if (mmap->length_high != 0 || mmap->length_low > 0xFFFFFFFF - start)
+                end = 0xFFFFFFFF;
+            else
+                end = start + mmap->length_low;
+
+            if (start < KERNEL_PAGE_END)
+                start = KERNEL_PAGE_END;
+            if (end > start)
+                frame_add_region (start, end);
+        }
+    }
+    else
+    {
+        uint32_t mem_upper_kb = CHECK_FLAG (mbi->flags, 0) ? mbi->mem_upper : DEFAULT_MEM_UPPER_KB;
+
+        /* mem_upper counts from 1 MB. Clamp first so 4 GB doesn't overflow */
+        if (mem_upper_kb > FRAME_PHYS_LIMIT / 1024)
+            mem_upper_kb = FRAME_PHYS_LIMIT / 1024;
+        frame_add_region (KERNEL_PAGE_END, 0x100000 + mem_upper_kb * 1024);
+    }
+}
 
 /* Check if MAGIC is valid and print the Multiboot information structure
    pointed by ADDR. */
@@ -208,19 +265,37 @@ entry (unsigned long magic, unsigned long addr)
             install_interrupt_handler(i, handlers[i], KERNEL_CS, PRIVILEGE_KERNEL);
         }
 
+        // Lazy FPU switching replaces the generic "Device not available" exception handler
+        install_interrupt_handler(FPU_NM_VEC, fpu_handler_wrapper, KERNEL_CS, PRIVILEGE_KERNEL);
+
         // Handle syscalls
         install_interrupt_handler(SYSCALL_INT, syscall_handler_wrapper, KERNEL_CS, PRIVILEGE_USER);
 
-        // Install device handlers
-        install_interrupt_handler(IRQ_INT_NUM(KEYBOARD_IRQ), keyboard_handler_wrapper, KERNEL_CS, PRIVILEGE_KERNEL);
-        install_interrupt_handler(IRQ_INT_NUM(RTC_IRQ), rtc_handler_wrapper, KERNEL_CS, PRIVILEGE_KERNEL);
-        install_interrupt_handler(IRQ_INT_NUM(PIT_IRQ), pit_handler_wrapper, KERNEL_CS, PRIVILEGE_KERNEL);
+        // Inter-processor interrupts and the local APIC timer
+        install_interrupt_handler(SMP_TICK_VEC, smp_tick_handler_wrapper, KERNEL_CS, PRIVILEGE_KERNEL);
+        install_interrupt_handler(SMP_RESCHED_VEC, smp_resched_handler_wrapper, KERNEL_CS, PRIVILEGE_KERNEL);
+        install_interrupt_handler(SMP_TLB_VEC, smp_tlb_handler_wrapper, KERNEL_CS, PRIVILEGE_KERNEL);
+        install_interrupt_handler(LAPIC_TIMER_VEC, smp_timer_handler_wrapper, KERNEL_CS, PRIVILEGE_KERNEL);
     }
 
-    printf("Initializing the PIC\n");
+    printf("Initializing the FPU\n");
+    fpu_init();
+
+    /* Let user programs make system calls with sysenter, if the CPU has it */
+    sysenter_init();
+    printf("Fast system calls (sysenter): %s\n", sysenter_available() ? "yes" : "no");
+
+    printf("Initializing the interrupt controller\n");
 
-    /* Init the PIC */
-    i8259_init();
+    /* Find the I/O APIC (and the other CPUs) in the MP table, and fall back to the 8259 without one */
+    mp_init();
+    irq_init();
+    printf("Interrupt controller: %s\n", irq_chip_name());
+
+    /* Install device handlers, on whichever vectors the interrupt controller put them */
+    irq_set_handler(KEYBOARD_IRQ, keyboard_handler_wrapper);
+    irq_set_handler(RTC_IRQ, rtc_handler_wrapper);
+    irq_set_handler(PIT_IRQ, pit_handler_wrapper);
 
     // Uncomment below to cause divide-by-zero exception
     //asm volatile("movl $0, %eax; divl %eax;");
@@ -237,16 +312,43 @@ entry (unsigned long magic, unsigned long addr)
         ece391_fs_init((void*) mod->mod_start);
     }
     
+    {
+        // Build the frame allocator from the memory map and size the process table to it
+        frame_stats_t frames;
+
+        init_physical_memory(mbi);
+        slab_init();
+        image_cache_init();
+        frame_get_stats(&frames);
+        task_init();
+        printf("Physical memory: %u kB free\n", frames.free * (FRAME_SIZE / 1024));
+        printf("Process table: %u slots\n", get_max_processes());
+    }
+
     printf("Initializing Paging\n");
 
-    initialize_paging_structs(kernel_pd, kernel_pt, (void*) VIDEO_PHYS_ADDR);
+    paging_init();
+    irq_map_registers();
+    smp_init();
+    paging_clone_kernel(kernel_pd);
     enable_paging(kernel_pd);
+    tlb_init();
+
+    /* Start the other CPUs. They wait in their idle tasks until processes are put on their run queues */
+    sched_init();
+    smp_boot_aps();
+    printf("CPUs online: %u\n", smp_num_cpus());
+
+    /* Publish the time to user programs */
+    vdata_init();
+    printf("TSC: %u kHz\n", vdata_get_page()->tsc_khz);
 
     /* Enable interrupts */
     /* Do not enable the following until after you have set up your
      * IDT correctly otherwise QEMU will triple fault and simple close
      * without showing you any output */
     printf("Enabling Interrupts\n");
+    latency_init();
     sti();
 
     kernel_run_first_program("shell");
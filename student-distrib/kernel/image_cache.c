@@ -0,0 +1,259 @@
+#include <kernel/image_cache.h>
+#include <arch/x86/frame.h>
+#include <kernel/slab.h>
+#include <fs/ece391_fs.h>
+#include <arch/x86/spinlock.h>
+#include <lib/lib.h>
+
+/* Cached programs, allocated from entry_cache. A slot is free when it is NULL */
+static image_cache_t *cache[IMAGE_CACHE_ENTRIES];
+
+static kmem_cache_t entry_cache;
+
+/* Incremented on every lookup; entries remember when they were last used */
+static uint32_t lookup_clock = 0;
+
+static image_cache_stats_t stats;
+
+/* Protects the entries and the counters */
+static spinlock_t image_lock = SPINLOCK_INIT;
+
+/**
+ * image_cache_init
+ * Sets up the cache the entries are allocated from. slab_init must be called first.
+ */
+void image_cache_init() {
+	kmem_cache_init(&entry_cache, "image_cache", sizeof(image_cache_t), 0);
+}
+
+/**
+ * image_cache_evict
+ * Drops the cache's references to a program's pages and frees the entry. Pages that processes
+ * still map stay in use until those processes are done with them.
+ *
+ * @param slot 	The slot of the entry to free. Nobody may be running the program
+ */
+static void image_cache_evict(int slot) {
+	image_cache_t *image = cache[slot];
+	uint32_t i;
+
+	for(i = 0; i < IMAGE_CACHE_NUM_PAGES(image->size); i++) {
+		if(image->pages[i] != 0) {
+			frame_put(image->pages[i]);
+		}
+	}
+
+	kfree(image->pages);
+	kmem_cache_free(&entry_cache, image);
+	cache[slot] = NULL;
+	stats.evictions++;
+}
+
+/**
+ * reclaim_locked
+ * Body of image_cache_reclaim. The image cache lock must be held.
+ *
+ * @return 		The number of programs dropped
+ */
+static uint32_t reclaim_locked() {
+	uint32_t dropped = 0;
+	int i;
+
+	for(i = 0; i < IMAGE_CACHE_ENTRIES; i++) {
+		if(cache[i] != NULL && cache[i]->users == 0) {
+			image_cache_evict(i);
+			dropped++;
+		}
+	}
+	return dropped;
+}
+
+/**
+ * image_cache_alloc_frame
+ * Gets a frame for the cache, dropping unused programs if memory is exhausted. The image cache
+ * lock must be held.
+ *
+ * @return 		The physical address of the frame, or 0 if there is no memory left
+ */
+static uint32_t image_cache_alloc_frame() {
+	uint32_t frame = frame_alloc();
+
+	if(frame == 0 && reclaim_locked() > 0) {
+		frame = frame_alloc();
+	}
+	return frame;
+}
+
+/**
+ * image_cache_get
+ * Finds the cache entry for a program, creating it if it isn't cached yet, and counts the caller
+ * as one of its users. Creating an entry loads nothing; pages are read as they are first touched.
+ *
+ * @param inode 	The program file's inode
+ * @param size 		The program file's size in bytes
+ *
+ * @return 			The cache entry, or NULL if every entry is in use (the caller then loads the program privately)
+ */
+image_cache_t *image_cache_get(uint32_t inode, uint32_t size) {
+	uint32_t flags;
+	image_cache_t *image = NULL;
+	int free_slot = -1;
+	int lru_slot = -1;
+	int victim;
+	int i;
+
+	spin_lock_irqsave(&image_lock, flags);
+
+	for(i = 0; i < IMAGE_CACHE_ENTRIES; i++) {
+		if(cache[i] == NULL) {
+			if(free_slot < 0) free_slot = i;
+		} else if(cache[i]->inode == inode && cache[i]->size == size) {
+			image = cache[i];
+			break;
+		} else if(cache[i]->users == 0 && (lru_slot < 0 || cache[i]->last_used < cache[lru_slot]->last_used)) {
+			// Least recently used program nobody is running
+			lru_slot = i;
+		}
+	}
+	victim = (free_slot >= 0) ? free_slot : lru_slot;
+
+	if(image != NULL) {
+		stats.hits++;
+	} else if(victim >= 0) {
+		uint32_t index_size = IMAGE_CACHE_NUM_PAGES(size) * sizeof(uint32_t);
+		image_cache_t *entry;
+		uint32_t *index;
+
+		stats.misses++;
+		if(cache[victim] != NULL) {
+			image_cache_evict(victim);
+		}
+
+		entry = kmem_cache_alloc(&entry_cache);
+		index = kmalloc(index_size);
+		if((entry == NULL || index == NULL) && reclaim_locked() > 0) {
+			if(entry == NULL) entry = kmem_cache_alloc(&entry_cache);
+			if(index == NULL) index = kmalloc(index_size);
+		}
+		if(entry != NULL && index != NULL) {
+			image = entry;
+			image->inode = inode;
+			image->size = size;
+			image->users = 0;
+			image->pages = index;
+			memset(image->pages, 0, index_size);
+			cache[victim] = image;
+		} else {
+			if(entry != NULL) kmem_cache_free(&entry_cache, entry);
+			kfree(index);
+		}
+	}
+
+	if(image != NULL) {
+		image->users++;
+		image->last_used = ++lookup_clock;
+	}
+
+	spin_unlock_irqrestore(&image_lock, flags);
+	return image;
+}
+
+/**
+ * image_cache_hold
+ * Adds another user to a cache entry, e.g. when a process running the program forks.
+ *
+ * @param image 	The cache entry
+ */
+void image_cache_hold(image_cache_t *image) {
+	uint32_t flags;
+
+	spin_lock_irqsave(&image_lock, flags);
+	image->users++;
+	spin_unlock_irqrestore(&image_lock, flags);
+}
+
+/**
+ * image_cache_put
+ * Removes a user from a cache entry. The pages stay cached so that the next launch of the program
+ * doesn't have to read them again, until the entry is needed for another program or memory runs out.
+ *
+ * @param image 	The cache entry
+ */
+void image_cache_put(image_cache_t *image) {
+	uint32_t flags;
+
+	spin_lock_irqsave(&image_lock, flags);
+	image->users--;
+	spin_unlock_irqrestore(&image_lock, flags);
+}
+
+/**
+ * image_cache_page
+ * Gets the frame holding one page of a program, reading it from the filesystem if no process has
+ * touched it yet. The part of the last page past the end of the file is zeroed.
+ *
+ * @param image 	The cache entry
+ * @param index 	The page number within the file
+ *
+ * @return 			The physical address of the frame, or 0 if the page is past the end of the file or memory is exhausted.
+ * 					The cache keeps its own reference; callers mapping the frame must add theirs with frame_get.
+ */
+uint32_t image_cache_page(image_cache_t *image, uint32_t index) {
+	uint32_t flags;
+	uint32_t frame;
+
+	if(index * FRAME_SIZE >= image->size) return 0;
+
+	spin_lock_irqsave(&image_lock, flags);
+
+	frame = image->pages[index];
+	if(frame == 0) {
+		frame = image_cache_alloc_frame();
+		if(frame != 0) {
+			int32_t count = read_data(image->inode, index * FRAME_SIZE, (uint8_t*) frame, FRAME_SIZE);
+			if(count < 0) count = 0;
+			memset((uint8_t*) frame + count, 0, FRAME_SIZE - count);
+
+			image->pages[index] = frame;
+			stats.pages_loaded++;
+		}
+	}
+
+	if(frame != 0) {
+		stats.pages_mapped++;
+	}
+
+	spin_unlock_irqrestore(&image_lock, flags);
+	return frame;
+}
+
+/**
+ * image_cache_reclaim
+ * Drops every cached program that no process is running, to free memory.
+ *
+ * @return 		The number of programs dropped
+ */
+uint32_t image_cache_reclaim() {
+	uint32_t flags;
+	uint32_t dropped;
+
+	spin_lock_irqsave(&image_lock, flags);
+	dropped = reclaim_locked();
+	spin_unlock_irqrestore(&image_lock, flags);
+
+	return dropped;
+}
+
+/**
+ * image_cache_get_stats
+ * Reports the image cache's counters.
+ *
+ * @param stats_out 	Filled in with the counters
+ */
+void image_cache_get_stats(image_cache_stats_t *stats_out) {
+	uint32_t flags;
+
+	spin_lock_irqsave(&image_lock, flags);
+	*stats_out = stats;
+	spin_unlock_irqrestore(&image_lock, flags);
+}
@@ -0,0 +1,982 @@
+#include <kernel/sched.h>
+#include <arch/x86/task.h>
+#include <arch/x86/paging.h>
+#include <arch/x86/tlb.h>
+#include <tty/terminal.h>
+#include <drivers/pit.h>
+#include <kernel/timer.h>
+#include <arch/x86/smp.h>
+#include <arch/x86/apic.h>
+#include <kernel/softirq.h>
+#include <lib/lib.h>
+
+/* Scheduler state of one CPU. A process stays on the CPU it was placed on (pcb->cpu), so its kernel
+ * stack, address space and FPU registers are only ever used by that CPU. Other CPUs only touch the
+ * run queue, under its lock, to wake one of its processes up. */
+typedef struct sched_cpu_t {
+	spinlock_t lock;                // Protects the run queue and the status of this CPU's processes
+	runqueue_t run_queue;           // Every runnable process of this CPU (including the one on it)
+	pcb_t *current;                 // The process (or idle task) on the CPU
+	pcb_t *idle;                    // This CPU's idle task
+	pcb_t *dead;                    // Exited process whose slot is freed once the CPU is off its stack
+	volatile uint8_t need_resched;  // Set when a process that outranks the current one becomes runnable; see sched_preempt
+	uint8_t tick_deferred;          // Set when a timer tick arrived while tasklets ran; see sched_deferred_switch
+	uint32_t idle_entries;          // Number of times the CPU went idle. The idle task's cpu_ticks says for how long.
+	uint32_t switches;              // Context switches on this CPU
+	uint32_t aged;                  // Times sched_age raised a process
+} sched_cpu_t;
+
+static sched_cpu_t cpus[SMP_MAX_CPUS];
+
+/* Each CPU's idle task runs whenever its run queue is empty. It is never on the run queue itself.
+ * Its PCB sits at the bottom of its own kernel stack like a process's, so get_current_pcb works.
+ * The other CPUs start up on their idle task's stack. */
+static union {
+	pcb_t pcb;
+	uint8_t kernel_stack[KERNEL_STACK_SIZE];
+} idle_tasks[SMP_MAX_CPUS] __attribute__((aligned (KERNEL_STACK_SIZE)));
+
+/* Timeslice for processes that haven't set their own */
+static uint32_t default_quantum = SCHED_DEFAULT_QUANTUM_TICKS;
+
+/**
+ * runqueue_init
+ * Empties a run queue.
+ *
+ * @param rq 	The run queue to initialize
+ */
+void runqueue_init(runqueue_t *rq) {
+	int i;
+
+	rq->bitmap = 0;
+	rq->nr_running = 0;
+	for(i = 0; i < SCHED_NUM_PRIORITIES; i++) {
+		rq->queues[i].head = NULL;
+		rq->queues[i].tail = NULL;
+	}
+}
+
+/**
+ * runqueue_enqueue
+ * Appends a process to the tail of the FIFO for its priority level, noting when it started waiting there.
+ *
+ * @param rq 	The run queue to add to
+ * @param pcb 	The process to add. Must not already be on a run queue.
+ */
+void runqueue_enqueue(runqueue_t *rq, pcb_t *pcb) {
+	runqueue_list_t *list = &rq->queues[pcb->priority];
+
+	pcb->rq_next = NULL;
+	pcb->rq_prev = list->tail;
+	if(list->tail != NULL) {
+		list->tail->rq_next = pcb;
+	} else {
+		list->head = pcb;
+	}
+	list->tail = pcb;
+
+	rq->bitmap |= (1 << pcb->priority);
+	rq->nr_running++;
+	pcb->on_runqueue = 1;
+	pcb->queued_tick = pit_get_ticks();
+}
+
+/**
+ * runqueue_dequeue
+ * Unlinks a process from wherever it is in its priority level's FIFO.
+ *
+ * @param rq 	The run queue to remove from
+ * @param pcb 	The process to remove. Does nothing if it is not queued.
+ */
+void runqueue_dequeue(runqueue_t *rq, pcb_t *pcb) {
+	runqueue_list_t *list = &rq->queues[pcb->priority];
+
+	if(!pcb->on_runqueue) return;
+
+	if(pcb->rq_prev != NULL) {
+		pcb->rq_prev->rq_next = pcb->rq_next;
+	} else {
+		list->head = pcb->rq_next;
+	}
+	if(pcb->rq_next != NULL) {
+		pcb->rq_next->rq_prev = pcb->rq_prev;
+	} else {
+		list->tail = pcb->rq_prev;
+	}
+
+	// Clear the bit for this level once its last process leaves
+	if(list->head == NULL) {
+		rq->bitmap &= ~(1 << pcb->priority);
+	}
+
+	pcb->rq_next = NULL;
+	pcb->rq_prev = NULL;
+	pcb->on_runqueue = 0;
+	rq->nr_running--;
+}
+
+/**
+ * runqueue_requeue
+ * Moves a queued process to the tail of its FIFO so the others at that level get a turn.
+ *
+ * @param rq 	The run queue the process is on
+ * @param pcb 	The process to rotate
+ */
+void runqueue_requeue(runqueue_t *rq, pcb_t *pcb) {
+	// Already last in line, nothing to do
+	if(pcb->rq_next == NULL) return;
+
+	runqueue_dequeue(rq, pcb);
+	runqueue_enqueue(rq, pcb);
+}
+
+/**
+ * runqueue_peek
+ * Finds the process that should run next in constant time: the head of the highest-priority non-empty FIFO.
+ *
+ * @param rq 	The run queue to look at
+ *
+ * @return 		The next process to run, or NULL if the run queue is empty
+ */
+pcb_t *runqueue_peek(runqueue_t *rq) {
+	uint32_t level;
+
+	if(rq->bitmap == 0) return NULL;
+
+	// Index of the lowest set bit = highest priority level with a runnable process
+	asm volatile(
+		"bsfl %1, %0"
+		: "=r"(level)
+		: "rm"(rq->bitmap)
+		: "cc"
+	);
+
+	return rq->queues[level].head;
+}
+
+/**
+ * this_cpu
+ * Get the scheduler state of the calling CPU.
+ *
+ * @return 		Its sched_cpu_t
+ */
+static inline sched_cpu_t *this_cpu() {
+	return &cpus[smp_cpu_id()];
+}
+
+/**
+ * sched_rearm_timer
+ * Programs the PIT for the next time the scheduler or the timer wheel has to run. A timeslice only
+ * needs to be enforced while there is another process to switch to; otherwise the PIT can stay quiet
+ * until the next timer expires. The other CPUs time their slices with their own local APIC timer if
+ * it could be calibrated. If not, they share the PIT: it fires for whichever CPU asked for the
+ * earliest event, and the boot CPU (which runs the timer wheel) passes every tick on to the others.
+ *
+ * @param cpu 		The calling CPU. Its lock must be held.
+ * @param running 	The process that has (or is about to get) the CPU
+ */
+static void sched_rearm_timer(sched_cpu_t *cpu, pcb_t *running) {
+	uint32_t now = pit_get_ticks();
+	uint32_t next = TIMER_NO_EVENT;
+
+	if(cpu == &cpus[0]) {
+		next = timer_next_event(now);
+	}
+
+	if(cpu->run_queue.nr_running > 1) {
+		int32_t remaining = running->slice_start_tick + sched_get_quantum(running) - now;
+		if(remaining <= 0) remaining = 1;
+		if(next == TIMER_NO_EVENT || (uint32_t) remaining < next) next = remaining;
+	}
+
+	if(cpu != &cpus[0] && lapic_timer_available()) {
+		lapic_timer_set(next);
+		return;
+	}
+
+	pit_set_next_event(next == TIMER_NO_EVENT ? PIT_NO_EVENT : next);
+}
+
+/**
+ * sched_kick
+ * Lets a CPU know that its run queue changed. The calling CPU re-programs the PIT right away, since a
+ * timeslice may now have to be enforced; another CPU is sent an IPI so that it does the same (and
+ * wakes up if it's idle).
+ *
+ * @param cpu 	The CPU whose run queue changed. Its lock must be held.
+ */
+static void sched_kick(sched_cpu_t *cpu) {
+	uint32_t index = cpu - cpus;
+
+	if(index == smp_cpu_id()) {
+		sched_rearm_timer(cpu, cpu->current);
+	} else {
+		smp_send_reschedule(index);
+	}
+}
+
+/**
+ * sched_reap
+ * Frees the slot of the process that exited last on a CPU, now that the CPU is no longer on its kernel stack.
+ *
+ * @param cpu 	The calling CPU
+ */
+static void sched_reap(sched_cpu_t *cpu) {
+	pcb_t *dead = cpu->dead;
+
+	if(dead != NULL) {
+		cpu->dead = NULL;
+		release_pcb_slot(dead);
+	}
+}
+
+/**
+ * sched_set_level
+ * Moves a process to another run queue level, at the back of its FIFO if it's runnable.
+ *
+ * @param cpu 		The process's CPU. Its lock must be held.
+ * @param pcb 		The process to move
+ * @param priority 	The new level
+ */
+static void sched_set_level(sched_cpu_t *cpu, pcb_t *pcb, uint32_t priority) {
+	// The run queue finds a process's FIFO by its priority, so take it off before changing it
+	if(pcb->on_runqueue) {
+		runqueue_dequeue(&cpu->run_queue, pcb);
+		pcb->priority = priority;
+		runqueue_enqueue(&cpu->run_queue, pcb);
+	} else {
+		pcb->priority = priority;
+	}
+}
+
+/**
+ * sched_base_priority
+ * Computes which run queue level a process belongs on, from its nice value and whether it's on the
+ * active terminal.
+ *
+ * @param pcb 	The process to look at
+ *
+ * @return 		Its level
+ */
+static uint32_t sched_base_priority(pcb_t *pcb) {
+	int32_t priority = SCHED_DEFAULT_PRIORITY + pcb->nice;
+
+	if(pcb->terminal_num == get_active_terminal()) {
+		priority -= SCHED_FOREGROUND_BOOST;
+	}
+	if(priority < 0) priority = 0;
+	if(priority > SCHED_NUM_PRIORITIES - 1) priority = SCHED_NUM_PRIORITIES - 1;
+
+	return priority;
+}
+
+/**
+ * sched_age
+ * Keeps the higher levels from starving the lower ones. The head of each lower level's FIFO has
+ * waited there the longest; once that is SCHED_STARVATION_TICKS, it is raised to the highest level
+ * in use, behind the processes already there, until its next timeslice is over (see sched_unage).
+ *
+ * @param cpu 	The calling CPU. Its lock must be held.
+ * @param now 	The current tick
+ */
+static void sched_age(sched_cpu_t *cpu, uint32_t now) {
+	runqueue_t *rq = &cpu->run_queue;
+	pcb_t *top = runqueue_peek(rq);
+	uint32_t level;
+
+	if(top == NULL) return;
+
+	for(level = top->priority + 1; level < SCHED_NUM_PRIORITIES; level++) {
+		pcb_t *pcb = rq->queues[level].head;
+
+		if(pcb != NULL && now - pcb->queued_tick >= SCHED_STARVATION_TICKS) {
+			sched_set_level(cpu, pcb, top->priority);
+			pcb->aged = 1;
+			cpu->aged++;
+		}
+	}
+}
+
+/**
+ * sched_unage
+ * Puts a process that sched_age raised back on its own level, now that it has had its timeslice
+ * (or blocked).
+ *
+ * @param cpu 	The process's CPU. Its lock must be held.
+ * @param pcb 	The process
+ */
+static void sched_unage(sched_cpu_t *cpu, pcb_t *pcb) {
+	pcb->aged = 0;
+	sched_set_level(cpu, pcb, sched_base_priority(pcb));
+}
+
+/**
+ * sched_switch
+ * Gives the CPU to the first process in line (or the idle task), then releases the CPU's lock.
+ *
+ * @param cpu 			The calling CPU. Its lock must be held; it is released before switching.
+ * @param former_pcb 	The process on the CPU
+ * @param voluntary 	1 if former_pcb is blocking or exiting, 0 if it is preempted
+ */
+static void sched_switch(sched_cpu_t *cpu, pcb_t *former_pcb, uint8_t voluntary) {
+	pcb_t *next_pcb = runqueue_peek(&cpu->run_queue);
+
+	if(next_pcb == NULL) {
+		next_pcb = cpu->idle;
+	}
+
+	if(next_pcb != former_pcb) {
+		sched_account_switch(former_pcb, next_pcb, voluntary);
+	}
+	sched_rearm_timer(cpu, next_pcb);
+	spin_unlock(&cpu->lock);
+
+	if(next_pcb != former_pcb) {
+		context_switch(former_pcb, next_pcb);
+	}
+}
+
+/**
+ * idle_loop
+ * Body of the idle task. Halts the CPU until an interrupt makes a process runnable, then gives the CPU to it.
+ */
+static void idle_loop() {
+	sched_cpu_t *cpu = this_cpu();
+
+	for(;;) {
+		cli();
+		latency_irqs_off(__FILE__, __LINE__);
+		sched_reap(cpu);
+
+		// Work the interrupts that woke the CPU up left behind
+		softirq_run();
+
+		spin_lock(&cpu->lock);
+		if(runqueue_peek(&cpu->run_queue) != NULL) {
+			sched_switch(cpu, cpu->idle, 1);
+		} else {
+			sched_rearm_timer(cpu, cpu->idle);
+			spin_unlock(&cpu->lock);
+			latency_irqs_on();
+
+			// sti only takes effect after the next instruction, so no wake-up is missed before hlt
+			asm volatile("sti; hlt" : : : "memory", "cc");
+		}
+	}
+}
+
+/**
+ * sched_init
+ * Resets every CPU's run queue and idle task. Must be called before any process is enqueued and
+ * before the other CPUs are started.
+ */
+void sched_init() {
+	uint32_t i;
+
+	for(i = 0; i < SMP_MAX_CPUS; i++) {
+		sched_cpu_t *cpu = &cpus[i];
+		pcb_t *idle = &idle_tasks[i].pcb;
+
+		spin_lock_init(&cpu->lock);
+		runqueue_init(&cpu->run_queue);
+		cpu->current = idle;
+		cpu->idle = idle;
+		cpu->dead = NULL;
+		cpu->need_resched = 0;
+		cpu->tick_deferred = 0;
+		cpu->idle_entries = 0;
+		cpu->switches = 0;
+		cpu->aged = 0;
+
+		idle->in_use = 1;
+		idle->status = PROCESS_RUNNING;
+		prepare_kernel_stack(idle, idle_tasks[i].kernel_stack + KERNEL_STACK_SIZE, idle_loop);
+		idle->on_runqueue = 0;
+		sched_task_init(idle, NULL);
+		idle->cpu = i;
+		idle->priority = SCHED_NUM_PRIORITIES - 1;
+	}
+}
+
+/**
+ * sched_start
+ * Records the first process the boot CPU runs. It is entered directly rather than through a context switch.
+ *
+ * @param pcb 	The process
+ */
+void sched_start(pcb_t *pcb) {
+	cpus[pcb->cpu].current = pcb;
+	pcb->last_run_tick = pit_get_ticks();
+	pcb->slice_start_tick = pcb->last_run_tick;
+}
+
+/**
+ * sched_get_idle_stack
+ * Get the top of a CPU's idle task stack, which the CPU starts up on.
+ *
+ * @param cpu 	The CPU's index
+ *
+ * @return 		The top (highest address) of the stack
+ */
+void *sched_get_idle_stack(uint32_t cpu) {
+	return idle_tasks[cpu].kernel_stack + KERNEL_STACK_SIZE;
+}
+
+/**
+ * sched_run_idle
+ * Turns a freshly started CPU into its idle task, which then runs whatever is put on its run queue.
+ * Must be called on the CPU's idle stack. Does not return.
+ */
+void sched_run_idle() {
+	sched_cpu_t *cpu = this_cpu();
+
+	cpu->idle->last_run_tick = pit_get_ticks();
+	idle_loop();
+}
+
+/**
+ * sched_select_cpu
+ * Picks a CPU for a new process: the online CPU with the fewest runnable processes. The run queues
+ * are read without their locks, so this is only a hint.
+ *
+ * @return 		The CPU's index
+ */
+uint32_t sched_select_cpu() {
+	uint32_t best = 0;
+	uint32_t i;
+
+	for(i = 1; i < smp_num_cpus(); i++) {
+		if(cpus[i].run_queue.nr_running < cpus[best].run_queue.nr_running) {
+			best = i;
+		}
+	}
+	return best;
+}
+
+/**
+ * sched_enqueue
+ * Marks a process as runnable by putting it on its CPU's run queue.
+ *
+ * @param pcb 	The process that became runnable
+ */
+void sched_enqueue(pcb_t *pcb) {
+	sched_cpu_t *cpu = &cpus[pcb->cpu];
+	uint32_t flags;
+
+	spin_lock_irqsave(&cpu->lock, flags);
+	runqueue_enqueue(&cpu->run_queue, pcb);
+	sched_kick(cpu);
+	spin_unlock_irqrestore(&cpu->lock, flags);
+}
+
+/**
+ * sched_dequeue
+ * Removes a process that can no longer run (blocked or exited) from its CPU's run queue.
+ *
+ * @param pcb 	The process to remove
+ */
+void sched_dequeue(pcb_t *pcb) {
+	sched_cpu_t *cpu = &cpus[pcb->cpu];
+	uint32_t flags;
+
+	spin_lock_irqsave(&cpu->lock, flags);
+	runqueue_dequeue(&cpu->run_queue, pcb);
+	spin_unlock_irqrestore(&cpu->lock, flags);
+}
+
+/**
+ * sched_wake_up
+ * Makes a blocked process runnable again. Safe to call from interrupt handlers and from any CPU.
+ * A process that is between sched_prepare_block and sched_block is still on the run queue; it
+ * just stays there.
+ *
+ * @param pcb 	The process to wake up
+ */
+void sched_wake_up(pcb_t *pcb) {
+	sched_cpu_t *cpu = &cpus[pcb->cpu];
+	uint32_t flags;
+
+	spin_lock_irqsave(&cpu->lock, flags);
+	if(pcb->status == PROCESS_BLOCKED) {
+		pcb->status = PROCESS_RUNNING;
+		if(!pcb->on_runqueue) {
+			runqueue_enqueue(&cpu->run_queue, pcb);
+
+			// Don't make it wait for the current process's timeslice to run out
+			if(pcb->priority < cpu->current->priority) {
+				cpu->need_resched = 1;
+			}
+			sched_kick(cpu);
+		}
+	}
+	spin_unlock_irqrestore(&cpu->lock, flags);
+}
+
+/**
+ * sched_prepare_block
+ * First half of blocking: marks the current process as blocked, but leaves it on the CPU. The caller
+ * then checks whether it still has to wait and either calls sched_block or sched_cancel_block. A
+ * wake-up from another CPU in between turns sched_block into a no-op, so it can't be lost.
+ */
+void sched_prepare_block() {
+	pcb_t *pcb = get_current_pcb();
+	sched_cpu_t *cpu = &cpus[pcb->cpu];
+	uint32_t flags;
+
+	spin_lock_irqsave(&cpu->lock, flags);
+	pcb->status = PROCESS_BLOCKED;
+	spin_unlock_irqrestore(&cpu->lock, flags);
+}
+
+/**
+ * sched_block
+ * Second half of blocking: gives up the CPU until sched_wake_up, unless that already happened.
+ */
+void sched_block() {
+	pcb_t *pcb = get_current_pcb();
+	sched_cpu_t *cpu = &cpus[pcb->cpu];
+	uint32_t flags;
+
+	spin_lock_irqsave(&cpu->lock, flags);
+	if(pcb->status == PROCESS_BLOCKED) {
+		runqueue_dequeue(&cpu->run_queue, pcb);
+		if(pcb->aged) sched_unage(cpu, pcb);
+		sched_switch(cpu, pcb, 1);
+	} else {
+		spin_unlock(&cpu->lock);
+	}
+	restore_flags(flags);
+}
+
+/**
+ * sched_cancel_block
+ * Undoes sched_prepare_block once it turned out there is nothing to wait for.
+ */
+void sched_cancel_block() {
+	sched_wake_up(get_current_pcb());
+}
+
+/**
+ * sched_task_init
+ * Sets up the scheduling state of a new process. It starts with no CPU time used.
+ *
+ * @param pcb 		The new process
+ * @param parent 	The process that executed it (its nice value, quantum and CPU are inherited), or NULL.
+ * 					The new process's terminal_num must already be set.
+ */
+void sched_task_init(pcb_t *pcb, pcb_t *parent) {
+	pcb->nice = (parent != NULL) ? parent->nice : 0;
+	pcb->quantum = (parent != NULL) ? parent->quantum : 0;
+
+	// Children stay on their parent's CPU; the shells are spread over the CPUs by terminal
+	pcb->cpu = (parent != NULL) ? parent->cpu : pcb->terminal_num % smp_num_cpus();
+
+	// Not on the run queue yet, so the level can be set directly
+	pcb->on_runqueue = 0;
+	sched_update_priority(pcb);
+
+	pcb->cpu_ticks = 0;
+	pcb->voluntary_switches = 0;
+	pcb->involuntary_switches = 0;
+	pcb->last_run_tick = pit_get_ticks();
+	pcb->slice_start_tick = pcb->last_run_tick;
+}
+
+/**
+ * sched_account_switch
+ * Charges the outgoing process for its time on the CPU and starts a new timeslice for the incoming one.
+ * Called for every switch between processes, right before it happens.
+ *
+ * @param prev 		The process giving up the CPU
+ * @param next 		The process getting the CPU
+ * @param voluntary 1 if prev blocked or exited, 0 if it was preempted
+ */
+void sched_account_switch(pcb_t *prev, pcb_t *next, uint8_t voluntary) {
+	uint32_t now = pit_get_ticks();
+
+	prev->cpu_ticks += now - prev->last_run_tick;
+	if(voluntary) {
+		prev->voluntary_switches++;
+	} else {
+		prev->involuntary_switches++;
+	}
+
+	next->last_run_tick = now;
+	next->slice_start_tick = now;
+}
+
+/**
+ * sched_get_quantum
+ * Get the timeslice length of a process.
+ *
+ * @param pcb 	The process to look at
+ *
+ * @return 		Its timeslice in PIT ticks
+ */
+uint32_t sched_get_quantum(pcb_t *pcb) {
+	return (pcb->quantum != 0) ? pcb->quantum : default_quantum;
+}
+
+/**
+ * sched_set_quantum
+ * Changes the timeslice of a process, or the system-wide default. Takes effect from the next timeslice.
+ *
+ * @param pcb 		The process to change (ignored for SCHED_QUANTUM_SYSTEM)
+ * @param ticks 	New timeslice in PIT ticks. 0 makes the process follow the system-wide quantum again.
+ * @param scope 	SCHED_QUANTUM_PROCESS or SCHED_QUANTUM_SYSTEM
+ *
+ * @return 			0 on success, -1 if the arguments are out of range
+ */
+int32_t sched_set_quantum(pcb_t *pcb, uint32_t ticks, uint32_t scope) {
+	if(ticks > SCHED_MAX_QUANTUM_TICKS) return -1;
+
+	if(scope == SCHED_QUANTUM_PROCESS) {
+		pcb->quantum = ticks;
+	} else if(scope == SCHED_QUANTUM_SYSTEM) {
+		if(ticks == 0) return -1;
+		default_quantum = ticks;
+	} else {
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * sched_get_cpu_ticks
+ * Get the CPU time used by a process so far, including the time slice it's in the middle of.
+ *
+ * @param pcb 	The process to look at
+ *
+ * @return 		CPU time in PIT ticks
+ */
+uint32_t sched_get_cpu_ticks(pcb_t *pcb) {
+	sched_cpu_t *cpu = &cpus[pcb->cpu];
+	uint32_t flags;
+	uint32_t ticks;
+
+	spin_lock_irqsave(&cpu->lock, flags);
+	ticks = pcb->cpu_ticks;
+	if(pcb == cpu->current) {
+		ticks += pit_get_ticks() - pcb->last_run_tick;
+	}
+	spin_unlock_irqrestore(&cpu->lock, flags);
+
+	return ticks;
+}
+
+/**
+ * sched_update_priority
+ * Recomputes which run queue level a process belongs on, from its nice value and whether it's on
+ * the active terminal, and moves it there if it's runnable. Any raise from sched_age is dropped.
+ *
+ * @param pcb 	The process to update
+ */
+void sched_update_priority(pcb_t *pcb) {
+	sched_cpu_t *cpu = &cpus[pcb->cpu];
+	uint32_t flags;
+	uint32_t priority = sched_base_priority(pcb);
+
+	spin_lock_irqsave(&cpu->lock, flags);
+	pcb->aged = 0;
+	if(pcb->priority != priority) {
+		sched_set_level(cpu, pcb, priority);
+	}
+	spin_unlock_irqrestore(&cpu->lock, flags);
+}
+
+/**
+ * sched_nice
+ * Changes a process's nice value. Lower values mean higher priority.
+ *
+ * @param pcb 		The process to change
+ * @param increment Amount to add to the nice value. The result is clamped to [SCHED_NICE_MIN, SCHED_NICE_MAX].
+ *
+ * @return 			The new nice value
+ */
+int32_t sched_nice(pcb_t *pcb, int32_t increment) {
+	int32_t nice = pcb->nice + increment;
+
+	if(nice < SCHED_NICE_MIN) nice = SCHED_NICE_MIN;
+	if(nice > SCHED_NICE_MAX) nice = SCHED_NICE_MAX;
+
+	pcb->nice = nice;
+	sched_update_priority(pcb);
+
+	return nice;
+}
+
+/**
+ * sched_foreground_changed
+ * Called when the active terminal changes. Moves the processes on the old terminal back to their
+ * base priority and boosts the ones on the new terminal.
+ */
+void sched_foreground_changed() {
+	uint32_t flags;
+	uint32_t i;
+
+	cli_and_save(flags);
+
+	for(i = 0; i < get_num_slots(); i++) {
+		pcb_t *pcb = get_pcb_from_slot(i);
+		if(pcb->in_use) {
+			sched_update_priority(pcb);
+		}
+	}
+
+	// The boosted processes may now outrank the current ones
+	for(i = 0; i < smp_num_cpus(); i++) {
+		cpus[i].need_resched = 1;
+		if(i != smp_cpu_id()) {
+			smp_send_reschedule(i);
+		}
+	}
+
+	restore_flags(flags);
+}
+
+/**
+ * sched_preempt
+ * Called at the end of an interrupt handler, after the EOI. If the handler woke up a process that
+ * outranks the interrupted one, switches to it now instead of at the end of the timeslice. While the
+ * CPU runs tasklets, need_resched is left set for sched_deferred_switch.
+ */
+void sched_preempt() {
+	uint32_t flags;
+	sched_cpu_t *cpu;
+	pcb_t *former_pcb = get_current_pcb();
+	pcb_t *next_pcb = NULL;
+
+	cli_and_save(flags);
+	if(softirq_active()) {
+		restore_flags(flags);
+		return;
+	}
+
+	cpu = this_cpu();
+	spin_lock(&cpu->lock);
+
+	if(cpu->need_resched) {
+		cpu->need_resched = 0;
+
+		next_pcb = runqueue_peek(&cpu->run_queue);
+		if(next_pcb == former_pcb || (next_pcb != NULL && next_pcb->priority >= former_pcb->priority)) {
+			next_pcb = NULL;
+		}
+	}
+
+	if(next_pcb != NULL) {
+		sched_account_switch(former_pcb, next_pcb, 0);
+		sched_rearm_timer(cpu, next_pcb);
+	}
+	spin_unlock(&cpu->lock);
+
+	if(next_pcb != NULL) {
+		context_switch(former_pcb, next_pcb);
+	}
+
+	restore_flags(flags);
+}
+
+/**
+ * sched_ipi
+ * Handles a reschedule IPI: another CPU changed this CPU's run queue. Re-programs the PIT for the
+ * new number of runnable processes and switches if a higher-priority process was woken up.
+ */
+void sched_ipi() {
+	sched_cpu_t *cpu = this_cpu();
+
+	spin_lock(&cpu->lock);
+	sched_rearm_timer(cpu, cpu->current);
+	spin_unlock(&cpu->lock);
+
+	sched_preempt();
+}
+
+/**
+ * context_switch
+ * Saves the current process's state and loads another process for execution: points the TSS at the
+ * next process's kernel stack, loads its address space (only if it differs) and swaps kernel stacks.
+ * Returns when some other context switches back to last_pcb. Must be called with interrupts disabled,
+ * on the CPU both processes belong to.
+ *
+ * @param last_pcb 	A pointer to the PCB of the process being swapped out
+ * @param pcb 		A pointer to the PCB of the process being run
+ */
+void context_switch(pcb_t *last_pcb, pcb_t *pcb) {
+	sched_cpu_t *cpu = &cpus[pcb->cpu];
+
+	// An exited process's slot can only be reused once no CPU runs on its kernel stack any more
+	sched_reap(cpu);
+	if(last_pcb->status == PROCESS_EXITED) {
+		cpu->dead = last_pcb;
+	}
+	cpu->current = pcb;
+	cpu->switches++;
+
+	if(pcb == cpu->idle) {
+		// The idle task only runs in the kernel and never touches user memory, so it keeps
+		// whichever address space and TSS stack were loaded. Except that of an exited process:
+		// another CPU may give the slot to a new process, which must not find it already loaded here.
+		cpu->idle_entries++;
+		if(last_pcb->status == PROCESS_EXITED) {
+			tlb_load_pd(paging_kernel_pd());
+		}
+	} else {
+		set_process_vmem_page(pcb->slot_num, get_terminal_output_buffer(pcb->terminal_num));
+		tlb_load_pd(pcb->process_pd_ptr);
+		set_kernel_stack(get_kernel_stack_base_from_slot(pcb->slot_num));
+
+		// The FPU registers are only swapped if the process actually uses them
+		fpu_switch(pcb);
+	}
+
+	switch_to(last_pcb, pcb);
+}
+
+/**
+ * schedule
+ * Gives up the CPU from kernel code, e.g. after the current process was taken off the run queue to block.
+ * If nothing at all is runnable, switches to the idle task.
+ */
+void schedule() {
+	uint32_t flags;
+	sched_cpu_t *cpu;
+
+	cli_and_save(flags);
+	cpu = this_cpu();
+	spin_lock(&cpu->lock);
+	sched_switch(cpu, get_current_pcb(), 1);
+	restore_flags(flags);
+}
+
+/**
+ * scheduler
+ * Called on every PIT interrupt (on the boot CPU) and tick IPI (on the others). Once the current
+ * process has used up its timeslice, rotates it to the back of its run queue. Then programs the next
+ * PIT event and switches to whichever process is now first in line.
+ */
+void scheduler() {
+	sched_cpu_t *cpu = this_cpu();
+	pcb_t *former_pcb = get_current_pcb();
+	uint32_t now = pit_get_ticks();
+
+	// The tick interrupted tasklets, which must finish on this stack first
+	if(softirq_active()) {
+		cpu->tick_deferred = 1;
+		return;
+	}
+
+	spin_lock(&cpu->lock);
+	cpu->need_resched = 0;
+
+	// Give the other processes at this priority level a turn
+	if(former_pcb->on_runqueue && now - former_pcb->slice_start_tick >= sched_get_quantum(former_pcb)) {
+		if(former_pcb->aged) {
+			sched_unage(cpu, former_pcb);
+		} else {
+			runqueue_requeue(&cpu->run_queue, former_pcb);
+		}
+
+		// Starts a new timeslice if nobody else wants the CPU
+		former_pcb->slice_start_tick = now;
+	}
+
+	sched_age(cpu, now);
+	sched_switch(cpu, former_pcb, 0);
+}
+
+/**
+ * sched_timeslice_expired
+ * Called when the local APIC timer of a CPU other than the boot CPU fires: the current process has
+ * used up its timeslice, so it is rotated to the back of its run queue and the next process in line
+ * gets the CPU. The local timer only runs while a timeslice is being enforced, so unlike scheduler()
+ * there is no need to check the (possibly stale) PIT tick count first.
+ */
+void sched_timeslice_expired() {
+	sched_cpu_t *cpu = this_cpu();
+	pcb_t *former_pcb = get_current_pcb();
+
+	if(softirq_active()) {
+		cpu->tick_deferred = 1;
+		return;
+	}
+
+	spin_lock(&cpu->lock);
+	cpu->need_resched = 0;
+
+	if(former_pcb->on_runqueue) {
+		if(former_pcb->aged) {
+			sched_unage(cpu, former_pcb);
+		} else {
+			runqueue_requeue(&cpu->run_queue, former_pcb);
+		}
+		former_pcb->slice_start_tick = pit_get_ticks();
+	}
+
+	sched_age(cpu, pit_get_ticks());
+	sched_switch(cpu, former_pcb, 0);
+}
+
+/**
+ * sched_deferred_switch
+ * Called by softirq_run once the CPU's tasklets are done, with interrupts disabled. Does what the
+ * scheduler put off while they ran: the timer tick (which also starts a new timeslice if it's up),
+ * or else a switch to a process they (or an interrupt meanwhile) woke up that outranks this one.
+ */
+void sched_deferred_switch() {
+	sched_cpu_t *cpu = this_cpu();
+
+	if(cpu->tick_deferred) {
+		cpu->tick_deferred = 0;
+		scheduler();
+	} else {
+		sched_preempt();
+	}
+}
+
+/**
+ * sched_switch_count
+ * Get the number of context switches the calling CPU has made, e.g. to tell whether it switched
+ * processes between two calls.
+ *
+ * @return 		The count
+ */
+uint32_t sched_switch_count() {
+	return this_cpu()->switches;
+}
+
+/**
+ * sched_get_idle_stats
+ * Reports how much of the time since boot the CPUs spent in their idle tasks, summed over all CPUs.
+ *
+ * @param stats 	Filled in with the idle statistics
+ */
+void sched_get_idle_stats(sched_idle_stats_t *stats) {
+	uint32_t i;
+
+	stats->idle_ticks = 0;
+	stats->idle_entries = 0;
+	stats->num_cpus = smp_num_cpus();
+	for(i = 0; i < stats->num_cpus; i++) {
+		stats->idle_ticks += sched_get_cpu_ticks(cpus[i].idle);
+		stats->idle_entries += cpus[i].idle_entries;
+	}
+	stats->total_ticks = pit_get_ticks();
+	stats->pit_interrupts = pit_get_interrupts();
+}
+
+/**
+ * sched_get_cpu_stats
+ * Reports how busy one CPU is.
+ *
+ * @param cpu 		The CPU's index
+ * @param stats 	Filled in with the CPU's statistics
+ */
+void sched_get_cpu_stats(uint32_t cpu, sched_cpu_stats_t *stats) {
+	stats->nr_running = cpus[cpu].run_queue.nr_running;
+	stats->idle_ticks = sched_get_cpu_ticks(cpus[cpu].idle);
+	stats->idle_entries = cpus[cpu].idle_entries;
+	stats->switches = cpus[cpu].switches;
+	stats->aged = cpus[cpu].aged;
+}
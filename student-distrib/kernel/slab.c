@@ -0,0 +1,381 @@
+#include <kernel/slab.h>
+#include <arch/x86/frame.h>
+#include <lib/lib.h>
+
+/*
+ * Slab allocator. Each kmem_cache_t hands out objects of one size from slabs: blocks of 2^order
+ * frames from the frame allocator, aligned to their size, with a slab_t header at the start and
+ * the objects after it. Free objects are linked through their first word, so allocating and
+ * freeing are O(1), and objects of one kind are packed together instead of fragmenting memory.
+ * Because slabs are aligned to their size, the slab an object belongs to is found by masking
+ * its address.
+ *
+ * kmalloc/kfree sit on top of one cache per power-of-two size class. Those caches use single
+ * frame slabs, so kfree can find the header of any object by rounding down to 4 kB; bigger
+ * requests get a block of their own with a small header instead.
+ */
+
+/* First word of a slab, and of a large kmalloc block */
+#define SLAB_MAGIC 0x51ab51ab
+#define KMALLOC_LARGE_MAGIC 0x1a46e000
+
+/* Slab objects are at least this aligned, and at least this big (to hold the free list link) */
+#define SLAB_MIN_ALIGN sizeof(void*)
+
+/* Size of the header in front of a large kmalloc block. Keeps the block 16-byte aligned */
+#define KMALLOC_LARGE_HEADER 16
+
+/* Header at the start of every slab */
+typedef struct slab_t {
+	uint32_t magic;
+	kmem_cache_t *cache;
+	struct slab_t *next;    // Linkage in the cache's partial list
+	struct slab_t *prev;
+	void *free;             // First free object, or NULL if the slab is full
+	uint32_t in_use;        // Objects allocated from this slab
+} slab_t;
+
+/* Header in front of a large kmalloc block */
+typedef struct kmalloc_large_t {
+	uint32_t magic;
+	uint32_t order;
+} kmalloc_large_t;
+
+/* Every initialized cache */
+static kmem_cache_t *caches = NULL;
+
+/* One cache per kmalloc size class */
+static kmem_cache_t kmalloc_caches[KMALLOC_NUM_CLASSES];
+static const int8_t *kmalloc_names[KMALLOC_NUM_CLASSES] = {
+	"kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128", "kmalloc-256", "kmalloc-512", "kmalloc-1024"
+};
+
+static uint32_t large_blocks = 0;
+static uint32_t large_frames = 0;
+
+/* Protects the list of caches and the large block counters. Each cache has a lock of its own */
+static spinlock_t slab_lock = SPINLOCK_INIT;
+
+/**
+ * cache_setup
+ * Initializes a cache with a given slab size.
+ *
+ * @param cache 	The cache
+ * @param name 		Name shown in the statistics
+ * @param size 		Size of the objects in bytes
+ * @param align 	Alignment of the objects. Must be a power of two
+ * @param order 	Slabs are 2^order frames
+ */
+static void cache_setup(kmem_cache_t *cache, const int8_t *name, uint32_t size, uint32_t align, uint32_t order) {
+	uint32_t flags;
+
+	if(align < SLAB_MIN_ALIGN) align = SLAB_MIN_ALIGN;
+	if(size < SLAB_MIN_ALIGN) size = SLAB_MIN_ALIGN;
+
+	cache->name = name;
+	cache->object_size = size;
+	cache->stride = (size + align - 1) & ~(align - 1);
+	cache->first_offset = (sizeof(slab_t) + align - 1) & ~(align - 1);
+	cache->order = order;
+	cache->objects_per_slab = 0;
+	if((FRAME_SIZE << order) > cache->first_offset) {
+		cache->objects_per_slab = ((FRAME_SIZE << order) - cache->first_offset) / cache->stride;
+	}
+	cache->partial = NULL;
+	cache->empty_slabs = 0;
+	cache->num_slabs = 0;
+	cache->in_use = 0;
+	cache->allocs = 0;
+	cache->frees = 0;
+	spin_lock_init(&cache->lock);
+
+	spin_lock_irqsave(&slab_lock, flags);
+	cache->next = caches;
+	caches = cache;
+	spin_unlock_irqrestore(&slab_lock, flags);
+}
+
+/**
+ * slab_init
+ * Sets up the kmalloc size classes. The frame allocator must be set up first.
+ */
+void slab_init() {
+	int i;
+
+	for(i = 0; i < KMALLOC_NUM_CLASSES; i++) {
+		cache_setup(&kmalloc_caches[i], kmalloc_names[i], KMALLOC_MIN_SIZE << i, KMALLOC_MIN_SIZE, 0);
+	}
+}
+
+/**
+ * kmem_cache_init
+ * Initializes a cache for objects of one size, with slabs big enough for SLAB_MIN_OBJECTS of them.
+ * No memory is allocated until the first object is.
+ *
+ * @param cache 	The cache
+ * @param name 		Name shown in the statistics
+ * @param size 		Size of the objects in bytes
+ * @param align 	Alignment of the objects (e.g. 16 for fxsave areas). Must be a power of two
+ */
+void kmem_cache_init(kmem_cache_t *cache, const int8_t *name, uint32_t size, uint32_t align) {
+	uint32_t order = 0;
+	uint32_t stride;
+
+	if(align < SLAB_MIN_ALIGN) align = SLAB_MIN_ALIGN;
+	stride = (size + align - 1) & ~(align - 1);
+
+	while(order < FRAME_MAX_ORDER && (FRAME_SIZE << order) < sizeof(slab_t) + align + SLAB_MIN_OBJECTS * stride) {
+		order++;
+	}
+
+	cache_setup(cache, name, size, align, order);
+}
+
+/**
+ * partial_remove
+ * Takes a slab off its cache's partial list.
+ *
+ * @param cache 	The cache
+ * @param slab 		The slab
+ */
+static void partial_remove(kmem_cache_t *cache, slab_t *slab) {
+	if(slab->prev != NULL) {
+		slab->prev->next = slab->next;
+	} else {
+		cache->partial = slab->next;
+	}
+	if(slab->next != NULL) {
+		slab->next->prev = slab->prev;
+	}
+}
+
+/**
+ * partial_push
+ * Puts a slab at the front of its cache's partial list.
+ *
+ * @param cache 	The cache
+ * @param slab 		The slab
+ */
+static void partial_push(kmem_cache_t *cache, slab_t *slab) {
+	slab->prev = NULL;
+	slab->next = cache->partial;
+	if(slab->next != NULL) {
+		slab->next->prev = slab;
+	}
+	cache->partial = slab;
+}
+
+/**
+ * cache_grow
+ * Adds an empty slab to a cache. Interrupts must be off.
+ *
+ * @param cache 	The cache
+ *
+ * @return 			The new slab, or NULL if memory is exhausted
+ */
+static slab_t *cache_grow(kmem_cache_t *cache) {
+	slab_t *slab;
+	uint8_t *object;
+	uint32_t i;
+
+	if(cache->objects_per_slab == 0) return NULL;
+
+	slab = (slab_t*) frame_alloc_pages(cache->order);
+	if(slab == NULL) return NULL;
+
+	slab->magic = SLAB_MAGIC;
+	slab->cache = cache;
+	slab->in_use = 0;
+
+	// Link the objects in address order
+	object = (uint8_t*) slab + cache->first_offset;
+	slab->free = object;
+	for(i = 1; i < cache->objects_per_slab; i++) {
+		*(void**) object = object + cache->stride;
+		object += cache->stride;
+	}
+	*(void**) object = NULL;
+
+	partial_push(cache, slab);
+	cache->empty_slabs++;
+	cache->num_slabs++;
+	return slab;
+}
+
+/**
+ * kmem_cache_alloc
+ * Allocates an object from a cache. Its contents are undefined.
+ *
+ * @param cache 	The cache
+ *
+ * @return 			The object, or NULL if memory is exhausted
+ */
+void *kmem_cache_alloc(kmem_cache_t *cache) {
+	uint32_t flags;
+	slab_t *slab;
+	void *object = NULL;
+
+	spin_lock_irqsave(&cache->lock, flags);
+
+	slab = cache->partial;
+	if(slab == NULL) {
+		slab = cache_grow(cache);
+	}
+
+	if(slab != NULL) {
+		object = slab->free;
+		slab->free = *(void**) object;
+		if(slab->in_use++ == 0) {
+			cache->empty_slabs--;
+		}
+		if(slab->free == NULL) {
+			partial_remove(cache, slab);
+		}
+
+		cache->in_use++;
+		cache->allocs++;
+	}
+
+	spin_unlock_irqrestore(&cache->lock, flags);
+	return object;
+}
+
+/**
+ * kmem_cache_free
+ * Returns an object to its cache. One empty slab is kept for the next allocation; any more
+ * go back to the frame allocator.
+ *
+ * @param cache 	The cache the object was allocated from
+ * @param object 	The object
+ */
+void kmem_cache_free(kmem_cache_t *cache, void *object) {
+	uint32_t flags;
+	slab_t *slab = (slab_t*) ((uint32_t) object & ~((FRAME_SIZE << cache->order) - 1));
+
+	spin_lock_irqsave(&cache->lock, flags);
+
+	// A full slab has room again
+	if(slab->free == NULL) {
+		partial_push(cache, slab);
+	}
+	*(void**) object = slab->free;
+	slab->free = object;
+
+	if(--slab->in_use == 0) {
+		if(cache->empty_slabs > 0) {
+			partial_remove(cache, slab);
+			slab->magic = 0;
+			frame_free_pages((uint32_t) slab, cache->order);
+			cache->num_slabs--;
+		} else {
+			cache->empty_slabs++;
+		}
+	}
+
+	cache->in_use--;
+	cache->frees++;
+
+	spin_unlock_irqrestore(&cache->lock, flags);
+}
+
+/**
+ * kmalloc
+ * Allocates kernel memory, from the smallest size class that fits or, for requests over
+ * KMALLOC_MAX_SIZE, from a block of frames of its own.
+ *
+ * @param size 		Number of bytes needed
+ *
+ * @return 			Memory aligned to at least 16 bytes with undefined contents, or NULL if size is 0 or memory is exhausted
+ */
+void *kmalloc(uint32_t size) {
+	uint32_t flags;
+	uint32_t order = 0;
+	uint32_t i = 0;
+	kmalloc_large_t *block;
+
+	if(size == 0) return NULL;
+
+	if(size <= KMALLOC_MAX_SIZE) {
+		while((KMALLOC_MIN_SIZE << i) < size) {
+			i++;
+		}
+		return kmem_cache_alloc(&kmalloc_caches[i]);
+	}
+
+	if(size > (FRAME_SIZE << FRAME_MAX_ORDER) - KMALLOC_LARGE_HEADER) return NULL;
+	while((FRAME_SIZE << order) < size + KMALLOC_LARGE_HEADER) {
+		order++;
+	}
+
+	block = (kmalloc_large_t*) frame_alloc_pages(order);
+	if(block == NULL) return NULL;
+
+	block->magic = KMALLOC_LARGE_MAGIC;
+	block->order = order;
+
+	spin_lock_irqsave(&slab_lock, flags);
+	large_blocks++;
+	large_frames += 1 << order;
+	spin_unlock_irqrestore(&slab_lock, flags);
+
+	return (uint8_t*) block + KMALLOC_LARGE_HEADER;
+}
+
+/**
+ * kfree
+ * Frees memory from kmalloc.
+ *
+ * @param ptr 	Pointer returned by kmalloc, or NULL
+ */
+void kfree(void *ptr) {
+	uint32_t flags;
+	uint32_t page = (uint32_t) ptr & ~(FRAME_SIZE - 1);
+
+	if(ptr == NULL) return;
+
+	// Size class objects live in single frame slabs, large blocks start a frame
+	if(*(uint32_t*) page == SLAB_MAGIC) {
+		kmem_cache_free(((slab_t*) page)->cache, ptr);
+	} else if(*(uint32_t*) page == KMALLOC_LARGE_MAGIC) {
+		kmalloc_large_t *block = (kmalloc_large_t*) page;
+		uint32_t order = block->order;
+
+		block->magic = 0;
+		frame_free_pages(page, order);
+
+		spin_lock_irqsave(&slab_lock, flags);
+		large_blocks--;
+		large_frames -= 1 << order;
+		spin_unlock_irqrestore(&slab_lock, flags);
+	}
+}
+
+/**
+ * slab_get_stats
+ * Reports how much memory the kernel heap uses, summed over every cache.
+ *
+ * @param stats_out 	Filled in with the totals
+ */
+void slab_get_stats(slab_stats_t *stats_out) {
+	uint32_t flags;
+	kmem_cache_t *cache;
+
+	memset(stats_out, 0, sizeof(*stats_out));
+
+	spin_lock_irqsave(&slab_lock, flags);
+
+	for(cache = caches; cache != NULL; cache = cache->next) {
+		spin_lock(&cache->lock);
+		stats_out->caches++;
+		stats_out->slabs += cache->num_slabs;
+		stats_out->slab_frames += cache->num_slabs << cache->order;
+		stats_out->objects += cache->in_use;
+		stats_out->allocs += cache->allocs;
+		stats_out->frees += cache->frees;
+		spin_unlock(&cache->lock);
+	}
+	stats_out->large_blocks = large_blocks;
+	stats_out->large_frames = large_frames;
+
+	spin_unlock_irqrestore(&slab_lock, flags);
+}
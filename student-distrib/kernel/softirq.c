@@ -0,0 +1,112 @@
+#include <kernel/softirq.h>
+#include <kernel/sched.h>
+#include <arch/x86/smp.h>
+#include <arch/x86/x86_desc.h>
+#include <lib/lib.h>
+
+/* Deferred interrupt work. A device's interrupt handler only does what can't wait (acknowledging the
+ * device and taking its data) and queues a tasklet for the rest. Before the interrupt returns, the
+ * wrapper (interrupt_wrapper.S) drains the CPU's queue with interrupts enabled again, so other
+ * interrupts, the PIT's in particular, aren't held up by it. The idle task drains it too.
+ *
+ * Tasklets run on the interrupted process's kernel stack, which must not be switched away from
+ * while they run: this CPU's queue would be stuck until the process came back. So the scheduler
+ * puts off switching while softirq_active (see sched_deferred_switch). */
+
+/* Deferred work of one CPU. Only touched by that CPU, with interrupts disabled */
+typedef struct softirq_cpu_t {
+	tasklet_t *head;            // Queued tasklets, oldest first
+	tasklet_t *tail;
+	uint8_t active;             // Set while the queue is being drained
+} softirq_cpu_t;
+
+static softirq_cpu_t cpus[SMP_MAX_CPUS];
+
+static softirq_stats_t stats;
+
+/**
+ * tasklet_schedule
+ * Queues a tasklet on the calling CPU, unless it's queued already. Must be called with interrupts
+ * disabled, e.g. from an interrupt handler.
+ *
+ * @param tasklet 	The tasklet to run
+ */
+void tasklet_schedule(tasklet_t *tasklet) {
+	softirq_cpu_t *cpu = &cpus[smp_cpu_id()];
+
+	if(tasklet->queued) {
+		stats.merged++;
+		return;
+	}
+
+	tasklet->queued = 1;
+	tasklet->next = NULL;
+	if(cpu->tail != NULL) {
+		cpu->tail->next = tasklet;
+	} else {
+		cpu->head = tasklet;
+	}
+	cpu->tail = tasklet;
+	stats.scheduled++;
+}
+
+/**
+ * softirq_run
+ * Runs the calling CPU's queued tasklets with interrupts enabled, including any queued meanwhile,
+ * then lets the scheduler do what it put off. Must be called with interrupts disabled, and not
+ * with any lock held; returns with interrupts disabled. Does nothing if the queue is already being
+ * drained further up this CPU's stack.
+ */
+void softirq_run() {
+	softirq_cpu_t *cpu = &cpus[smp_cpu_id()];
+
+	if(cpu->head == NULL || cpu->active) return;
+	cpu->active = 1;
+
+	while(cpu->head != NULL) {
+		tasklet_t *tasklet = cpu->head;
+
+		// Take the whole queue; anything queued while it runs is picked up by the next round
+		cpu->head = NULL;
+		cpu->tail = NULL;
+		stats.batches++;
+
+		latency_irqs_on();
+		sti();
+		while(tasklet != NULL) {
+			tasklet_t *next = tasklet->next;
+
+			// Cleared first, so that an interrupt can queue it again while it runs
+			tasklet->queued = 0;
+			tasklet->func(tasklet->data);
+			stats.run++;
+			tasklet = next;
+		}
+		cli();
+		latency_irqs_off(__FILE__, __LINE__);
+	}
+
+	cpu->active = 0;
+	sched_deferred_switch();
+}
+
+/**
+ * softirq_active
+ * Checks whether the calling CPU is running tasklets (and so mustn't switch processes).
+ *
+ * @return 		1 if it is, 0 if not
+ */
+uint32_t softirq_active() {
+	return cpus[smp_cpu_id()].active;
+}
+
+/**
+ * softirq_get_stats
+ * Get the deferred work counters. They are updated without a lock, so they're approximate while
+ * other CPUs run tasklets.
+ *
+ * @param out 	Filled in with the counters
+ */
+void softirq_get_stats(softirq_stats_t *out) {
+	*out = stats;
+}
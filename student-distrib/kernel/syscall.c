@@ -6,6 +6,9 @@
 #include <lib/lib.h>
 #include <drivers/rtc.h>
 #include <tty/terminal.h>
+#include <kernel/sched.h>
+#include <kernel/timer.h>
+#include <drivers/pit.h>
 
 #define RTC_FT 0
 #define DIRECTORY_FT 1
@@ -200,18 +203,7 @@ int32_t syscall_write(int32_t fd, const void *buf, int32_t nbytes) {
  */
 int32_t syscall_execute(const int8_t *command) {
     pcb_t *parent_pcb = get_current_pcb();
-    pcb_t *child_pcb = NULL;
-
-    // Find a free PCB slot
-    int i;
-    for(i = 0; i < MAX_PROCESSES; i++) {
-        pcb_t *some_pcb = get_pcb_from_slot(i);
-        if(!some_pcb->in_use) {
-            child_pcb = some_pcb;
-            child_pcb->slot_num = i;
-            break;
-        }
-    }
+    pcb_t *child_pcb = allocate_pcb();
 
     // No free PCB slots available
     if(child_pcb == NULL) return -1;
@@ -219,43 +211,45 @@ int32_t syscall_execute(const int8_t *command) {
     // Save program name and args in the child process's PCB
     parse_command(command, child_pcb->program_name, child_pcb->args);
 
-    // Load executable and check validity
-    uint32_t entrypoint = load_program_into_slot(child_pcb->program_name, child_pcb->slot_num);
-    if(entrypoint == NULL) return -1;
-    child_pcb->entrypoint = entrypoint;
-
-    // Set up paging for the new child process
+    // Set up paging for the new child process. Its process page is only reachable through its own page directory.
     void *vmem_ptr = get_terminal_output_buffer(parent_pcb->terminal_num);
-    child_pcb->process_pd_ptr = setup_process_paging(get_process_page_from_slot(child_pcb->slot_num), child_pcb->slot_num, vmem_ptr);
+    child_pcb->process_pd_ptr = setup_process_paging(child_pcb->slot_num, vmem_ptr);
+    if(child_pcb->process_pd_ptr == NULL) {
+        free_pcb(child_pcb);
+        return -1;
+    }
     set_process_vmem_page(child_pcb->slot_num, vmem_ptr);
-    enable_paging(child_pcb->process_pd_ptr);
+
+    // Check the executable. Its pages are only loaded once the child touches them.
+    uint32_t entrypoint = load_program(child_pcb, child_pcb->program_name);
+    if(entrypoint == NULL) {
+        free_pcb(child_pcb);
+        return -1;
+    }
+    child_pcb->entrypoint = entrypoint;
 
     // Set up the child process's PCB
     child_pcb->parent = parent_pcb;
     child_pcb->child = NULL;
     parent_pcb->child = child_pcb;
-    child_pcb->in_use = 1;
     child_pcb->pid = get_next_pid();
     child_pcb->terminal_num = parent_pcb->terminal_num;
+    sched_task_init(child_pcb, parent_pcb);
     child_pcb->status = PROCESS_RUNNING;
     parent_pcb->status = PROCESS_BLOCKED;
     open_stdin_and_stdout(child_pcb);
 
-    // Prepare for context switch: set the new kernel stack in the TSS and save esp/ebp registers
-    set_kernel_stack(get_kernel_stack_base_from_slot(child_pcb->slot_num));
-    asm volatile(
-        "mov %%esp, %0\r\n"
-        "mov %%ebp, %1\r\n"
-        : "=g"(parent_pcb->regs.esp), "=g"(parent_pcb->regs.ebp)
-        :
-        : "memory", "eax"
-    );
+    // The child starts out in the program as soon as it gets the CPU
+    prepare_kernel_stack(child_pcb, get_kernel_stack_base_from_slot(child_pcb->slot_num), enter_user_program);
 
-    // Switch to user mode
-    switch_to_ring_3(PROCESS_LINK_START, child_pcb->entrypoint);
+    // The parent sleeps until the child halts; the child takes its place on the run queue
+    sched_account_switch(parent_pcb, child_pcb, 1);
+    sched_dequeue(parent_pcb);
+    sched_enqueue(child_pcb);
+    context_switch(parent_pcb, child_pcb);
 
-    // We'll never come back here (read halt_program comments for complete reason)
-    return -1;
+    // halt_program switched back to us and left the child's exit status behind
+    return parent_pcb->child_status;
 }
 
 /**
@@ -327,3 +321,147 @@ int32_t syscall_set_handler(int32_t signum, void *handler_address) {
 int32_t syscall_sigreturn() {
     return -1;
 }
+
+/**
+ * syscall_set_quantum
+ * Sets how many PIT ticks a process may run before other processes at its priority get a turn.
+ * CPU-bound programs can ask for long timeslices, interactive ones for short ones.
+ * 
+ * @param ticks   New timeslice in PIT ticks (at most SCHED_MAX_QUANTUM_TICKS). For the process
+ *                scope, 0 makes the process follow the system-wide quantum again.
+ * @param scope   SCHED_QUANTUM_PROCESS for the calling process (inherited by programs it executes
+ *                afterwards), SCHED_QUANTUM_SYSTEM for the system-wide default. The default affects
+ *                every process, so only a terminal's base shell may change it.
+ *
+ * @return        0 on success, -1 if the arguments are out of range or the caller may not change the default
+ */
+int32_t syscall_set_quantum(uint32_t ticks, uint32_t scope) {
+    pcb_t *pcb = get_current_pcb();
+
+    // Base shells are the only processes without a parent
+    if(scope == SCHED_QUANTUM_SYSTEM && pcb->parent != NULL) return -1;
+
+    return sched_set_quantum(pcb, ticks, scope);
+}
+
+/**
+ * syscall_nice
+ * Changes the calling process's nice value, which sets its base priority. Lower values mean higher
+ * priority. Programs it executes afterwards inherit the new value.
+ * 
+ * @param increment   Amount to add to the nice value. The result is clamped to [SCHED_NICE_MIN, SCHED_NICE_MAX].
+ *
+ * @return            0
+ */
+int32_t syscall_nice(int32_t increment) {
+    sched_nice(get_current_pcb(), increment);
+    return 0;
+}
+
+/**
+ * sleep_timer_expired
+ * Timer callback that ends a sleep syscall.
+ * 
+ * @param data    The sleeping process's PCB
+ */
+static void sleep_timer_expired(void *data) {
+    sched_wake_up((pcb_t*) data);
+}
+
+/**
+ * syscall_sleep
+ * Blocks the calling process for at least the given time. The process is off the run queue while it
+ * sleeps, and its wake-up is a timer on the timer wheel, so sleeping processes cost no CPU time and
+ * don't need the RTC.
+ * 
+ * @param ms      Time to sleep in milliseconds. It is rounded up to whole PIT ticks.
+ *
+ * @return        0
+ */
+int32_t syscall_sleep(uint32_t ms) {
+    pcb_t *pcb = get_current_pcb();
+    uint32_t ticks;
+
+    // Split the conversion so that ms * SCHED_TICK_HZ can't overflow
+    ticks = (ms / 1000) * SCHED_TICK_HZ + ((ms % 1000) * SCHED_TICK_HZ + 999) / 1000;
+    if(ticks == 0) return 0;
+    if(ticks > TIMER_MAX_TICKS) ticks = TIMER_MAX_TICKS;
+
+    // The current tick is already partly over, so wait one more to sleep at least "ms"
+    timer_setup(&pcb->sleep_timer, sleep_timer_expired, pcb);
+    timer_add(&pcb->sleep_timer, pit_get_ticks() + ticks + 1);
+
+    // Marked blocked before the check, so a timer firing on another CPU in between isn't missed
+    for(;;) {
+        sched_prepare_block();
+        if(!timer_pending(&pcb->sleep_timer)) break;
+        sched_block();
+    }
+    sched_cancel_block();
+
+    return 0;
+}
+
+/**
+ * syscall_fork
+ * Creates a copy of the calling process. The child shares the parent's memory copy-on-write, so
+ * creating it only costs a page table copy; a page is duplicated the first time either of them
+ * writes to it. The child inherits open files, the terminal and scheduling settings, and runs
+ * alongside the parent, which doesn't wait for it to halt.
+ *
+ * @return        The child's pid in the parent, 0 in the child, -1 on failure
+ */
+int32_t syscall_fork() {
+    pcb_t *parent_pcb = get_current_pcb();
+    pcb_t *child_pcb = allocate_pcb();
+    uint8_t *child_stack_base;
+
+    // No free PCB slots available
+    if(child_pcb == NULL) return -1;
+
+    void *vmem_ptr = get_terminal_output_buffer(parent_pcb->terminal_num);
+    child_pcb->process_pd_ptr = fork_process_paging(parent_pcb->slot_num, child_pcb->slot_num, vmem_ptr);
+    if(child_pcb->process_pd_ptr == NULL) {
+        free_pcb(child_pcb);
+        return -1;
+    }
+
+    // Same program, open files and RTC settings
+    memcpy(child_pcb->fa, parent_pcb->fa, sizeof(child_pcb->fa));
+    memcpy(child_pcb->program_name, parent_pcb->program_name, sizeof(child_pcb->program_name));
+    memcpy(child_pcb->args, parent_pcb->args, sizeof(child_pcb->args));
+    child_pcb->entrypoint = parent_pcb->entrypoint;
+    child_pcb->image_inode = parent_pcb->image_inode;
+    memcpy(child_pcb->segments, parent_pcb->segments, sizeof(child_pcb->segments));
+    child_pcb->num_segments = parent_pcb->num_segments;
+    child_pcb->image = parent_pcb->image;
+    if(child_pcb->image != NULL) {
+        image_cache_hold(child_pcb->image);
+    }
+    child_pcb->rtc_enabled = parent_pcb->rtc_enabled;
+    child_pcb->rtc_interval = parent_pcb->rtc_interval;
+    child_pcb->rtc_deadline = parent_pcb->rtc_deadline;
+    child_pcb->rtc_queued = 0;
+    wait_queue_init(&child_pcb->rtc_wait);
+
+    // Set up the child process's PCB
+    child_pcb->parent = parent_pcb;
+    child_pcb->child = NULL;
+    child_pcb->forked = 1;
+    child_pcb->pid = get_next_pid();
+    child_pcb->terminal_num = parent_pcb->terminal_num;
+    child_pcb->status = PROCESS_RUNNING;
+    sched_task_init(child_pcb, parent_pcb);
+    fpu_fork(parent_pcb, child_pcb);
+
+    // Nobody waits for a forked child, so it can run on whichever CPU is least busy
+    child_pcb->cpu = sched_select_cpu();
+
+    // The child returns from this same syscall, from a copy of the parent's syscall frame
+    child_stack_base = get_kernel_stack_base_from_slot(child_pcb->slot_num);
+    memcpy(child_stack_base - SYSCALL_FRAME_SIZE, (uint8_t*) get_current_kernel_stack_base() - SYSCALL_FRAME_SIZE, SYSCALL_FRAME_SIZE);
+    prepare_kernel_stack(child_pcb, child_stack_base - SYSCALL_FRAME_SIZE, fork_child_return);
+
+    sched_enqueue(child_pcb);
+    return child_pcb->pid;
+}
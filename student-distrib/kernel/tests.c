@@ -2,15 +2,44 @@
 #include <types.h>
 #include <fs/ece391_fs.h>
 #include <drivers/rtc.h>
-#include <arch/x86/i8259.h>
+#include <arch/x86/irq.h>
 #include <tty/terminal.h>
 #include <tty/keyboard_map.h>
 #include <lib/lib.h>
 #include <lib/circular_buffer.h>
+#include <kernel/sched.h>
+#include <kernel/timer.h>
+#include <kernel/image_cache.h>
+#include <kernel/slab.h>
+#include <drivers/pit.h>
+#include <arch/x86/fpu.h>
+#include <arch/x86/cpu.h>
+#include <arch/x86/frame.h>
+#include <arch/x86/paging.h>
+#include <arch/x86/tlb.h>
+#include <arch/x86/x86_desc.h>
+#include <arch/x86/latency.h>
+#include <kernel/softirq.h>
+#include <kernel/vdata.h>
 
 static volatile uint16_t htz = 1;
 static uint16_t index_num = 0;
 
+// Fake processes for the scheduler benchmark; only their run queue fields are used
+static pcb_t sched_bench_pcbs[SCHED_BENCH_MAX_TASKS];
+
+// Two kernel contexts that bounce the CPU back and forth for the context switch benchmark
+static pcb_t switch_bench_main;
+static union {
+    pcb_t pcb;
+    uint8_t kernel_stack[KERNEL_STACK_SIZE];
+} switch_bench_partner __attribute__((aligned (KERNEL_STACK_SIZE)));
+
+// Page directory and TSS stack both contexts "switch" to, and which switch path to emulate
+static pd_entry *switch_bench_pd;
+static uint32_t switch_bench_esp0;
+static volatile uint8_t switch_bench_legacy;
+
 /*
  * test_suite
  *   DESCRIPTION:  Dispatcher for test suite, called from interrupt handler.
@@ -35,6 +64,21 @@ void test_suite(int test_num){
      else if (test_num == 5) { // Represents suggested test #5 on piazza.
          stop_rtc_test();
      }
+     else if (test_num == 6) {
+         sched_benchmark();
+     }
+     else if (test_num == 7) {
+         kernel_stats();
+     }
+     else if (test_num == 8) {
+         process_stats();
+     }
+     else if (test_num == 9) {
+         switch_benchmark();
+     }
+     else if (test_num == 10) {
+         latency_stats();
+     }
 }
 
 /*
@@ -176,17 +220,13 @@ void read_file_by_index(){
  *   SIDE EFFECTS: none
  */ 
 void start_rtc_test() {
-    rtc_open(NULL, "rtc");             // tests "rtc_open". If our RTC interrupts occur that means 'rtc_open' worked correctly
-
     /* Update htz */
     htz <<= 1;              // doubles value. htz must be power of 2
     if (htz > MAX_FREQ)
         htz = MIN_FREQ;
 
-    uint32_t temp_htz = htz;
-    rtc_write(0, &temp_htz, sizeof(temp_htz));         // tests "rtc_write".
-
-    set_rtc_test_enabled(1);
+    // The test runs the RTC itself, rather than through whichever process this key press interrupted
+    set_rtc_test_rate(htz);
 }
 
 /*
@@ -206,8 +246,460 @@ void stop_rtc_test(){
     // Clear buffer and screen
     terminal_close(0);
 
-    rtc_close(NULL);
-    set_rtc_test_enabled(0);
+    set_rtc_test_rate(0);
+
+    restore_flags(flags);
+}
+
+/*
+ * sched_benchmark
+ *   DESCRIPTION:  Measures the cost of one scheduling decision (pick the next process, rotate it
+ *                 to the back of its queue) on a private run queue holding 1, 2, 4, ... runnable tasks.
+ *   INPUTS:       none
+ *   OUTPUTS:      Prints the average number of TSC cycles per decision for each run queue size.
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: Erases the screen
+ */
+void sched_benchmark(){
+    runqueue_t rq;
+    uint32_t num_tasks;
+    uint32_t i;
+    uint64_t start, end;
+
+    clear_terminal(0);
+    printf(" Scheduler pick-next benchmark (%u picks per run)\n\n", 1 << SCHED_BENCH_ITER_SHIFT);
+
+    for(num_tasks = 1; num_tasks <= SCHED_BENCH_MAX_TASKS; num_tasks <<= 1) {
+        runqueue_init(&rq);
+        for(i = 0; i < num_tasks; i++) {
+            sched_bench_pcbs[i].priority = SCHED_DEFAULT_PRIORITY;
+            runqueue_enqueue(&rq, &sched_bench_pcbs[i]);
+        }
+
+        rdtsc(start);
+        for(i = 0; i < (1 << SCHED_BENCH_ITER_SHIFT); i++) {
+            runqueue_requeue(&rq, runqueue_peek(&rq));
+        }
+        rdtsc(end);
+
+        printf(" %u runnable:    %u cycles per pick\n", num_tasks, (uint32_t) (end - start) >> SCHED_BENCH_ITER_SHIFT);
+    }
+}
+
+/*
+ * sched_stats
+ *   DESCRIPTION:  Shows the scheduler's counters: how much time the CPUs have spent in their idle tasks,
+ *                 how many PIT interrupts it took to keep time (fewer than ticks when the PIT is left
+ *                 quiet while idle), then how busy each CPU is and how many waiting processes it aged.
+ *   INPUTS:       none
+ *   OUTPUTS:      Prints the statistics.
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: none
+ */
+static void sched_stats(){
+    sched_idle_stats_t stats;
+    uint32_t idle_percent = 0;
+    uint32_t cpu;
+
+    sched_get_idle_stats(&stats);
+    if(stats.total_ticks >= 100) {
+        // Each CPU can be idle for every tick
+        idle_percent = stats.idle_ticks / (stats.total_ticks / 100 * stats.num_cpus);
+    }
+
+    printf(" Ticks since boot:    %u\n", stats.total_ticks);
+    printf(" PIT interrupts:      %u\n", stats.pit_interrupts);
+    printf(" Ticks idle:          %u (%u%%)\n", stats.idle_ticks, idle_percent);
+    printf(" Times gone idle:     %u\n", stats.idle_entries);
+    printf(" CPUs online:         %u\n", stats.num_cpus);
+
+    for(cpu = 0; cpu < stats.num_cpus; cpu++) {
+        sched_cpu_stats_t cpu_stats;
+
+        sched_get_cpu_stats(cpu, &cpu_stats);
+        printf("  CPU %u: %u runnable, %u ticks idle (%u times), %u switches, %u aged\n", cpu, cpu_stats.nr_running,
+               cpu_stats.idle_ticks, cpu_stats.idle_entries, cpu_stats.switches, cpu_stats.aged);
+    }
+}
+
+/*
+ * memory_stats
+ *   DESCRIPTION:  Shows how much user memory is in use and how user pages were faulted in or
+ *                 copied on write.
+ *   INPUTS:       none
+ *   OUTPUTS:      Prints the statistics.
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: none
+ */
+static void memory_stats(){
+    frame_stats_t frames;
+    paging_stats_t paging;
+
+    frame_get_stats(&frames);
+    paging_get_stats(&paging);
+
+    printf(" Frames free:         %u of %u (%u shared, %u free 4MB blocks)\n", frames.free, frames.total, frames.shared, frames.free_large);
+    printf(" Demand paging:       %u shared pages, %u private pages\n", paging.shared_faults, paging.private_faults);
+    printf(" Copy-on-write:       %u faults (%u copies, %u reuses)\n", paging.cow_faults, paging.cow_copies, paging.cow_reuses);
+}
+
+/*
+ * image_cache_stats
+ *   DESCRIPTION:  Shows how often programs' pages could be shared through the image cache.
+ *   INPUTS:       none
+ *   OUTPUTS:      Prints the statistics.
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: none
+ */
+static void image_cache_stats(){
+    image_cache_stats_t images;
+
+    image_cache_get_stats(&images);
+
+    printf(" Image cache:         %u hits, %u misses, %u evictions\n", images.hits, images.misses, images.evictions);
+    printf(" Image pages:         %u loaded, %u mapped shared\n", images.pages_loaded, images.pages_mapped);
+}
+
+/*
+ * fpu_stats
+ *   DESCRIPTION:  Shows how often lazy FPU switching had to save or load registers.
+ *   INPUTS:       none
+ *   OUTPUTS:      Prints the statistics.
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: none
+ */
+static void fpu_stats(){
+    fpu_stats_t fpu;
+
+    fpu_get_stats(&fpu);
+
+    printf(" FPU traps:           %u (%u saves, %u restores)\n", fpu.traps, fpu.saves, fpu.restores);
+}
+
+/*
+ * timer_stats
+ *   DESCRIPTION:  Shows what the timer wheel did: timers pending, fired, cancelled and cascaded
+ *                 to a finer level.
+ *   INPUTS:       none
+ *   OUTPUTS:      Prints the statistics.
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: none
+ */
+static void timer_stats(){
+    timer_stats_t timers;
+
+    timer_get_stats(&timers);
+
+    printf(" Timers pending:      %u\n", timers.pending);
+    printf(" Timers fired:        %u of %u (%u cancelled, %u cascades)\n", timers.expired, timers.added, timers.cancelled, timers.cascaded);
+}
+
+/*
+ * tlb_stats
+ *   DESCRIPTION:  Shows how much TLB flushing address space changes caused, and how many CR3 loads
+ *                 were skipped because the address space was already loaded.
+ *   INPUTS:       none
+ *   OUTPUTS:      Prints the statistics.
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: none
+ */
+static void tlb_stats(){
+    tlb_stats_t tlb;
+
+    tlb_get_stats(&tlb);
+
+    printf(" TLB flushes:         %u full, %u single page\n", tlb.full_flushes, tlb.page_flushes);
+    printf(" Address spaces:      %u CR3 loads, %u skipped (already loaded)\n", tlb.cr3_loads, tlb.cr3_skips);
+}
+
+/*
+ * heap_stats
+ *   DESCRIPTION:  Shows how much memory the kernel heap holds and how often it was called.
+ *   INPUTS:       none
+ *   OUTPUTS:      Prints the statistics.
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: none
+ */
+static void heap_stats(){
+    slab_stats_t heap;
+
+    slab_get_stats(&heap);
+
+    printf(" Kernel heap:         %u objects in %u slabs (%u kB), %u large blocks (%u kB)\n", heap.objects, heap.slabs,
+           heap.slab_frames * (FRAME_SIZE / 1024), heap.large_blocks, heap.large_frames * (FRAME_SIZE / 1024));
+    printf(" Heap calls:          %u allocs, %u frees in %u caches\n", heap.allocs, heap.frees, heap.caches);
+}
+
+/*
+ * vdata_stats
+ *   DESCRIPTION:  Shows what the data page shared with user programs says.
+ *   INPUTS:       none
+ *   OUTPUTS:      Prints the statistics.
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: none
+ */
+static void vdata_stats(){
+    vdata_t *vdata = vdata_get_page();
+
+    printf(" Data page:           tick %u, %u runnable, %u switches, TSC %u kHz\n", vdata->ticks, vdata->nr_running,
+           vdata->switches, vdata->tsc_khz);
+}
+
+/*
+ * kernel_stats
+ *   DESCRIPTION:  Shows kernel counters, one subsystem after the other: the scheduler, user memory,
+ *                 the image cache, lazy FPU switching, the timer wheel, TLB flushing, the kernel heap
+ *                 and the data page shared with user programs.
+ *   INPUTS:       none
+ *   OUTPUTS:      Prints the statistics.
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: Erases the screen
+ */
+void kernel_stats(){
+    clear_terminal(0);
+    printf(" Kernel statistics\n\n");
+    sched_stats();
+    memory_stats();
+    image_cache_stats();
+    fpu_stats();
+    timer_stats();
+    tlb_stats();
+    heap_stats();
+    vdata_stats();
+}
+
+/*
+ * process_stats
+ *   DESCRIPTION:  Lists every process with its CPU accounting: CPU time, voluntary and involuntary
+ *                 context switches, when it last ran and its timeslice, all in PIT ticks.
+ *   INPUTS:       none
+ *   OUTPUTS:      Prints one line per process.
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: Erases the screen
+ */
+void process_stats(){
+    uint32_t i;
+
+    clear_terminal(0);
+    printf(" Process statistics at tick %u\n\n", pit_get_ticks());
+    printf(" pid  name        cpu    vol    invol  last   quantum  prio  nice\n");
+
+    for(i = 0; i < get_num_slots(); i++) {
+        pcb_t *pcb = get_pcb_from_slot(i);
+        if(!pcb->in_use) continue;
+
+        printf(" %u    %s    %u    %u    %u    %u    %u    %u    %d\n", pcb->pid, pcb->program_name, sched_get_cpu_ticks(pcb),
+               pcb->voluntary_switches, pcb->involuntary_switches, pcb->last_run_tick, sched_get_quantum(pcb),
+               pcb->priority, pcb->nice);
+    }
+}
+
+/*
+ * tasklet_stats
+ *   DESCRIPTION:  Shows how much work interrupt handlers deferred to tasklets.
+ *   INPUTS:       none
+ *   OUTPUTS:      Prints the statistics.
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: none
+ */
+static void tasklet_stats(){
+    softirq_stats_t softirq;
+
+    softirq_get_stats(&softirq);
+
+    printf(" Tasklets: %u queued (%u more already were), %u run in %u batches\n\n",
+           softirq.scheduled, softirq.merged, softirq.run, softirq.batches);
+}
+
+/*
+ * handler_latency_stats
+ *   DESCRIPTION:  Shows how long each interrupt handler runs: count, longest run and a histogram
+ *                 with power-of-2 buckets, in TSC cycles.
+ *   INPUTS:       none
+ *   OUTPUTS:      Prints the statistics.
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: none
+ */
+static void handler_latency_stats(){
+    latency_irq_stats_t irq;
+    uint32_t src;
+    uint32_t i;
+
+    printf(" Interrupt handler run times (cycles)\n");
+    printf(" Buckets: <1k 1k 2k 4k 8k 16k 32k 64k 128k 256k 512k 1M+\n\n");
+    for(src = 0; src < LATENCY_NUM_SRCS; src++) {
+        latency_get_irq_stats(src, &irq);
+        if(irq.count == 0 && irq.switched == 0) continue;
+
+        printf(" %s: %u runs, longest %u, %u more switched processes\n  ", irq.name, irq.count, irq.max, irq.switched);
+        for(i = 0; i < LATENCY_HIST_BUCKETS; i++) {
+            printf(" %u", irq.hist[i]);
+        }
+        printf("\n");
+    }
+}
+
+/*
+ * irqs_off_stats
+ *   DESCRIPTION:  Shows the call sites that kept interrupts disabled the longest, in TSC cycles.
+ *   INPUTS:       none
+ *   OUTPUTS:      Prints the statistics.
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: none
+ */
+static void irqs_off_stats(){
+    latency_window_t windows[LATENCY_TOP_WINDOWS];
+    uint32_t num_windows;
+    uint32_t i;
+
+    num_windows = latency_get_windows(windows);
+    printf("\n Longest windows with interrupts disabled (cycles)\n");
+    for(i = 0; i < num_windows; i++) {
+        if(windows[i].line != 0) {
+            printf(" %u    %s:%u (%u times)\n", windows[i].max, windows[i].site, windows[i].line, windows[i].count);
+        } else {
+            printf(" %u    %s (%u times)\n", windows[i].max, windows[i].site, windows[i].count);
+        }
+    }
+}
+
+/*
+ * latency_stats
+ *   DESCRIPTION:  Shows how much work interrupt handlers deferred to tasklets, how long each handler
+ *                 runs, then the call sites that kept interrupts disabled the longest.
+ *   INPUTS:       none
+ *   OUTPUTS:      Prints the statistics.
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: Erases the screen
+ */
+void latency_stats(){
+    clear_terminal(0);
+    tasklet_stats();
+
+    if(!latency_enabled()) {
+        printf(" This CPU has no TSC, so interrupt latency isn't measured\n");
+        return;
+    }
+
+    handler_latency_stats();
+    irqs_off_stats();
+}
+
+/*
+ * legacy_switch_work
+ *   DESCRIPTION:  Does what the old context switch did on every switch besides swapping stacks:
+ *                 reload CR3 (flushing the TLB) unconditionally, then rebuild the TSS descriptor
+ *                 in the GDT and reload the task register.
+ *   INPUTS:       none
+ *   OUTPUTS:      none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: Flushes the TLB, reloads the TSS
+ */
+static void legacy_switch_work(){
+    seg_desc_t the_tss_desc;
+
+    tlb_flush_all();
+    enable_paging(switch_bench_pd);
+
+    tss.ss0 = KERNEL_DS;
+    tss.esp0 = switch_bench_esp0;
+
+    the_tss_desc.granularity    = 0;
+    the_tss_desc.opsize         = 0;
+    the_tss_desc.reserved       = 0;
+    the_tss_desc.avail          = 0;
+    the_tss_desc.seg_lim_19_16  = TSS_SIZE & 0x000F0000;
+    the_tss_desc.present        = 1;
+    the_tss_desc.sys            = 0;
+    the_tss_desc.type           = 0x9;
+    the_tss_desc.dpl            = 0x3;
+
+    SET_TSS_PARAMS(the_tss_desc, &tss, tss_size);
+    tss_desc_ptr = the_tss_desc;
+    ltr(KERNEL_TSS);
+}
+
+/*
+ * switch_work
+ *   DESCRIPTION:  Does what context_switch does on every switch besides swapping stacks.
+ *   INPUTS:       none
+ *   OUTPUTS:      none
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: Sets the TSS stack
+ */
+static void switch_work(){
+    tlb_load_pd(switch_bench_pd);
+    set_kernel_stack((void*) switch_bench_esp0);
+}
+
+/*
+ * switch_bench_partner_loop
+ *   DESCRIPTION:  Body of the benchmark's second context. Switches straight back every time it gets the CPU.
+ *   INPUTS:       none
+ *   OUTPUTS:      none
+ *   RETURN VALUE: none (never returns)
+ *   SIDE EFFECTS: none
+ */
+static void switch_bench_partner_loop(){
+    for(;;) {
+        if(switch_bench_legacy) {
+            legacy_switch_work();
+        } else {
+            switch_work();
+        }
+        switch_to(&switch_bench_partner.pcb, &switch_bench_main);
+    }
+}
+
+/*
+ * switch_benchmark
+ *   DESCRIPTION:  Pingpong between two kernel contexts to measure the cost of a context switch,
+ *                 first the way it used to be done (CR3 reload, TSS descriptor rebuild and ltr on
+ *                 every switch), then the way context_switch does it now (only tss.esp0, CR3 only if
+ *                 the address space changes, callee-saved registers swapped by switch_to).
+ *   INPUTS:       none
+ *   OUTPUTS:      Prints the average number of TSC cycles per switch for both.
+ *   RETURN VALUE: none
+ *   SIDE EFFECTS: Erases the screen
+ */
+void switch_benchmark(){
+    uint32_t flags;
+    uint32_t cr3;
+    uint32_t i;
+    uint64_t start, end;
+    int legacy;
+
+    cli_and_save(flags);
+
+    // Both contexts live in the current address space and share the current TSS stack
+    read_cr3(cr3);
+    switch_bench_pd = (pd_entry*) cr3;
+    switch_bench_esp0 = tss.esp0;
+
+    prepare_kernel_stack(&switch_bench_partner.pcb, switch_bench_partner.kernel_stack + KERNEL_STACK_SIZE, switch_bench_partner_loop);
+
+    clear_terminal(0);
+    printf(" Context switch benchmark (%u round trips per run)\n\n", 1 << SWITCH_BENCH_ITER_SHIFT);
+
+    for(legacy = 1; legacy >= 0; legacy--) {
+        switch_bench_legacy = legacy;
+
+        rdtsc(start);
+        for(i = 0; i < (1 << SWITCH_BENCH_ITER_SHIFT); i++) {
+            if(legacy) {
+                legacy_switch_work();
+            } else {
+                switch_work();
+            }
+            switch_to(&switch_bench_main, &switch_bench_partner.pcb);
+        }
+        rdtsc(end);
+
+        // Every round trip is two switches
+        printf(" %s    %u cycles per switch\n", legacy ? "Before (TSS rebuild + ltr + CR3):" : "After (switch_to, esp0 only):    ",
+               (uint32_t) ((end - start) >> (SWITCH_BENCH_ITER_SHIFT + 1)));
+    }
 
+    tss.esp0 = switch_bench_esp0;
     restore_flags(flags);
 }
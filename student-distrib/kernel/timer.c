@@ -0,0 +1,341 @@
+#include <kernel/timer.h>
+#include <drivers/pit.h>
+#include <arch/x86/spinlock.h>
+#include <lib/lib.h>
+
+/* The timer wheel. Level 0 has one slot per tick; a slot on level n holds the timers that fire in one
+ * TIMER_WHEEL_SLOTS^n tick window. When the level below wraps around, the next slot of a level is
+ * cascaded: its timers are spread out over the lower levels. Adding, cancelling and expiring a timer
+ * are all O(1), and a tick costs the same no matter how many timers are pending. */
+static timer_t *wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+
+/* Bit i of wheel_bitmap[n] is set iff wheel[n][i] is non-empty */
+static uint64_t wheel_bitmap[TIMER_WHEEL_LEVELS];
+
+/* The next tick the wheel has to process. Everything before it has been expired */
+static uint32_t wheel_next = 0;
+
+static timer_stats_t stats;
+
+/* Protects the wheel. Timers are added from any CPU, but only the boot CPU's PIT interrupt runs them */
+static spinlock_t timer_lock = SPINLOCK_INIT;
+
+/**
+ * lowest_bit
+ * Finds the lowest set bit of a non-zero 64-bit mask.
+ *
+ * @param mask 	The mask to search. Must not be 0
+ *
+ * @return 		The index of the lowest set bit
+ */
+static uint32_t lowest_bit(uint64_t mask) {
+	uint32_t low = (uint32_t) mask;
+	uint32_t index;
+
+	if(low == 0) {
+		asm volatile("bsfl %1, %0" : "=r"(index) : "rm"((uint32_t) (mask >> 32)) : "cc");
+		return index + 32;
+	}
+
+	asm volatile("bsfl %1, %0" : "=r"(index) : "rm"(low) : "cc");
+	return index;
+}
+
+/**
+ * timer_enqueue
+ * Puts a timer into the wheel slot that covers its expiry tick.
+ *
+ * @param timer 	The timer to insert. Must not be pending
+ */
+static void timer_enqueue(timer_t *timer) {
+	uint32_t expires = timer->expires;
+	uint32_t delta = expires - wheel_next;
+	uint32_t level = 0;
+	uint32_t slot;
+
+	// Overdue timers go into the slot that is processed next; too distant ones get cascaded down
+	// from the last level until they're close enough
+	if((int32_t) delta < 0) {
+		expires = wheel_next;
+		delta = 0;
+	} else if(delta > TIMER_MAX_TICKS) {
+		expires = wheel_next + TIMER_MAX_TICKS;
+		delta = TIMER_MAX_TICKS;
+	}
+
+	while(level < TIMER_WHEEL_LEVELS - 1 && delta >= (1U << ((level + 1) * TIMER_WHEEL_BITS))) {
+		level++;
+	}
+	slot = (expires >> (level * TIMER_WHEEL_BITS)) & TIMER_WHEEL_MASK;
+
+	timer->next = wheel[level][slot];
+	timer->prev = NULL;
+	if(timer->next != NULL) {
+		timer->next->prev = timer;
+	}
+	wheel[level][slot] = timer;
+	wheel_bitmap[level] |= 1ULL << slot;
+
+	timer->level = level;
+	timer->slot = slot;
+	timer->queued = 1;
+}
+
+/**
+ * timer_dequeue
+ * Takes a timer out of its wheel slot.
+ *
+ * @param timer 	The timer to remove. Must be pending
+ */
+static void timer_dequeue(timer_t *timer) {
+	if(timer->prev != NULL) {
+		timer->prev->next = timer->next;
+	} else {
+		wheel[timer->level][timer->slot] = timer->next;
+		if(timer->next == NULL) {
+			wheel_bitmap[timer->level] &= ~(1ULL << timer->slot);
+		}
+	}
+	if(timer->next != NULL) {
+		timer->next->prev = timer->prev;
+	}
+
+	timer->next = NULL;
+	timer->prev = NULL;
+	timer->queued = 0;
+}
+
+/**
+ * timer_cascade
+ * Moves the timers of one slot down to the lower levels, now that they are close enough.
+ *
+ * @param level 	The level to cascade (1 or higher)
+ * @param slot 		The slot on that level
+ */
+static void timer_cascade(uint32_t level, uint32_t slot) {
+	timer_t *timer;
+
+	while((timer = wheel[level][slot]) != NULL) {
+		timer_dequeue(timer);
+		timer_enqueue(timer);
+		stats.cascaded++;
+	}
+}
+
+/**
+ * timer_init
+ * Empties the timer wheel. Ticks are counted from the PIT's current tick.
+ */
+void timer_init() {
+	uint32_t flags;
+	int level, slot;
+
+	spin_lock_irqsave(&timer_lock, flags);
+
+	for(level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+		for(slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+			wheel[level][slot] = NULL;
+		}
+		wheel_bitmap[level] = 0;
+	}
+	wheel_next = pit_get_ticks() + 1;
+	memset(&stats, 0, sizeof(stats));
+
+	spin_unlock_irqrestore(&timer_lock, flags);
+}
+
+/**
+ * timer_setup
+ * Initializes a timer that isn't pending.
+ *
+ * @param timer 	The timer to initialize
+ * @param callback 	Function to run when the timer fires. Called from the PIT interrupt with interrupts disabled
+ * @param data 		Argument for the callback
+ */
+void timer_setup(timer_t *timer, timer_callback_t callback, void *data) {
+	timer->next = NULL;
+	timer->prev = NULL;
+	timer->queued = 0;
+	timer->callback = callback;
+	timer->data = data;
+}
+
+/**
+ * timer_add
+ * Starts a timer. If the timer is already pending, it is moved to the new deadline.
+ *
+ * @param timer 	The timer to start (set up with timer_setup)
+ * @param expires 	PIT tick the timer fires on. Ticks in the past fire on the next tick
+ */
+void timer_add(timer_t *timer, uint32_t expires) {
+	uint32_t flags;
+	int32_t delta;
+
+	spin_lock_irqsave(&timer_lock, flags);
+
+	if(timer->queued) {
+		timer_dequeue(timer);
+		stats.pending--;
+	}
+
+	timer->expires = expires;
+	timer_enqueue(timer);
+	stats.pending++;
+	stats.added++;
+
+	// The PIT may be set to sleep past the deadline
+	delta = expires - pit_get_ticks();
+	pit_set_next_event(delta > 0 ? delta : 1);
+
+	spin_unlock_irqrestore(&timer_lock, flags);
+}
+
+/**
+ * timer_cancel
+ * Stops a timer before it fires.
+ *
+ * @param timer 	The timer to stop
+ *
+ * @return 			1 if the timer was pending, 0 if it had already fired or was never started
+ */
+int32_t timer_cancel(timer_t *timer) {
+	uint32_t flags;
+
+	spin_lock_irqsave(&timer_lock, flags);
+
+	if(!timer->queued) {
+		spin_unlock_irqrestore(&timer_lock, flags);
+		return 0;
+	}
+
+	timer_dequeue(timer);
+	stats.pending--;
+	stats.cancelled++;
+
+	spin_unlock_irqrestore(&timer_lock, flags);
+	return 1;
+}
+
+/**
+ * timer_pending
+ * Checks whether a timer has been started and hasn't fired or been cancelled yet.
+ *
+ * @param timer 	The timer to check
+ *
+ * @return 			1 if it is pending, 0 otherwise
+ */
+uint8_t timer_pending(timer_t *timer) {
+	return timer->queued;
+}
+
+/**
+ * timer_run
+ * Fires every timer that is due by the given tick, cascading the upper levels as the wheel turns.
+ * Called from the PIT interrupt. With one-shot PIT programming several ticks may have passed since
+ * the last call, so each of them is processed in turn.
+ *
+ * @param now 	The current PIT tick
+ */
+void timer_run(uint32_t now) {
+	uint32_t flags;
+	timer_t *timer;
+	uint32_t slot;
+	uint32_t level;
+
+	spin_lock_irqsave(&timer_lock, flags);
+
+	while((int32_t) (now - wheel_next) >= 0) {
+		slot = wheel_next & TIMER_WHEEL_MASK;
+
+		// Level 0 wrapped around: bring the timers of the next window down, and do the same for
+		// every level above whose own window ends here
+		if(slot == 0) {
+			for(level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+				uint32_t index = (wheel_next >> (level * TIMER_WHEEL_BITS)) & TIMER_WHEEL_MASK;
+				timer_cascade(level, index);
+				if(index != 0) break;
+			}
+		}
+
+		wheel_next++;
+
+		// Dequeue before calling back so the callback can restart the timer. The callback runs
+		// without the lock, since it may wake a process up (and add timers of its own)
+		while((timer = wheel[0][slot]) != NULL) {
+			timer_callback_t callback = timer->callback;
+			void *data = timer->data;
+
+			timer_dequeue(timer);
+			stats.pending--;
+			stats.expired++;
+
+			spin_unlock(&timer_lock);
+			callback(data);
+			spin_lock(&timer_lock);
+		}
+	}
+
+	spin_unlock_irqrestore(&timer_lock, flags);
+}
+
+/**
+ * timer_next_event
+ * Finds out when the PIT next has to interrupt for the timer wheel, so it can sleep until then.
+ *
+ * @param now 	The current PIT tick
+ *
+ * @return 		Ticks from now until the wheel has to run (at least 1), or TIMER_NO_EVENT if no timer is pending
+ */
+uint32_t timer_next_event(uint32_t now) {
+	uint32_t flags;
+	uint32_t deadline = 0;
+	uint32_t level;
+	uint8_t found = 0;
+
+	spin_lock_irqsave(&timer_lock, flags);
+
+	// Level 0 holds exact expiry ticks for the next TIMER_WHEEL_SLOTS ticks. Rotate its bitmap so
+	// that bit 0 is the slot processed next; the lowest set bit is then the next expiry
+	if(wheel_bitmap[0] != 0) {
+		uint32_t shift = wheel_next & TIMER_WHEEL_MASK;
+		uint64_t pending = wheel_bitmap[0];
+
+		if(shift != 0) {
+			pending = (pending >> shift) | (pending << (TIMER_WHEEL_SLOTS - shift));
+		}
+		deadline = wheel_next + lowest_bit(pending);
+		found = 1;
+	}
+
+	// Timers on the upper levels are only looked at again when level 0 wraps around
+	for(level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+		if(wheel_bitmap[level] != 0) {
+			uint32_t wrap = (wheel_next + TIMER_WHEEL_MASK) & ~TIMER_WHEEL_MASK;
+			if(!found || (int32_t) (wrap - deadline) < 0) {
+				deadline = wrap;
+			}
+			found = 1;
+			break;
+		}
+	}
+
+	spin_unlock_irqrestore(&timer_lock, flags);
+
+	if(!found) return TIMER_NO_EVENT;
+	if((int32_t) (deadline - now) <= 0) return 1;
+	return deadline - now;
+}
+
+/**
+ * timer_get_stats
+ * Reports the timer wheel's counters.
+ *
+ * @param stats_out 	Filled in with the counters
+ */
+void timer_get_stats(timer_stats_t *stats_out) {
+	uint32_t flags;
+
+	spin_lock_irqsave(&timer_lock, flags);
+	*stats_out = stats;
+	spin_unlock_irqrestore(&timer_lock, flags);
+}
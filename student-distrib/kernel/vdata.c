@@ -0,0 +1,138 @@
+#include <kernel/vdata.h>
+#include <kernel/sched.h>
+#include <drivers/pit.h>
+#include <arch/x86/cpu.h>
+#include <arch/x86/io.h>
+#include <arch/x86/paging.h>
+#include <arch/x86/smp.h>
+#include <lib/lib.h>
+
+/* A page of kernel data that every process has mapped read-only (see clone_process_kernel), so that
+ * user programs can tell the time without a system call. The PIT handler republishes the tick count
+ * on every interrupt, along with the TSC at the start of that tick. Between interrupts (which can be
+ * up to PIT_MAX_COUNT apart when the CPUs are idle) a reader adds the cycles since tsc_stamp, which
+ * makes the time precise to well under a tick. */
+
+/* Polls of OUT2 before giving up on the TSC calibration */
+#define VDATA_CALIBRATE_TIMEOUT 1000000
+
+/* The page is shared with user programs, so nothing else may live in it */
+static union {
+	vdata_t data;
+	uint8_t pad[FOUR_KB_ALIGNED];
+} page __attribute__((aligned (FOUR_KB_ALIGNED)));
+
+/* TSC cycles per tick, or 0 if the TSC couldn't be calibrated */
+static uint32_t tsc_per_tick = 0;
+
+/**
+ * vdata_calibrate_tsc
+ * Measures how many TSC cycles one tick takes, against PIT channel 2 like lapic_timer_calibrate.
+ * Must be called with interrupts disabled.
+ *
+ * @return      Cycles per tick, or 0 if there is no TSC or the PIT never finished
+ */
+static uint32_t vdata_calibrate_tsc() {
+	uint32_t count = PIT_FREQUENCY / SCHED_TICK_HZ;
+	uint32_t eax, ebx, ecx, edx;
+	uint64_t start;
+	uint64_t end;
+	uint8_t gate;
+	uint32_t waited;
+
+	cpuid(CPUID_FEATURES, eax, ebx, ecx, edx);
+	if(!(edx & CPUID_EDX_TSC)) return 0;
+
+	// Load channel 2 with the gate low, so it doesn't start counting yet, and keep the speaker quiet
+	gate = inportb(PIT_CH2_GATE_PORT);
+	outportb(PIT_CH2_GATE_PORT, gate & ~(PIT_CH2_GATE | PIT_CH2_SPEAKER));
+	outportb(PIT_CMD_REG_PORT, PIT_BINARY_VAL | PIT_CMD_MODE0 | PIT_CMD_RW_BOTH | PIT_CMD_COUNTER2);
+	outportb(PIT_CH2_DATA_PORT, (uint8_t) (count & LOW_EIGHT_BIT_BITMASK));
+	outportb(PIT_CH2_DATA_PORT, (uint8_t) ((count >> 8) & LOW_EIGHT_BIT_BITMASK));
+
+	// Start the countdown and wait for OUT2 to go high at its end
+	outportb(PIT_CH2_GATE_PORT, (gate & ~PIT_CH2_SPEAKER) | PIT_CH2_GATE);
+	rdtsc(start);
+	for(waited = 0; !(inportb(PIT_CH2_GATE_PORT) & PIT_CH2_OUT) && waited < VDATA_CALIBRATE_TIMEOUT; waited++) {
+		cpu_relax();
+	}
+	rdtsc(end);
+
+	outportb(PIT_CH2_GATE_PORT, gate);
+
+	if(waited >= VDATA_CALIBRATE_TIMEOUT) return 0;
+	return (uint32_t) (end - start);
+}
+
+/**
+ * vdata_init
+ * Calibrates the TSC and fills in the data page. Must be called with interrupts disabled, before the
+ * first process is started.
+ */
+void vdata_init() {
+	vdata_t *vdata = &page.data;
+
+	tsc_per_tick = vdata_calibrate_tsc();
+
+	vdata->version = VDATA_VERSION;
+	vdata->tick_hz = SCHED_TICK_HZ;
+	vdata->tsc_khz = tsc_per_tick / (1000 / SCHED_TICK_HZ);
+	vdata_update(pit_get_ticks(), 0);
+}
+
+/**
+ * vdata_update
+ * Publishes the tick count and the scheduler's statistics. Only the PIT's CPU may call it (the
+ * page has a single writer), with interrupts disabled and no scheduler lock held.
+ *
+ * @param ticks     The current tick count
+ * @param partial   How far into that tick we are, in 1/(1 << VDATA_PARTIAL_SHIFT) ticks
+ */
+void vdata_update(uint32_t ticks, uint32_t partial) {
+	vdata_t *vdata = &page.data;
+	sched_cpu_stats_t cpu_stats;
+	uint32_t num_cpus = smp_num_cpus();
+	uint32_t nr_running = 0;
+	uint32_t switches = 0;
+	uint32_t idle_ticks = 0;
+	uint32_t tsc_stamp;
+	uint64_t tsc;
+	uint32_t cpu;
+
+	for(cpu = 0; cpu < num_cpus; cpu++) {
+		sched_get_cpu_stats(cpu, &cpu_stats);
+		nr_running += cpu_stats.nr_running;
+		switches += cpu_stats.switches;
+		idle_ticks += cpu_stats.idle_ticks;
+	}
+
+	// Back-date the TSC to the start of the tick. Split so that neither product overflows
+	rdtsc(tsc);
+	tsc_stamp = (uint32_t) tsc;
+	tsc_stamp -= (tsc_per_tick >> VDATA_PARTIAL_SHIFT) * partial;
+	tsc_stamp -= ((tsc_per_tick & ((1 << VDATA_PARTIAL_SHIFT) - 1)) * partial) >> VDATA_PARTIAL_SHIFT;
+
+	// Readers must see seq turn odd before any field changes, and every field change before it turns even.
+	// x86 doesn't reorder stores with each other, so only the compiler has to be kept from doing so.
+	vdata->seq++;
+	asm volatile("" : : : "memory");
+	vdata->ticks = ticks;
+	vdata->tsc_stamp = tsc_stamp;
+	vdata->num_cpus = num_cpus;
+	vdata->nr_running = nr_running;
+	vdata->switches = switches;
+	vdata->idle_ticks = idle_ticks;
+	asm volatile("" : : : "memory");
+	vdata->seq++;
+}
+
+/**
+ * vdata_get_page
+ * Get the data page, for mapping it into processes. The kernel is identity mapped, so this is also
+ * its physical address.
+ *
+ * @return      The data page
+ */
+vdata_t *vdata_get_page() {
+	return &page.data;
+}
@@ -0,0 +1,150 @@
+#include <kernel/wait_queue.h>
+#include <kernel/sched.h>
+#include <arch/x86/task.h>
+#include <lib/lib.h>
+
+/**
+ * wait_queue_init
+ * Initializes an empty wait queue.
+ *
+ * @param wq 	The wait queue to initialize
+ */
+void wait_queue_init(wait_queue_t *wq) {
+	spin_lock_init(&wq->lock);
+	wq->head = NULL;
+	wq->tail = NULL;
+}
+
+/**
+ * wait_queue_prepare
+ * Puts the current process on a wait queue (unless it's still on it) and marks it as blocked. It
+ * keeps the CPU until wait_queue_sleep, so the caller can check its condition in between.
+ *
+ * @param wq 	The wait queue to sleep on
+ */
+void wait_queue_prepare(wait_queue_t *wq) {
+	uint32_t flags;
+	pcb_t *pcb = get_current_pcb();
+
+	spin_lock_irqsave(&wq->lock, flags);
+
+	// Append to the tail so wake-ups are first come, first served
+	if(pcb->wait_queue != wq) {
+		pcb->wait_next = NULL;
+		if(wq->tail != NULL) {
+			wq->tail->wait_next = pcb;
+		} else {
+			wq->head = pcb;
+		}
+		wq->tail = pcb;
+		pcb->wait_queue = wq;
+	}
+
+	sched_prepare_block();
+
+	spin_unlock_irqrestore(&wq->lock, flags);
+}
+
+/**
+ * wait_queue_sleep
+ * Gives the CPU to someone else after wait_queue_prepare. Returns once another context wakes the
+ * process up with wait_queue_wake_one/all, or right away if that already happened.
+ *
+ * @param wq 	The wait queue the process is on
+ */
+void wait_queue_sleep(wait_queue_t *wq) {
+	// A blocked process is off the run queue, so it costs no CPU time until it's woken
+	sched_block();
+}
+
+/**
+ * wait_queue_finish
+ * Takes the current process off a wait queue once it no longer has to wait, and makes it runnable
+ * again if it was still marked as blocked.
+ *
+ * @param wq 	The wait queue the process was sleeping on
+ */
+void wait_queue_finish(wait_queue_t *wq) {
+	uint32_t flags;
+	pcb_t *pcb = get_current_pcb();
+
+	spin_lock_irqsave(&wq->lock, flags);
+
+	if(pcb->wait_queue == wq) {
+		pcb_t *prev = NULL;
+		pcb_t *cur = wq->head;
+
+		while(cur != pcb) {
+			prev = cur;
+			cur = cur->wait_next;
+		}
+
+		if(prev != NULL) {
+			prev->wait_next = pcb->wait_next;
+		} else {
+			wq->head = pcb->wait_next;
+		}
+		if(wq->tail == pcb) {
+			wq->tail = prev;
+		}
+		pcb->wait_next = NULL;
+		pcb->wait_queue = NULL;
+	}
+
+	sched_cancel_block();
+
+	spin_unlock_irqrestore(&wq->lock, flags);
+}
+
+/**
+ * wait_queue_wake_one
+ * Wakes up the process that has been waiting the longest. Safe to call from interrupt handlers and
+ * from any CPU.
+ *
+ * @param wq 	The wait queue to wake a process from
+ *
+ * @return 		1 if a process was woken, 0 if the queue was empty
+ */
+int32_t wait_queue_wake_one(wait_queue_t *wq) {
+	uint32_t flags;
+	pcb_t *pcb;
+
+	spin_lock_irqsave(&wq->lock, flags);
+
+	pcb = wq->head;
+	if(pcb == NULL) {
+		spin_unlock_irqrestore(&wq->lock, flags);
+		return 0;
+	}
+
+	wq->head = pcb->wait_next;
+	if(wq->head == NULL) {
+		wq->tail = NULL;
+	}
+	pcb->wait_next = NULL;
+	pcb->wait_queue = NULL;
+
+	// Still under the queue's lock, so the process can't have exited in the meantime
+	sched_wake_up(pcb);
+
+	spin_unlock_irqrestore(&wq->lock, flags);
+	return 1;
+}
+
+/**
+ * wait_queue_wake_all
+ * Wakes up every process on a wait queue. Safe to call from interrupt handlers and from any CPU.
+ *
+ * @param wq 	The wait queue to empty
+ *
+ * @return 		The number of processes woken
+ */
+int32_t wait_queue_wake_all(wait_queue_t *wq) {
+	int32_t num_woken = 0;
+
+	while(wait_queue_wake_one(wq)) {
+		num_woken++;
+	}
+
+	return num_woken;
+}
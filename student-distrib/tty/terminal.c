@@ -1,7 +1,7 @@
 #include <lib/circular_buffer.h>
 #include <tty/terminal.h>
 #include <tty/keyboard_map.h>
-#include <arch/x86/i8259.h>
+#include <arch/x86/irq.h>
 #include <kernel/tests.h>
 #include <types.h>
 #include <lib/lib.h>
@@ -9,6 +9,11 @@
 #include <arch/x86/io.h>
 #include <arch/x86/paging.h>
 #include <arch/x86/task.h>
+#include <kernel/wait_queue.h>
+#include <kernel/sched.h>
+#include <kernel/softirq.h>
+#include <arch/x86/smp.h>
+#include <arch/x86/spinlock.h>
 
 static volatile uint8_t keyboard_state[KEYBOARD_SIZE] = {0};
 static volatile uint8_t caps_lock_status = 0;
@@ -16,6 +21,7 @@ static volatile uint8_t caps_lock_status = 0;
 static volatile uint8_t input_buffer_internal[NUM_TERMINALS][KEYBOARD_BUFFER_SIZE];
 static volatile circular_buffer_t input_buffer[NUM_TERMINALS];
 static volatile uint8_t new_line_ready[NUM_TERMINALS];
+static wait_queue_t new_line_wait[NUM_TERMINALS];   // Readers sleep here until new_line_ready becomes nonzero
 
 static volatile uint16_t output_buffer[NUM_TERMINALS][FOUR_KB_ALIGNED] __attribute__((aligned (FOUR_KB_ALIGNED)));
 static volatile uint8_t cursor_location[NUM_TERMINALS][2]; // 2 represents the 2 dimensional (x,y) coordinates we have.
@@ -23,6 +29,26 @@ static volatile uint8_t cursor_location[NUM_TERMINALS][2]; // 2 represents the 2
 static volatile uint8_t active_terminal = 0;
 static volatile uint16_t *video_memory[NUM_TERMINALS] = {(volatile uint16_t*) VIDEO_VIRT_ADDR};
 
+/* One lock per terminal, protecting its input buffer, screen and cursor. Output to one terminal
+ * never waits for another: processes on other CPUs write to their terminals while the keyboard
+ * tasklet echoes on the boot CPU. The CRTC cursor registers belong to whichever terminal is active.
+ * putc and clear_terminal take the lock themselves, so kernel printf is serialized with processes
+ * writing to terminal 0. (Zero-initialized, which is unlocked: printf uses terminal 0 before
+ * multiple_terminal_init.) */
+static spinlock_t terminal_lock[NUM_TERMINALS];
+
+/* Serializes terminal switches. Changing active_terminal also takes the locks of the old and the
+ * new terminal, in index order, so holding a terminal's lock keeps it active or inactive */
+static spinlock_t switch_lock = SPINLOCK_INIT;
+
+/* Scancodes keyboard_handler took from the keyboard controller, until the keyboard tasklet gets to them */
+static uint8_t scancode_buffer_internal[KEYBOARD_SCANCODE_BUFFER_SIZE];
+static circular_buffer_t scancode_buffer;
+static spinlock_t scancode_lock = SPINLOCK_INIT;
+
+static void keyboard_tasklet_func(void *data);
+static tasklet_t keyboard_tasklet = TASKLET_INIT(keyboard_tasklet_func, NULL);
+
 static volatile uint8_t single_terminal = 1;
  
 /** 
@@ -79,6 +105,16 @@ static void set_hardware_cursor(uint8_t terminal_num, uint8_t x, uint8_t y) {
     }
 }
 
+/**
+ * get_active_terminal
+ * Returns the terminal that is on the screen (and receives keyboard input).
+ *
+ * @return  The number terminal (0-2) that is active.
+ */
+uint8_t get_active_terminal() {
+    return active_terminal;
+}
+
 /**
  * switch_active_terminal
  * Switches terminals and does necessary bookkepping (copying buffers, flushing tlb, etc.)
@@ -88,22 +124,49 @@ static void set_hardware_cursor(uint8_t terminal_num, uint8_t x, uint8_t y) {
 void switch_active_terminal(uint8_t new_terminal) {
     if(new_terminal < NUM_TERMINALS) {
         uint32_t flags;
-        cli_and_save(flags);
-
-        memcpy((void*) output_buffer[active_terminal], (void*) VIDEO_PHYS_ADDR, FOUR_KB_ALIGNED);
+        spin_lock_irqsave(&switch_lock, flags);
 
         uint8_t old_terminal = active_terminal;
+        if(old_terminal == new_terminal) {
+            spin_unlock_irqrestore(&switch_lock, flags);
+            return;
+        }
+        spin_lock(&terminal_lock[old_terminal < new_terminal ? old_terminal : new_terminal]);
+        spin_lock(&terminal_lock[old_terminal < new_terminal ? new_terminal : old_terminal]);
+
+        memcpy((void*) output_buffer[old_terminal], (void*) VIDEO_PHYS_ADDR, FOUR_KB_ALIGNED);
         active_terminal = new_terminal;
 
         video_memory[old_terminal] = get_terminal_output_buffer(old_terminal);
         video_memory[new_terminal] = get_terminal_output_buffer(new_terminal);
 
-        flush_tlb();
-
         memcpy((void*) VIDEO_PHYS_ADDR, (void*) output_buffer[active_terminal], FOUR_KB_ALIGNED);
         set_hardware_cursor(active_terminal, cursor_location[active_terminal][0], cursor_location[active_terminal][1]);
 
-        restore_flags(flags);
+        spin_unlock(&terminal_lock[new_terminal]);
+        spin_unlock(&terminal_lock[old_terminal]);
+
+        // The rest only needs switch_lock: it scales with the number of processes, so it mustn't
+        // hold up output to the terminals. Point the vidmap pages of both terminals' processes at
+        // their new screens. Only the one page changes, so at most one TLB entry is dropped instead
+        // of the whole TLB.
+        {
+            uint32_t i;
+            for(i = 0; i < get_num_slots(); i++) {
+                pcb_t *pcb = get_pcb_from_slot(i);
+                if(pcb->in_use && (pcb->terminal_num == old_terminal || pcb->terminal_num == new_terminal)) {
+                    set_process_vmem_page(i, get_terminal_output_buffer(pcb->terminal_num));
+                }
+            }
+
+            // Those processes may be running on (or still loaded by) other CPUs
+            smp_flush_tlb_others();
+        }
+
+        // Processes on the terminal the user is looking at get a priority boost
+        sched_foreground_changed();
+
+        spin_unlock_irqrestore(&switch_lock, flags);
 
     }
 }
@@ -186,6 +249,7 @@ static uint8_t keyboard_putc(uint8_t terminal_num, uint8_t ch) {
 
         // We read a new line
         new_line_ready[terminal_num]++;
+        wait_queue_wake_all(&new_line_wait[terminal_num]);
 
     } else if(ch == '\t') {
         // Check if there's space for at least 2 bytes (because we also need new line character)
@@ -230,8 +294,8 @@ static uint8_t keyboard_putc(uint8_t terminal_num, uint8_t ch) {
 }
 
 /*
- * putc
- * Outputs a character to the screen. Scrolls screen vertically if necessary.
+ * putc_internal
+ * Outputs a character to the screen. Scrolls screen vertically if necessary. The terminal's lock must be held.
  * 
  * @param ch  The character to output to the screen
  */
@@ -281,19 +345,23 @@ void putc_internal(uint8_t terminal_num, uint8_t ch) {
 
 /**
  * putc
- * Outputs a character to terminal 0.
+ * Outputs a character to terminal 0, taking its lock.
  *
  * @param ch  the character to output.
  */
 void putc(uint8_t ch) {
+    uint32_t flags;
+
+    spin_lock_irqsave(&terminal_lock[0], flags);
     putc_internal(0, ch);
+    spin_unlock_irqrestore(&terminal_lock[0], flags);
 }
 
 /*
- * clear_terminal
- * Clears the terminal
+ * clear_terminal_locked
+ * Clears the terminal. The terminal's lock must be held.
  */
-void clear_terminal(uint8_t terminal_num) {
+static void clear_terminal_locked(uint8_t terminal_num) {
 
     // 16-bit word representing space with black background and white foreground
     uint16_t blank_word = ' ' | (TERMINAL_FOREGROUND_COLOR | TERMINAL_BACKGROUND_COLOR);
@@ -304,85 +372,146 @@ void clear_terminal(uint8_t terminal_num) {
 }
 
 /*
- * keyboard_handler
- * runs when keyboard Interrupt happens. Outputs keys pressed. Can also run tests (Ctrl+1 to Ctrl+5)
+ * clear_terminal
+ * Clears the terminal, taking its lock.
  */
-void keyboard_handler() {
+void clear_terminal(uint8_t terminal_num) {
     uint32_t flags;
-    cli_and_save(flags);
 
+    spin_lock_irqsave(&terminal_lock[terminal_num], flags);
+    clear_terminal_locked(terminal_num);
+    spin_unlock_irqrestore(&terminal_lock[terminal_num], flags);
+}
+
+/*
+ * keyboard_process_scancode
+ * Handles one key press or release: updates the key state, runs tests (Ctrl+0 to Ctrl+9), switches
+ * terminals (Alt+F1 to Alt+F3) and echoes printable keys to the active terminal. Called by the
+ * keyboard tasklet, with interrupts enabled.
+ *
+ * @param scancode  The byte the keyboard controller sent
+ */
+static void keyboard_process_scancode(uint8_t scancode) {
+    int8_t keycode = (int8_t) scancode;
     uint8_t terminal_num = active_terminal;
-    uint8_t status;
-    do {
-        // Check keyboard status
-        status = inportb(KEYBOARD_STATUS_PORT);
+    uint32_t flags;
 
-        // If this bit is set, data is available
-        if(status & 0x01) {
-            int8_t keycode = (int8_t) inportb(KEYBOARD_DATA_PORT);
-
-            // If there's an escape code, we can just drop the keycode
-            // Reference: http://www.win.tue.nl/~aeb/linux/kbd/scancodes-1.html#ss1.5
-            if((uint8_t) keycode == KEYBOARD_ESCAPE_CODE) continue;
-
-            if(keycode < 0) {
-                // Key released
-                keyboard_state[keycode & KEYCODE_MASK] = 0;
-            } else {
-                // Key pressed
-                keyboard_state[keycode & KEYCODE_MASK] = 1;
-
-                // Handle special keys, then print if printable
-                uint8_t ctrl_pressed = keyboard_state[KEYBOARD_CTRL];
-                uint8_t alt_pressed = keyboard_state[KEYBOARD_ALT];
-                uint8_t shift_pressed = keyboard_state[KEYBOARD_LEFT_SHIFT] || keyboard_state[KEYBOARD_RIGHT_SHIFT];
-
-                int map_index = shift_pressed | (caps_lock_status << 1);
-                uint8_t pressed_char = keyboard_map[map_index][(int) keycode];
-
-                // Toggle caps lock if necessary
-                if(keycode == KEYBOARD_CAPS_LOCK) {
-                    caps_lock_status = !caps_lock_status;
-                }
+    // If there's an escape code, we can just drop the keycode
+    // Reference: http://www.win.tue.nl/~aeb/linux/kbd/scancodes-1.html#ss1.5
+    if(scancode == KEYBOARD_ESCAPE_CODE) return;
 
-                // Run test suite for Ctrl+1 to Ctrl+5
-                if (ctrl_pressed && pressed_char >= '1' && pressed_char <= '5'){
-                    test_suite(pressed_char - '0');
-                }
+    if(keycode < 0) {
+        // Key released
+        keyboard_state[keycode & KEYCODE_MASK] = 0;
+        return;
+    }
 
-                if (alt_pressed && keycode >= KEYBOARD_F1 && keycode < KEYBOARD_F1 + NUM_TERMINALS) {
-                    switch_active_terminal(keycode - KEYBOARD_F1);
-                }
+    // Key pressed
+    keyboard_state[keycode & KEYCODE_MASK] = 1;
 
-                // Ctrl+L should clear the screen and place cursor at the top, but not clear the buffer
-                if(ctrl_pressed && pressed_char == 'l') {
-                    int i;
-                    uint8_t current_buf[KEYBOARD_BUFFER_SIZE];
-                    uint32_t len = circular_buffer_peek((circular_buffer_t*) &input_buffer[terminal_num], current_buf, KEYBOARD_BUFFER_SIZE);
+    // Handle special keys, then print if printable
+    uint8_t ctrl_pressed = keyboard_state[KEYBOARD_CTRL];
+    uint8_t alt_pressed = keyboard_state[KEYBOARD_ALT];
+    uint8_t shift_pressed = keyboard_state[KEYBOARD_LEFT_SHIFT] || keyboard_state[KEYBOARD_RIGHT_SHIFT];
 
-                    clear_terminal(terminal_num);
+    int map_index = shift_pressed | (caps_lock_status << 1);
+    uint8_t pressed_char = keyboard_map[map_index][(int) keycode];
 
-                    for(i = 0; i < len; i++) {
-                        putc_internal(terminal_num, current_buf[i]);
-                    }
-                }
+    // Toggle caps lock if necessary
+    if(keycode == KEYBOARD_CAPS_LOCK) {
+        caps_lock_status = !caps_lock_status;
+    }
 
-                // Ctrl/Alt key combos aren't printable
-                if(ctrl_pressed || alt_pressed) {
-                    pressed_char = 0;
-                }
+    // Run test suite for Ctrl+1 to Ctrl+9, and Ctrl+0 for test 10. The tests expect to run with
+    // interrupts disabled, as they did from the interrupt handler.
+    if (ctrl_pressed && pressed_char >= '0' && pressed_char <= '9'){
+        cli_and_save(flags);
+        test_suite(pressed_char == '0' ? 10 : pressed_char - '0');
+        restore_flags(flags);
+    }
 
-                // Print to screen
-                if(pressed_char > 0) {
-                    keyboard_putc(terminal_num, pressed_char);
-                }
-            }
+    if (alt_pressed && keycode >= KEYBOARD_F1 && keycode < KEYBOARD_F1 + NUM_TERMINALS) {
+        switch_active_terminal(keycode - KEYBOARD_F1);
+        terminal_num = active_terminal;
+    }
+
+    // Ctrl+L should clear the screen and place cursor at the top, but not clear the buffer
+    if(ctrl_pressed && pressed_char == 'l') {
+        int i;
+        uint8_t current_buf[KEYBOARD_BUFFER_SIZE];
+        uint32_t len;
+
+        spin_lock_irqsave(&terminal_lock[terminal_num], flags);
+        len = circular_buffer_peek((circular_buffer_t*) &input_buffer[terminal_num], current_buf, KEYBOARD_BUFFER_SIZE);
+
+        clear_terminal_locked(terminal_num);
+
+        for(i = 0; i < len; i++) {
+            putc_internal(terminal_num, current_buf[i]);
+        }
+        spin_unlock_irqrestore(&terminal_lock[terminal_num], flags);
+    }
+
+    // Ctrl/Alt key combos aren't printable
+    if(ctrl_pressed || alt_pressed) {
+        pressed_char = 0;
+    }
+
+    // Print to screen
+    if(pressed_char > 0) {
+        spin_lock_irqsave(&terminal_lock[terminal_num], flags);
+        keyboard_putc(terminal_num, pressed_char);
+        spin_unlock_irqrestore(&terminal_lock[terminal_num], flags);
+    }
+}
+
+/*
+ * keyboard_tasklet_func
+ * Processes the scancodes keyboard_handler queued, oldest first, with interrupts enabled. Scancodes
+ * that arrive meanwhile are processed too.
+ *
+ * @param data  Unused
+ */
+static void keyboard_tasklet_func(void *data) {
+    uint32_t flags;
+    uint8_t scancode;
+
+    for(;;) {
+        spin_lock_irqsave(&scancode_lock, flags);
+        if(!circular_buffer_get_byte(&scancode_buffer, &scancode)) {
+            spin_unlock_irqrestore(&scancode_lock, flags);
+            return;
+        }
+        spin_unlock_irqrestore(&scancode_lock, flags);
+
+        keyboard_process_scancode(scancode);
+    }
+}
+
+/*
+ * keyboard_handler
+ * Runs when a keyboard interrupt happens. Only drains the keyboard controller into the scancode
+ * buffer; the keys are handled by the keyboard tasklet once interrupts are enabled again.
+ */
+void keyboard_handler() {
+    uint8_t status;
+
+    spin_lock(&scancode_lock);
+    do {
+        // Check keyboard status
+        status = inportb(KEYBOARD_STATUS_PORT);
+
+        // If this bit is set, data is available. If the tasklet is that far behind, drop the key.
+        if(status & 0x01) {
+            circular_buffer_put_byte(&scancode_buffer, inportb(KEYBOARD_DATA_PORT));
         }
     } while (status & 0x01);
-    
+    spin_unlock(&scancode_lock);
+
     // Acknowledge interrupt
     send_eoi(KEYBOARD_IRQ);
-    restore_flags(flags);
+
+    tasklet_schedule(&keyboard_tasklet);
 }
 
 /**
@@ -393,14 +522,14 @@ void keyboard_handler() {
  */
 void reset_terminal(uint8_t terminal_num) {
     uint32_t flags;
-    cli_and_save(flags);
+    spin_lock_irqsave(&terminal_lock[terminal_num], flags);
 
     circular_buffer_init((circular_buffer_t*) &input_buffer[terminal_num], (void*) input_buffer_internal[terminal_num], KEYBOARD_BUFFER_SIZE);
-    clear_terminal(terminal_num);
+    clear_terminal_locked(terminal_num);
     new_line_ready[terminal_num] = 0;
     set_hardware_cursor(terminal_num, 0, 0);
 
-    restore_flags(flags);
+    spin_unlock_irqrestore(&terminal_lock[terminal_num], flags);
 }
 
 /**
@@ -408,19 +537,17 @@ void reset_terminal(uint8_t terminal_num) {
  * Initializes all 3 terminals.
  */
 void multiple_terminal_init() {
-    uint32_t flags;
-    cli_and_save(flags);
-
     int i;
     for(i = 0; i < NUM_TERMINALS; i++) {
         video_memory[i] = get_terminal_output_buffer(i);
+        wait_queue_init(&new_line_wait[i]);
         reset_terminal(i);
     }
 
+    circular_buffer_init(&scancode_buffer, scancode_buffer_internal, KEYBOARD_SCANCODE_BUFFER_SIZE);
+
     single_terminal = 0;
     enable_irq(KEYBOARD_IRQ);
-
-    restore_flags(flags);
 }
 
 // Keyboard syscalls
@@ -437,14 +564,14 @@ int32_t terminal_open(file_t *f, const int8_t *filename) {
     uint8_t terminal_num = get_process_terminal();
 
     uint32_t flags;
-    cli_and_save(flags);
+    spin_lock_irqsave(&terminal_lock[terminal_num], flags);
 
     // Clear buffer and screen, then enable keyboard interrupts
     circular_buffer_init((circular_buffer_t*) &input_buffer[terminal_num], (void*) input_buffer_internal[terminal_num], KEYBOARD_BUFFER_SIZE);
-    clear_terminal(terminal_num); // Rodney: a situation may arise where we don't want to clear the terminal.
-    enable_irq(KEYBOARD_IRQ);
+    clear_terminal_locked(terminal_num); // Rodney: a situation may arise where we don't want to clear the terminal.
 
-    restore_flags(flags);
+    spin_unlock_irqrestore(&terminal_lock[terminal_num], flags);
+    enable_irq(KEYBOARD_IRQ);
     return 0;
 }
 
@@ -460,12 +587,12 @@ int32_t terminal_close(file_t *f) {
     uint8_t terminal_num = get_process_terminal();
 
     uint32_t flags;
-    cli_and_save(flags);
+    spin_lock_irqsave(&terminal_lock[terminal_num], flags);
 
     circular_buffer_clear((circular_buffer_t*) &input_buffer[terminal_num]);
     //clear_terminal();
 
-    restore_flags(flags);
+    spin_unlock_irqrestore(&terminal_lock[terminal_num], flags);
     // disable_irq(KEYBOARD_IRQ);
     return 0;
 }
@@ -486,37 +613,40 @@ int32_t terminal_read(file_t *f, void *buf, int32_t nbytes) {
     uint32_t retval;
     uint32_t max_len;
     uint32_t flags;
+    uint8_t line[KEYBOARD_BUFFER_SIZE];
 
-    // We're in a system call, so interrupts have been disabled.
-    // We need to temporarily enable interrupts so that we can
-    // actually fill the keyboard buffer.
-    cli_and_save(flags);
-    sti();
+    // Sleep until the keyboard handler sees the Enter key. Other processes run in the meantime.
+    // Another reader of the same terminal may take the line first, so check again under the lock.
+    for(;;) {
+        wait_event(&new_line_wait[terminal_num], new_line_ready[terminal_num]);
 
-    // Wait for Enter key
-    while (!new_line_ready[terminal_num]) {
-        asm volatile("hlt");
+        spin_lock_irqsave(&terminal_lock[terminal_num], flags);
+        if(new_line_ready[terminal_num]) break;
+        spin_unlock_irqrestore(&terminal_lock[terminal_num], flags);
     }
 
-    cli();
-
     // Read up to min(nbytes, number of bytes available in buffered line)
     max_len = circular_buffer_find((circular_buffer_t*) &input_buffer[terminal_num], '\n') + 1;
     if(max_len < nbytes){
         nbytes = max_len;
     }
-    retval = circular_buffer_get((circular_buffer_t*) &input_buffer[terminal_num], buf, nbytes);
+    retval = circular_buffer_get((circular_buffer_t*) &input_buffer[terminal_num], line, nbytes);
 
     // We read one new line
     new_line_ready[terminal_num]--;
     
-    restore_flags(flags);
+    spin_unlock_irqrestore(&terminal_lock[terminal_num], flags);
+
+    // Touching the user's buffer may fault, so only once the lock is released
+    memcpy(buf, line, retval);
     return retval;
 }
 
 /*
  * terminal_write
- * Writes nbytes from provided buffer to screen
+ * Writes nbytes from provided buffer to screen. Only the process's own terminal is locked, a chunk
+ * at a time, and from the write system call this CPU takes its pending interrupts between chunks,
+ * so a long write delays neither the other terminals nor the keyboard, RTC and scheduler.
  * 
  * @param fd     For now, ignored.
  * @param buf    This is where we get the bytes to write to the screen
@@ -527,16 +657,29 @@ int32_t terminal_read(file_t *f, void *buf, int32_t nbytes) {
 int32_t terminal_write(file_t *f, const void *buf, int32_t nbytes) {
     // TODO: something with the fd
     int i;
+    int32_t done;
     uint32_t flags;
-    cli_and_save(flags);
+    uint8_t chunk[TERMINAL_WRITE_CHUNK];
 
-    pcb_t *pcb = get_current_pcb();
+    uint8_t terminal_num = get_current_pcb()->terminal_num;
 
-    // Write characters to screen
-    for(i = 0; i < nbytes; i++) {
-        putc_internal(pcb->terminal_num, ((uint8_t*)buf)[i]);
-    }
+    // Write characters to screen. They are copied out of the user's buffer first, since touching
+    // it may fault, which mustn't happen with the lock held.
+    for(done = 0; done < nbytes; done += TERMINAL_WRITE_CHUNK) {
+        int32_t len = (nbytes - done < TERMINAL_WRITE_CHUNK) ? nbytes - done : TERMINAL_WRITE_CHUNK;
+        memcpy(chunk, (uint8_t*) buf + done, len);
+
+        spin_lock_irqsave(&terminal_lock[terminal_num], flags);
+        for(i = 0; i < len; i++) {
+            putc_internal(terminal_num, chunk[i]);
+        }
+        spin_unlock_irqrestore(&terminal_lock[terminal_num], flags);
 
-    restore_flags(flags);
+        // The kernel runs with interrupts off, so without this they would wait for the whole write.
+        // Kernel callers (the tests) pass no file and may be inside an interrupt handler themselves.
+        if(f != NULL && done + len < nbytes) {
+            interrupt_window();
+        }
+    }
     return nbytes;
 }
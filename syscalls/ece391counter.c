@@ -8,6 +8,7 @@
 int main ()
 {
     uint32_t i, cnt, max = 0;
+    uint32_t start;
     uint8_t buf[BUFSIZE];
 
     ece391_fdputs(1, (uint8_t*)"Enter the Test Number: (0): 100, (1): 10000, (2): 100000\n");
@@ -34,12 +35,19 @@ int main ()
         }
     }
 
+    /* Read from the kernel data page, so timing costs no system calls */
+    start = ece391_uptime_ms();
     for (i = 0; i < max; i++) {
         ece391_itoa(i+1, buf, 10);
         ece391_fdputs(1, buf);
         ece391_fdputs(1, (uint8_t*)"\n");
     }
 
+    ece391_fdputs(1, (uint8_t*)"Took ");
+    ece391_itoa(ece391_uptime_ms() - start, buf, 10);
+    ece391_fdputs(1, buf);
+    ece391_fdputs(1, (uint8_t*)" ms\n");
+
     return 0;
 }
 
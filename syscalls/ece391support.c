@@ -102,3 +102,41 @@ uint8_t* ece391_strrev(uint8_t* s)
    return s;
 }
 
+/* Copy the kernel data page, retrying if the kernel updated it meanwhile */
+void ece391_vdata_read(ece391_vdata_t* out)
+{
+    const volatile uint32_t* src = (const volatile uint32_t*)ECE391_VDATA_ADDR;
+    uint32_t* dst = (uint32_t*)out;
+    uint32_t i;
+
+    do {
+        dst[0] = src[0];
+        for (i = 1; i < sizeof(*out) / sizeof(uint32_t); i++) {
+            dst[i] = src[i];
+        }
+    } while ((dst[0] & 1) || dst[0] != src[0]);
+}
+
+/* Milliseconds since boot, read from the kernel data page (no system call) */
+uint32_t ece391_uptime_ms(void)
+{
+    ece391_vdata_t vdata;
+    uint32_t cycles;
+    uint32_t ms;
+
+    ece391_vdata_read(&vdata);
+    if (vdata.tick_hz == 0) {
+        return 0;
+    }
+    ms = vdata.ticks * (1000 / vdata.tick_hz);
+
+    /* Add the time since the start of that tick, if the TSC is calibrated */
+    if (vdata.tsc_khz != 0) {
+        asm volatile ("rdtsc" : "=a"(cycles) : : "edx");
+        cycles -= vdata.tsc_stamp;
+        if ((int32_t)cycles > 0) {
+            ms += cycles / vdata.tsc_khz;
+        }
+    }
+    return ms;
+}
@@ -0,0 +1,64 @@
+#include <stdint.h>
+
+#include "ece391support.h"
+#include "ece391syscall.h"
+
+#define ITERATIONS 10000
+#define ROUNDS     5
+
+/* Low half of the time-stamp counter */
+static uint32_t rdtsc ()
+{
+    uint32_t low, high;
+
+    asm volatile ("rdtsc" : "=a" (low), "=d" (high));
+    return low;
+}
+
+/*
+ * Cycles per round trip of a system call that does no work (close of an
+ * invalid descriptor), with the current entry method. The fastest of a
+ * few rounds is taken, so that interrupts and context switches drop out.
+ */
+static uint32_t measure ()
+{
+    uint32_t round, i, start, cycles, best = 0xFFFFFFFF;
+
+    for (round = 0; round < ROUNDS; round++) {
+        start = rdtsc ();
+        for (i = 0; i < ITERATIONS; i++)
+            (void)ece391_close (-1);
+        cycles = rdtsc () - start;
+        if (cycles < best)
+            best = cycles;
+    }
+    return best / ITERATIONS;
+}
+
+static void print_result (const char* method, uint32_t cycles)
+{
+    uint8_t buf[16];
+
+    ece391_fdputs (1, (uint8_t*)method);
+    ece391_itoa (cycles, buf, 10);
+    ece391_fdputs (1, buf);
+    ece391_fdputs (1, (uint8_t*)" cycles per call\n");
+}
+
+int main ()
+{
+    int32_t has_sysenter = ece391_use_sysenter;
+
+    ece391_use_sysenter = 0;
+    print_result ("INT $0x80: ", measure ());
+
+    if (!has_sysenter) {
+        ece391_fdputs (1, (uint8_t*)"sysenter:  not supported by this CPU\n");
+        return 0;
+    }
+
+    ece391_use_sysenter = 1;
+    print_result ("sysenter:  ", measure ());
+
+    return 0;
+}